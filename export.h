@@ -0,0 +1,93 @@
+// MicroComputer screen export
+// What --export-shm and --export-port publish, shared by the emulator and
+// viewers such as fs/watch.c. Both carry the visible screen of each
+// machine: 80x25 text cells with their colors, and the 320x200 pixel
+// framebuffer with rows of 40 bytes at 1 bpp or 160 bytes at 4 bpp.
+//
+// Shared memory: one segment per machine, named NAME.N for machine N (the
+// window's machine or a single headless run is 0, pool workers are 0 up),
+// holding an ExportScreen. The emulator makes seq odd, updates the frame
+// and makes seq even again; a viewer copies the frame and keeps the copy
+// if seq read the same even number before and after.
+//
+// Stream: a viewer connects to the TCP port and reads messages of
+//
+//     u32 length of the rest, u8 type, u8 machine, ExportState, spans
+//
+// all little-endian. EXPORT_KEY holds the whole screen, EXPORT_DELTA
+// only what changed since that machine's previous message, EXPORT_GONE
+// (no state, no spans) says the machine stopped. Every viewer starts with
+// a key frame of each machine. A span is
+//
+//     u8 plane, u8 row, u16 start, u16 end, RLE data
+//
+// covering bytes [start, end) of one row of chars, colors or pixels. The
+// data is PackBits: a header h < 128 is followed by h + 1 literal bytes,
+// h > 128 by one byte repeated 257 - h times.
+
+#ifndef MICROCOMPUTER_EXPORT_H
+#define MICROCOMPUTER_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EXPORT_TEXT_WIDTH   80
+#define EXPORT_TEXT_HEIGHT  25
+#define EXPORT_PIXEL_HEIGHT 200
+#define EXPORT_PIXEL_BYTES  32000
+
+#define EXPORT_MAGIC        "MSCR"
+#define EXPORT_VERSION      1
+
+// Message types
+#define EXPORT_KEY          0
+#define EXPORT_DELTA        1
+#define EXPORT_GONE         2
+
+// Span planes
+#define EXPORT_CHARS        0
+#define EXPORT_COLORS       1
+#define EXPORT_PIXELS       2
+
+typedef struct {
+    uint8_t pixel_mode;
+    uint8_t pixel_depth;        // 1 or 4
+    uint8_t cursor_visible;
+    uint8_t cursor_x;
+    uint8_t cursor_y;
+    uint8_t reserved[3];
+} ExportState;
+
+typedef struct {
+    char magic[4];                  // EXPORT_MAGIC
+    uint32_t version;               // EXPORT_VERSION
+    volatile uint32_t seq;          // odd while a frame is being written
+    uint32_t frames;                // frames written so far
+    ExportState state;
+    char chars[EXPORT_TEXT_HEIGHT][EXPORT_TEXT_WIDTH];
+    uint8_t colors[EXPORT_TEXT_HEIGHT][EXPORT_TEXT_WIDTH];
+    uint8_t pixels[EXPORT_PIXEL_BYTES];
+} ExportScreen;
+
+// Decode PackBits from src[0, n) into exactly len bytes of dst; returns
+// the number of bytes of src used, or 0 if src is short or overflows dst
+static inline size_t export_unrle(const uint8_t *src, size_t n, uint8_t *dst, size_t len) {
+    size_t in = 0, out = 0;
+    while (out < len) {
+        if (in >= n) return 0;
+        uint8_t h = src[in++];
+        if (h < 128) {
+            size_t count = (size_t)h + 1;
+            if (in + count > n || out + count > len) return 0;
+            for (size_t i = 0; i < count; i++) dst[out++] = src[in++];
+        } else if (h > 128) {
+            size_t count = 257 - (size_t)h;
+            if (in >= n || out + count > len) return 0;
+            for (size_t i = 0; i < count; i++) dst[out++] = src[in];
+            in++;
+        }
+    }
+    return in;
+}
+
+#endif
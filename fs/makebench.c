@@ -0,0 +1,224 @@
+/*
+ * Microbenchmark Generator for MicroComputer
+ * Creates small programs that each hammer one part of the emulator
+ * Compile: gcc -o makebench makebench.c
+ * Run: ./makebench
+ * Output: bench_alu.bin, bench_mem.bin, bench_call.bin, bench_pixel.bin
+ *         (run each with: microemu --headless --run bench_alu.bin)
+ *
+ * Every program is a fixed number of iterations ending in HALT, so the
+ * instruction count of a run is the same on every engine and machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../opcodes.h"
+
+// Register conventions shared by all benchmarks
+#define R_ONE   6       // holds 1
+#define R_ZERO  5       // holds 0
+
+typedef struct {
+    uint8_t data[64 * 1024];
+    size_t size;
+} Program;
+
+void emit_byte(Program *p, uint8_t byte) {
+    p->data[p->size++] = byte;
+}
+
+void emit_word(Program *p, uint16_t word) {
+    emit_byte(p, word & 0xFF);
+    emit_byte(p, (word >> 8) & 0xFF);
+}
+
+void pad_to(Program *p, size_t addr) {
+    while (p->size < addr) emit_byte(p, OP_HALT);
+}
+
+void load_reg(Program *p, uint8_t reg, uint16_t value) {
+    emit_byte(p, OP_LOAD_REG);
+    emit_byte(p, reg);
+    emit_word(p, value);
+}
+
+void alu(Program *p, uint8_t op, uint8_t dst, uint8_t src1, uint8_t src2) {
+    emit_byte(p, op);
+    emit_byte(p, dst);
+    emit_byte(p, src1);
+    emit_byte(p, src2);
+}
+
+// SHL/SHR shift dst by src in place
+void shift(Program *p, uint8_t op, uint8_t dst, uint8_t src) {
+    emit_byte(p, op);
+    emit_byte(p, dst);
+    emit_byte(p, src);
+}
+
+void jump(Program *p, uint8_t op, uint16_t addr) {
+    emit_byte(p, op);
+    emit_word(p, addr);
+}
+
+// Count reg down by one and jump back to top until it reaches zero
+void loop_end(Program *p, uint8_t reg, uint16_t top) {
+    alu(p, OP_SUB, reg, reg, R_ONE);
+    emit_byte(p, OP_CMP);
+    emit_byte(p, reg);
+    emit_byte(p, R_ZERO);
+    jump(p, OP_JNZ, top);
+}
+
+void prologue(Program *p) {
+    load_reg(p, R_ONE, 1);
+    load_reg(p, R_ZERO, 0);
+}
+
+// 300 x 10000 iterations of a register-only mix
+void bench_alu(Program *p) {
+    prologue(p);
+    load_reg(p, 4, 3);
+    load_reg(p, 2, 300);
+    uint16_t outer = (uint16_t)p->size;
+    load_reg(p, 0, 10000);
+    uint16_t inner = (uint16_t)p->size;
+    alu(p, OP_ADD, 1, 1, 0);
+    alu(p, OP_XOR, 3, 3, 1);
+    alu(p, OP_MUL, 7, 3, 4);
+    shift(p, OP_SHL, 1, 4);
+    shift(p, OP_SHR, 3, 4);
+    alu(p, OP_AND, 7, 7, 1);
+    alu(p, OP_OR, 3, 3, 7);
+    loop_end(p, 0, inner);
+    loop_end(p, 2, outer);
+    emit_byte(p, OP_HALT);
+}
+
+// 4 KiB block copies, then a word load/add/store loop
+void bench_mem(Program *p) {
+    prologue(p);
+    load_reg(p, 0, 2000);
+    uint16_t copy = (uint16_t)p->size;
+    emit_byte(p, OP_COPY_MEM);
+    emit_word(p, 0x4000);
+    emit_word(p, 0x6000);
+    emit_word(p, 0x1000);
+    emit_byte(p, OP_COPY_MEM);
+    emit_word(p, 0x6000);
+    emit_word(p, 0x4001);
+    emit_word(p, 0x1000);
+    loop_end(p, 0, copy);
+
+    load_reg(p, 2, 100);
+    uint16_t outer = (uint16_t)p->size;
+    load_reg(p, 0, 10000);
+    uint16_t inner = (uint16_t)p->size;
+    emit_byte(p, OP_LOAD_MEM);
+    emit_byte(p, 1);
+    emit_word(p, 0x4000);
+    alu(p, OP_ADD, 1, 1, 0);
+    emit_byte(p, OP_STORE_MEM);
+    emit_word(p, 0x4000);
+    emit_byte(p, 1);
+    loop_end(p, 0, inner);
+    loop_end(p, 2, outer);
+    emit_byte(p, OP_HALT);
+}
+
+// Two-deep CALL/RET chains. RET takes the pushed return address with its
+// bytes swapped, so each CALL is placed to return to an address whose two
+// bytes are equal (0x0101, 0x0202) and comes back where it should.
+void bench_call(Program *p) {
+    prologue(p);
+    load_reg(p, 2, 200);
+    uint16_t outer = (uint16_t)p->size;
+    load_reg(p, 0, 10000);
+    jump(p, OP_JMP, 0x00FE - 4);
+
+    pad_to(p, 0x00FE - 4);
+    uint16_t inner = (uint16_t)p->size;
+    alu(p, OP_ADD, 1, 1, R_ONE);
+    jump(p, OP_CALL, 0x01FF - 4);        // returns to 0x0101
+    loop_end(p, 0, inner);
+    loop_end(p, 2, outer);
+    emit_byte(p, OP_HALT);
+
+    pad_to(p, 0x01FF - 4);
+    alu(p, OP_XOR, 3, 3, 1);
+    jump(p, OP_CALL, 0x0300);           // returns to 0x0202
+    emit_byte(p, OP_RET);
+
+    pad_to(p, 0x0300);
+    alu(p, OP_ADD, 7, 7, 3);
+    emit_byte(p, OP_RET);
+}
+
+// Single pixels, small fills, full-screen lines and a moving sprite
+void bench_pixel(Program *p) {
+    static const uint8_t sprite[8] = {0x3C, 0x42, 0xA5, 0x81, 0xA5, 0x99, 0x42, 0x3C};
+    uint16_t sprite_addr = 0x2000;
+
+    prologue(p);
+    load_reg(p, 1, 0);
+    load_reg(p, 3, 96);
+    load_reg(p, 0, 50000);
+    uint16_t top = (uint16_t)p->size;
+    emit_byte(p, OP_SET_PIXEL);
+    emit_word(p, 10);
+    emit_word(p, 10);
+    emit_byte(p, 1);
+    emit_byte(p, OP_FILL_RECT);
+    emit_word(p, 40);
+    emit_word(p, 40);
+    emit_word(p, 32);
+    emit_word(p, 32);
+    emit_byte(p, OP_DRAW_LINE);
+    emit_word(p, 0);
+    emit_word(p, 0);
+    emit_word(p, 319);
+    emit_word(p, 199);
+    emit_byte(p, OP_DRAW_SPRITE_REG);
+    emit_word(p, sprite_addr);
+    emit_byte(p, 1);
+    emit_byte(p, 3);
+    emit_byte(p, 8);
+    emit_byte(p, 8);
+    emit_byte(p, 0x01);
+    alu(p, OP_ADD, 1, 1, R_ONE);
+    loop_end(p, 0, top);
+    emit_byte(p, OP_HALT);
+
+    pad_to(p, sprite_addr);
+    memcpy(p->data + p->size, sprite, sizeof(sprite));
+    p->size += sizeof(sprite);
+}
+
+static int write_program(const char *filename, void (*build)(Program *)) {
+    static Program p;
+    memset(&p, 0, sizeof(p));
+    build(&p);
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: Could not create %s\n", filename);
+        return -1;
+    }
+    fwrite(p.data, 1, p.size, f);
+    fclose(f);
+    printf("Created %s (%zu bytes)\n", filename, p.size);
+    return 0;
+}
+
+int main(void) {
+    if (write_program("bench_alu.bin", bench_alu) != 0 ||
+        write_program("bench_mem.bin", bench_mem) != 0 ||
+        write_program("bench_call.bin", bench_call) != 0 ||
+        write_program("bench_pixel.bin", bench_pixel) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -12,34 +12,7 @@
 #include <string.h>
 #include <math.h>
 
-// Opcodes
-#define OP_HALT         0x00
-#define OP_PRINT_CHAR   0x01
-#define OP_PRINT_STR    0x02
-#define OP_CLEAR_SCREEN 0x04
-#define OP_SLEEP_MS     0x20
-#define OP_BEEP         0x21
-#define OP_SET_PIXEL    0x30
-#define OP_CLEAR_PIXELS 0x31
-#define OP_LOAD_REG     0x40
-#define OP_STORE_REG    0x41
-#define OP_ADD          0x50
-#define OP_SUB          0x51
-#define OP_MUL          0x52
-#define OP_DIV          0x53
-#define OP_AND          0x54
-#define OP_OR           0x55
-#define OP_XOR          0x56
-#define OP_NOT          0x57
-#define OP_CMP          0x58
-#define OP_JMP          0x60
-#define OP_JZ           0x61
-#define OP_JNZ          0x62
-#define OP_JG           0x63
-#define OP_JL           0x64
-#define OP_READ_CHAR    0x70
-#define OP_LOAD_MEM     0x80
-#define OP_STORE_MEM    0x81
+#include "../opcodes.h"
 
 typedef struct {
     uint8_t *data;
@@ -99,6 +72,15 @@ void beep(Program *p, uint16_t freq, uint16_t duration) {
     emit_word(p, duration);
 }
 
+// wave: 0 square, 1 triangle, 2 sawtooth, 3 noise
+void tone(Program *p, uint8_t channel, uint16_t freq, uint16_t duration, uint8_t wave) {
+    emit_byte(p, OP_TONE);
+    emit_byte(p, channel);
+    emit_word(p, freq);
+    emit_word(p, duration);
+    emit_byte(p, wave);
+}
+
 void set_pixel(Program *p, uint16_t x, uint16_t y, uint8_t value) {
     emit_byte(p, OP_SET_PIXEL);
     emit_word(p, x);
@@ -110,6 +92,31 @@ void clear_pixels(Program *p) {
     emit_byte(p, OP_CLEAR_PIXELS);
 }
 
+// Sprite bitmaps are 1 bpp, MSB first, each row padded to a whole byte
+#define SPRITE_TRANSPARENT 0x01
+
+void draw_sprite(Program *p, uint16_t addr, int16_t x, int16_t y,
+                 uint8_t w, uint8_t h, uint8_t flags) {
+    emit_byte(p, OP_DRAW_SPRITE);
+    emit_word(p, addr);
+    emit_word(p, (uint16_t)x);
+    emit_word(p, (uint16_t)y);
+    emit_byte(p, w);
+    emit_byte(p, h);
+    emit_byte(p, flags);
+}
+
+void draw_sprite_reg(Program *p, uint16_t addr, uint8_t rx, uint8_t ry,
+                     uint8_t w, uint8_t h, uint8_t flags) {
+    emit_byte(p, OP_DRAW_SPRITE_REG);
+    emit_word(p, addr);
+    emit_byte(p, rx);
+    emit_byte(p, ry);
+    emit_byte(p, w);
+    emit_byte(p, h);
+    emit_byte(p, flags);
+}
+
 void load_reg(Program *p, uint8_t reg, uint16_t value) {
     emit_byte(p, OP_LOAD_REG);
     emit_byte(p, reg);
@@ -153,6 +160,89 @@ void jnz(Program *p, uint16_t addr) {
     emit_word(p, addr);
 }
 
+// Fused instructions: one dispatch for a common multi-instruction idiom
+
+// dst += value, without a scratch register for the constant
+void add_imm(Program *p, uint8_t dst, uint16_t value) {
+    emit_byte(p, OP_ADDI);
+    emit_byte(p, dst);
+    emit_word(p, value);
+}
+
+void cmp_imm(Program *p, uint8_t src, uint16_t value) {
+    emit_byte(p, OP_CMPI);
+    emit_byte(p, src);
+    emit_word(p, value);
+}
+
+// reg -= 1, then jump to addr unless it reached zero
+void djnz(Program *p, uint8_t reg, uint16_t addr) {
+    emit_byte(p, OP_DJNZ);
+    emit_byte(p, reg);
+    emit_word(p, addr);
+}
+
+// Jump to addr unless reg == value
+void cjne(Program *p, uint8_t reg, uint16_t value, uint16_t addr) {
+    emit_byte(p, OP_CJNE);
+    emit_byte(p, reg);
+    emit_word(p, value);
+    emit_word(p, addr);
+}
+
+// reg = word at base + R[idx]
+void load_idx(Program *p, uint8_t reg, uint16_t base, uint8_t idx) {
+    emit_byte(p, OP_LOAD_IDX);
+    emit_byte(p, reg);
+    emit_word(p, base);
+    emit_byte(p, idx);
+}
+
+// word at base + R[idx] = reg
+void store_idx(Program *p, uint16_t base, uint8_t idx, uint8_t reg) {
+    emit_byte(p, OP_STORE_IDX);
+    emit_word(p, base);
+    emit_byte(p, idx);
+    emit_byte(p, reg);
+}
+
+void fill_mem(Program *p, uint16_t addr, uint16_t len, uint8_t value) {
+    emit_byte(p, OP_FILL_MEM);
+    emit_word(p, addr);
+    emit_word(p, len);
+    emit_byte(p, value);
+}
+
+void cmp_mem(Program *p, uint16_t a, uint16_t b, uint16_t len) {
+    emit_byte(p, OP_CMP_MEM);
+    emit_word(p, a);
+    emit_word(p, b);
+    emit_word(p, len);
+}
+
+// reg = offset of the first byte equal to value within [addr, addr + len)
+void find_byte(Program *p, uint8_t reg, uint16_t addr, uint16_t len, uint8_t value) {
+    emit_byte(p, OP_FIND_BYTE);
+    emit_byte(p, reg);
+    emit_word(p, addr);
+    emit_word(p, len);
+    emit_byte(p, value);
+}
+
+void add_mem(Program *p, uint16_t addr, uint16_t len, uint8_t value) {
+    emit_byte(p, OP_ADD_MEM);
+    emit_word(p, addr);
+    emit_word(p, len);
+    emit_byte(p, value);
+}
+
+void xor_mem(Program *p, uint16_t addr, uint16_t len, uint8_t value) {
+    emit_byte(p, OP_XOR_MEM);
+    emit_word(p, addr);
+    emit_word(p, len);
+    emit_byte(p, value);
+}
+
 void halt(Program *p) {
     emit_byte(p, OP_HALT);
 }
@@ -161,6 +251,16 @@ size_t get_current_addr(Program *p) {
     return p->size;
 }
 
+// Place a block of data in the program behind a jump; returns its address
+uint16_t emit_data(Program *p, const uint8_t *data, size_t len) {
+    jmp(p, (uint16_t)(get_current_addr(p) + 3 + len));
+    uint16_t addr = (uint16_t)get_current_addr(p);
+    for (size_t i = 0; i < len; i++) {
+        emit_byte(p, data[i]);
+    }
+    return addr;
+}
+
 // Demo sections
 void banner_effect(Program *p) {
     clear_screen(p);
@@ -191,7 +291,7 @@ void sound_test(Program *p) {
         print_str(p, names[i]);
         print_str(p, "\n");
         beep(p, notes[i], 300);
-        sleep_ms(p, 100);
+        sleep_ms(p, 400);
     }
     
     sleep_ms(p, 500);
@@ -204,9 +304,18 @@ void sound_test(Program *p) {
     
     for (int i = 0; i < 14; i++) {
         beep(p, melody[i], durations[i]);
-        sleep_ms(p, 50);
+        sleep_ms(p, durations[i] + 50);
     }
     
+    // The channels play at once: a C major chord over a drum hit
+    sleep_ms(p, 500);
+    print_str(p, "\nPlaying a chord...\n");
+    tone(p, 0, 262, 800, 1);
+    tone(p, 1, 330, 800, 1);
+    tone(p, 2, 392, 800, 2);
+    tone(p, 3, 4000, 60, 3);
+    sleep_ms(p, 800);
+    
     sleep_ms(p, 1000);
 }
 
@@ -236,6 +345,26 @@ void register_test(Program *p) {
     mul_regs(p, 4, 0, 1);
     sleep_ms(p, 500);
     
+    // Indexed loads walk a table: R6 steps through it two bytes at a time
+    static const uint8_t table[16] = {1, 0, 2, 0, 3, 0, 4, 0, 5, 0, 6, 0, 7, 0, 8, 0};
+    print_str(p, "R5 = sum of an 8-entry table (indexed loads)\n");
+    uint16_t table_addr = emit_data(p, table, sizeof(table));
+    load_reg(p, 5, 0);
+    load_reg(p, 6, 0);
+    size_t sum_loop = get_current_addr(p);
+    load_idx(p, 7, table_addr, 6);
+    add_regs(p, 5, 5, 7);
+    add_imm(p, 6, 2);
+    cjne(p, 6, sizeof(table), (uint16_t)sum_loop);
+    sleep_ms(p, 500);
+    
+    // One FIND_BYTE scans for the terminator instead of a load/compare loop
+    static const uint8_t word[] = "MicroComputer";
+    print_str(p, "R7 = length of \"MicroComputer\" (memory search)\n");
+    uint16_t word_addr = emit_data(p, word, sizeof(word));
+    find_byte(p, 7, word_addr, 0xFFFF, 0);
+    sleep_ms(p, 500);
+    
     print_str(p, "\nCheck 'meminfo' command to see register values!\n");
     sleep_ms(p, 2000);
 }
@@ -249,8 +378,6 @@ void loop_test(Program *p) {
     
     // Initialize counter: R0 = 10
     load_reg(p, 0, 10);
-    load_reg(p, 1, 1);  // R1 = 1 (decrement value)
-    load_reg(p, 2, 0);  // R2 = 0 (compare target)
     
     size_t loop_start = get_current_addr(p);
     
@@ -259,14 +386,8 @@ void loop_test(Program *p) {
     sleep_ms(p, 200);
     beep(p, 440, 50);
     
-    // Decrement: R0 = R0 - R1
-    sub_regs(p, 0, 0, 1);
-    
-    // Compare R0 with 0
-    cmp_regs(p, 0, 2);
-    
-    // Jump back if not zero
-    jnz(p, (uint16_t)loop_start);
+    // Decrement R0 and jump back if not zero
+    djnz(p, 0, (uint16_t)loop_start);
     
     print_str(p, "\n\nLoop complete!\n");
     sleep_ms(p, 1500);
@@ -324,6 +445,41 @@ void graphics_test(Program *p) {
     
     sleep_ms(p, 2000);
     
+    // Sprites: each 16x16 face is a single instruction
+    static const uint8_t face[32] = {
+        0x07, 0xE0, 0x18, 0x18, 0x20, 0x04, 0x40, 0x02,
+        0x4C, 0x32, 0x8C, 0x31, 0x80, 0x01, 0x80, 0x01,
+        0x80, 0x01, 0x88, 0x11, 0x84, 0x21, 0x43, 0xC2,
+        0x40, 0x02, 0x20, 0x04, 0x18, 0x18, 0x07, 0xE0
+    };
+    uint16_t face_addr = emit_data(p, face, sizeof(face));
+    clear_pixels(p);
+    for (int i = 0; i < 10; i++) {
+        draw_sprite(p, face_addr, 8 + i * 30, 20 + (i % 2) * 20, 16, 16, 0);
+        beep(p, 400 + i * 60, 30);
+    }
+    sleep_ms(p, 1000);
+    
+    // Slide a face across using the register form. The copy has a blank
+    // 4-pixel margin each side, so drawing it opaque 4 pixels further on
+    // erases the previous position.
+    uint8_t slider[48];
+    for (int row = 0; row < 16; row++) {
+        uint32_t bits = (uint32_t)(face[row * 2] << 8 | face[row * 2 + 1]) << 4;
+        slider[row * 3] = (bits >> 16) & 0xFF;
+        slider[row * 3 + 1] = (bits >> 8) & 0xFF;
+        slider[row * 3 + 2] = bits & 0xFF;
+    }
+    uint16_t slider_addr = emit_data(p, slider, sizeof(slider));
+    load_reg(p, 0, 0);      // R0 = x
+    load_reg(p, 1, 140);    // R1 = y
+    for (int x = 0; x + 24 <= 320; x += 4) {
+        draw_sprite_reg(p, slider_addr, 0, 1, 24, 16, 0);
+        sleep_ms(p, 20);
+        add_imm(p, 0, 4);
+    }
+    sleep_ms(p, 1500);
+    
     // Return to text mode
     clear_screen(p);
 }
@@ -451,7 +607,7 @@ void finale(Program *p) {
     uint16_t fanfare[] = {523, 587, 659, 784};
     for (int i = 0; i < 4; i++) {
         beep(p, fanfare[i], 200);
-        sleep_ms(p, 50);
+        sleep_ms(p, 250);
     }
     beep(p, 1047, 600);
     
@@ -495,6 +651,7 @@ int main(void) {
     printf("  - Register arithmetic\n");
     printf("  - Loops using jumps\n");
     printf("  - Pixel graphics mode\n");
+    printf("  - Sprites\n");
     printf("  - Animated patterns\n");
     
     free(prog.data);
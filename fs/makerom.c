@@ -0,0 +1,228 @@
+/*
+ * ROM Archive Packer for MicroComputer
+ * Packs flat .bin programs into one LZ4-compressed .rom archive
+ * Compile: gcc -o makerom makerom.c
+ * Run: ./makerom games.rom demo.bin snake.bin@1000 ...
+ * Output: games.rom (place in fs/ folder; its programs show up as
+ *         games.rom/demo.bin and so on, and "run games.rom" runs the first)
+ *
+ * A program named file@ADDR is loaded at hex address ADDR and starts
+ * there; otherwise it loads and starts at 0. -r stores segments raw.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MEM_SIZE (64 * 1024)
+
+// Archive layout, see "ROM archives" in microemu.c
+#define ROM_VERSION       1
+#define ROM_HEADER_SIZE   16
+#define ROM_PROGRAM_SIZE  32
+#define ROM_SEGMENT_SIZE  20
+#define ROM_RAW           0
+#define ROM_LZ4           1
+
+typedef struct {
+    char name[24];
+    uint16_t load;
+    uint8_t codec;
+    uint8_t *stored;
+    uint32_t length;
+    uint32_t stored_size;
+} Entry;
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+static uint32_t fnv1a(const uint8_t *p, size_t n) {
+    uint32_t h = 2166136261u;
+    while (n--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t read32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// LZ4 length extension: 255s, then the remainder
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) return op;      // last sequence: literals only
+
+    put16(op, (uint16_t)offset);
+    op += 2;
+    match_len -= 4;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15) op = put_length(op, match_len - 15);
+    return op;
+}
+
+// Greedy LZ4 block compressor. dst needs n + n / 255 + 16 bytes. Follows
+// the format's end rules: the last match starts at least 12 bytes before
+// the end and the last 5 bytes are literals.
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+    static uint32_t table[4096];        // position + 1 of a recent 4-byte sequence
+    uint8_t *op = dst;
+    size_t anchor = 0, ip = 0;
+
+    memset(table, 0, sizeof(table));
+    while (n >= 13 && ip < n - 12) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> 20;
+        size_t ref = table[h];
+        table[h] = (uint32_t)ip + 1;
+        if (ref && ip - (ref - 1) <= 65535 && read32(src + ref - 1) == seq) {
+            ref--;
+            size_t len = 4;
+            while (ip + len < n - 5 && src[ref + len] == src[ip + len]) len++;
+            op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+    op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+    return (size_t)(op - dst);
+}
+
+static int add_program(Entry *e, const char *arg, int raw) {
+    char path[1024];
+    const char *at = strrchr(arg, '@');
+    unsigned long load = 0;
+
+    snprintf(path, sizeof(path), "%.*s", at ? (int)(at - arg) : (int)strlen(arg), arg);
+    if (at) load = strtoul(at + 1, NULL, 16);
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Could not open %s\n", path);
+        return -1;
+    }
+    uint8_t *data = malloc(MEM_SIZE + 1);
+    size_t size = data ? fread(data, 1, MEM_SIZE + 1, f) : 0;
+    fclose(f);
+    if (!data || load >= MEM_SIZE || size > MEM_SIZE - load) {
+        fprintf(stderr, "Error: %s does not fit in memory at %04lX\n", path, load);
+        free(data);
+        return -1;
+    }
+
+    const char *base = strrchr(path, '/');
+    const char *name = base ? base + 1 : path;
+    size_t name_len = strlen(name);
+    memset(e->name, 0, sizeof(e->name));
+    memcpy(e->name, name, name_len < sizeof(e->name) ? name_len : sizeof(e->name));
+    e->load = (uint16_t)load;
+    e->length = (uint32_t)size;
+    e->codec = ROM_RAW;
+    e->stored = data;
+    e->stored_size = (uint32_t)size;
+
+    if (!raw) {
+        uint8_t *packed = malloc(size + size / 255 + 16);
+        size_t packed_size = packed ? lz4_compress(data, size, packed) : size;
+        if (packed_size < size) {
+            free(data);
+            e->codec = ROM_LZ4;
+            e->stored = packed;
+            e->stored_size = (uint32_t)packed_size;
+        } else {
+            free(packed);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int raw = 0, first = 1;
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        raw = 1;
+        first = 2;
+    }
+    if (argc - first < 2 || argc - first - 1 > 65535) {
+        fprintf(stderr, "Usage: %s [-r] out.rom program.bin[@ADDR] ...\n", argv[0]);
+        return 1;
+    }
+
+    int count = argc - first - 1;
+    Entry *entries = calloc(count, sizeof(Entry));
+    if (!entries) return 1;
+    for (int i = 0; i < count; i++) {
+        if (add_program(&entries[i], argv[first + 1 + i], raw) != 0) return 1;
+    }
+
+    // One segment per program; data follows the tables
+    size_t tables = (size_t)count * (ROM_PROGRAM_SIZE + ROM_SEGMENT_SIZE);
+    uint8_t *head = calloc(1, ROM_HEADER_SIZE + tables);
+    if (!head) return 1;
+    uint8_t *program = head + ROM_HEADER_SIZE;
+    uint8_t *segment = program + (size_t)count * ROM_PROGRAM_SIZE;
+    uint32_t offset = (uint32_t)(ROM_HEADER_SIZE + tables);
+    size_t raw_total = 0;
+
+    for (int i = 0; i < count; i++) {
+        Entry *e = &entries[i];
+        uint8_t *p = program + i * ROM_PROGRAM_SIZE;
+        uint8_t *g = segment + i * ROM_SEGMENT_SIZE;
+        memcpy(p, e->name, sizeof(e->name));
+        put16(p + 24, e->load);
+        put16(p + 26, (uint16_t)i);
+        put16(p + 28, 1);
+        put16(g, e->load);
+        g[2] = e->codec;
+        put32(g + 4, e->length);
+        put32(g + 8, e->stored_size);
+        put32(g + 12, offset);
+        put32(g + 16, fnv1a(e->stored, e->stored_size));
+        offset += e->stored_size;
+        raw_total += e->length;
+    }
+    memcpy(head, "MROM", 4);
+    put16(head + 4, ROM_VERSION);
+    put16(head + 6, (uint16_t)count);
+    put16(head + 8, (uint16_t)count);
+    put32(head + 12, fnv1a(program, tables));
+
+    FILE *f = fopen(argv[first], "wb");
+    if (!f) {
+        fprintf(stderr, "Error: Could not create %s\n", argv[first]);
+        return 1;
+    }
+    fwrite(head, 1, ROM_HEADER_SIZE + tables, f);
+    for (int i = 0; i < count; i++) {
+        fwrite(entries[i].stored, 1, entries[i].stored_size, f);
+    }
+    fclose(f);
+
+    printf("Created %s: %d programs, %zu bytes (%zu uncompressed)\n",
+           argv[first], count, (size_t)offset, raw_total);
+    return 0;
+}
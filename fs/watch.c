@@ -0,0 +1,209 @@
+/*
+ * Screen Viewer for MicroComputer
+ * Shows a machine exported by microemu --export-port or --export-shm
+ * Compile: gcc -o watch watch.c          (older glibc: add -lrt)
+ * Run: ./watch [-n FRAMES] [ADDR:]PORT [MACHINE]
+ *      ./watch [-n FRAMES] --shm NAME.N
+ * Output: the machine's screen redrawn in the terminal as it changes,
+ *         text as text and pixel mode in 4x8 blocks; -n stops after
+ *         that many frames, printing each one below the last
+ *
+ * The stream and the shared memory layout are described in export.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../export.h"
+
+static ExportScreen view;
+
+static int fb_stride(int depth) {
+    return depth == 4 ? 160 : 40;
+}
+
+static int block_set(int bx, int by) {
+    int stride = fb_stride(view.state.pixel_depth);
+    for (int y = by * 8; y < by * 8 + 8; y++) {
+        for (int x = bx * 4; x < bx * 4 + 4; x++) {
+            const uint8_t *row = view.pixels + y * stride;
+            int v = view.state.pixel_depth == 4 ? (x & 1 ? row[x >> 1] & 0x0F : row[x >> 1] >> 4)
+                                                : (row[x >> 3] >> (7 - (x & 7))) & 1;
+            if (v) return 1;
+        }
+    }
+    return 0;
+}
+
+static void draw(const char *title, unsigned frames, int scroll) {
+    if (!scroll) printf("\033[H\033[2J");
+    printf("%s  frame %u  %s mode\n", title, frames,
+           view.state.pixel_mode ? "pixel" : "text");
+    for (int y = 0; y < EXPORT_TEXT_HEIGHT; y++) {
+        for (int x = 0; x < EXPORT_TEXT_WIDTH; x++) {
+            char c;
+            if (view.state.pixel_mode) {
+                c = block_set(x, y) ? '#' : ' ';
+            } else if (view.state.cursor_visible && x == view.state.cursor_x &&
+                       y == view.state.cursor_y) {
+                c = '_';
+            } else {
+                c = view.chars[y][x];
+                if (c < 32 || c > 126) c = ' ';
+            }
+            putchar(c);
+        }
+        putchar('\n');
+    }
+    fflush(stdout);
+}
+
+static int read_all(int fd, uint8_t *buf, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = read(fd, buf + got, n - got);
+        if (r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
+// Apply one message for our machine; returns 0, 1 when it has gone, -1 if malformed
+static int apply(const uint8_t *msg, size_t len) {
+    if (msg[0] == EXPORT_GONE) return 1;
+    if (len < 2 + sizeof(ExportState)) return -1;
+    memcpy(&view.state, msg + 2, sizeof(ExportState));
+    size_t pos = 2 + sizeof(ExportState);
+    while (pos < len) {
+        if (pos + 6 > len) return -1;
+        int plane = msg[pos], row = msg[pos + 1];
+        size_t lo = msg[pos + 2] | msg[pos + 3] << 8;
+        size_t hi = msg[pos + 4] | msg[pos + 5] << 8;
+        uint8_t *dst;
+        size_t width;
+        if (plane == EXPORT_CHARS && row < EXPORT_TEXT_HEIGHT) {
+            dst = (uint8_t *)view.chars[row];
+            width = EXPORT_TEXT_WIDTH;
+        } else if (plane == EXPORT_COLORS && row < EXPORT_TEXT_HEIGHT) {
+            dst = view.colors[row];
+            width = EXPORT_TEXT_WIDTH;
+        } else if (plane == EXPORT_PIXELS && row < EXPORT_PIXEL_HEIGHT) {
+            width = fb_stride(view.state.pixel_depth);
+            dst = view.pixels + row * width;
+        } else {
+            return -1;
+        }
+        if (lo >= hi || hi > width) return -1;
+        size_t used = export_unrle(msg + pos + 6, len - pos - 6, dst + lo, hi - lo);
+        if (!used) return -1;
+        pos += 6 + used;
+    }
+    return 0;
+}
+
+static int watch_stream(const char *address, int machine, int limit) {
+    char host[64] = "127.0.0.1";
+    const char *port = address, *colon = strrchr(address, ':');
+    if (colon) {
+        size_t n = (size_t)(colon - address);
+        if (n >= sizeof(host)) n = sizeof(host) - 1;
+        memcpy(host, address, n);
+        host[n] = '\0';
+        port = colon + 1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(port));
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || fd < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Could not connect to %s\n", address);
+        return 1;
+    }
+
+    static uint8_t msg[1 << 20];
+    char title[96];
+    unsigned frames = 0;
+    snprintf(title, sizeof(title), "%s machine %d", address, machine);
+    for (;;) {
+        uint8_t head[4];
+        if (read_all(fd, head, 4) != 0) break;
+        size_t len = head[0] | head[1] << 8 | head[2] << 16 | (size_t)head[3] << 24;
+        if (len < 2 || len > sizeof(msg) || read_all(fd, msg, len) != 0) break;
+        if (msg[1] != machine) continue;
+        int status = apply(msg, len);
+        if (status < 0) {
+            fprintf(stderr, "Error: Bad message from %s\n", address);
+            break;
+        }
+        if (status > 0) {
+            printf("machine %d has stopped\n", machine);
+            break;
+        }
+        draw(title, ++frames, limit > 0);
+        if (limit > 0 && (int)frames >= limit) break;
+    }
+    close(fd);
+    return 0;
+}
+
+static int watch_shm(const char *name, int limit) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open shared memory %s\n", path);
+        return 1;
+    }
+    const ExportScreen *s = mmap(NULL, sizeof(ExportScreen), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED || memcmp(s->magic, EXPORT_MAGIC, 4) != 0 ||
+        s->version != EXPORT_VERSION) {
+        fprintf(stderr, "Error: %s is not an exported screen\n", path);
+        return 1;
+    }
+
+    uint32_t shown = 0;
+    int frames = 0;
+    for (;;) {
+        uint32_t seq = s->seq;
+        if (seq & 1 || seq == shown) {
+            usleep(33000);
+            continue;
+        }
+        __sync_synchronize();
+        memcpy(&view, s, sizeof(view));
+        __sync_synchronize();
+        if (s->seq != seq) continue;
+        shown = seq;
+        draw(name, view.frames, limit > 0);
+        if (limit > 0 && ++frames >= limit) break;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int limit = 0, arg = 1;
+    if (arg + 1 < argc && strcmp(argv[arg], "-n") == 0) {
+        limit = atoi(argv[arg + 1]);
+        arg += 2;
+    }
+    if (arg + 1 < argc && strcmp(argv[arg], "--shm") == 0) {
+        return watch_shm(argv[arg + 1], limit);
+    }
+    if (arg < argc) {
+        return watch_stream(argv[arg], arg + 1 < argc ? atoi(argv[arg + 1]) : 0, limit);
+    }
+    fprintf(stderr, "Usage: %s [-n FRAMES] [ADDR:]PORT [MACHINE]\n"
+                    "       %s [-n FRAMES] --shm NAME.N\n", argv[0], argv[0]);
+    return 1;
+}
@@ -2,22 +2,26 @@
  * MicroComputer Emulator with GUI Display and CLI OS
  * Compile: 
  *   Windows: gcc -o microemu.exe microemu.c -lws2_32 -lgdi32 -lpthread
- *   Linux:   gcc -o microemu microemu.c -lX11 -lpthread -lm
+ *   Linux:   gcc -o microemu microemu.c -lX11 -lXext -lpthread -lm -ldl -lrt
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <errno.h>
 
 #ifdef _WIN32
     #include <winsock2.h>
     #include <windows.h>
+    #include <mmsystem.h>
     #include <direct.h>
     #define mkdir(path, mode) _mkdir(path)
     #define PATH_SEP "\\"
@@ -27,80 +31,55 @@
     #include <unistd.h>
     #include <termios.h>
     #include <sys/select.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <sys/syscall.h>
+    #ifdef __linux__
+        #include <sys/inotify.h>
+    #endif
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <dirent.h>
+    #include <dlfcn.h>
     #include <X11/Xlib.h>
     #include <X11/Xutil.h>
     #include <X11/keysym.h>
+    #include <X11/extensions/XShm.h>
+    #include <sys/ipc.h>
+    #include <sys/shm.h>
     #define PATH_SEP "/"
     #define sleep_ms(ms) usleep((ms) * 1000)
     #define sleep_us(us) usleep(us)
 #endif
 
+#include "opcodes.h"
+#include "export.h"
+
 // Virtual CPU Specifications
 #define MEM_SIZE (64 * 1024)
 #define STACK_SIZE 256
+// The stack is the last STACK_SIZE bytes of memory, filled downward from
+// sp. PUSH and CALL store two bytes at sp and sp - 1, POP and RET load
+// sp + 1 and sp + 2; each is refused when those bytes would leave the
+// stack page, so sp never wraps and a full or empty stack stays usable.
+#define STACK_ADDR(sp)      (MEM_SIZE - STACK_SIZE + (sp))
+#define STACK_CAN_PUSH(sp)  ((sp) >= 2 && (sp) < STACK_SIZE)
+#define STACK_CAN_POP(sp)   ((sp) < STACK_SIZE - 2)
 #define MAX_PATH_LEN 256
 #define SCREEN_WIDTH 80
 #define SCREEN_HEIGHT 25
 #define CHAR_WIDTH 8
 #define CHAR_HEIGHT 16
 #define INPUT_BUFFER_SIZE 256
+#define KEY_QUEUE_SIZE 64
 #define MAX_HISTORY 50
 
 // Pixel graphics mode
 #define PIXEL_WIDTH 320
 #define PIXEL_HEIGHT 200
 
-// Opcodes
-#define OP_HALT         0x00
-#define OP_PRINT_CHAR   0x01
-#define OP_PRINT_STR    0x02
-#define OP_CLEAR_SCREEN 0x04
-#define OP_SET_COLOR    0x05
-#define OP_GET_CURSOR   0x06
-#define OP_SET_CURSOR   0x07
-#define OP_DRAW_LINE    0x08
-#define OP_DRAW_RECT    0x09
-#define OP_FILL_RECT    0x0A
-#define OP_DRAW_CIRCLE  0x0B
-#define OP_SLEEP_MS     0x20
-#define OP_BEEP         0x21
-#define OP_GET_TIME     0x22
-#define OP_RANDOM       0x23
-#define OP_SET_PIXEL    0x30
-#define OP_CLEAR_PIXELS 0x31
-#define OP_DRAW_SPRITE  0x32
-#define OP_LOAD_REG     0x40
-#define OP_STORE_REG    0x41
-#define OP_PUSH         0x42
-#define OP_POP          0x43
-#define OP_ADD          0x50
-#define OP_SUB          0x51
-#define OP_MUL          0x52
-#define OP_DIV          0x53
-#define OP_MOD          0x54
-#define OP_AND          0x55
-#define OP_OR           0x56
-#define OP_XOR          0x57
-#define OP_NOT          0x58
-#define OP_SHL          0x59
-#define OP_SHR          0x5A
-#define OP_CMP          0x5B
-#define OP_JMP          0x60
-#define OP_JZ           0x61
-#define OP_JNZ          0x62
-#define OP_JG           0x63
-#define OP_JL           0x64
-#define OP_CALL         0x65
-#define OP_RET          0x66
-#define OP_READ_CHAR    0x70
-#define OP_KEY_PRESSED  0x71
-#define OP_LOAD_MEM     0x80
-#define OP_STORE_MEM    0x81
-#define OP_COPY_MEM     0x82
+// Opcodes (OP_*, OPLEN_*) and opcode_info[] come from opcodes.h
 
 // Color codes
 #define COLOR_BLACK     0
@@ -121,7 +100,11 @@
 #define COLOR_BRIGHT_WHITE   15
 
 // Virtual CPU state
+// The scheduler fields sit ahead of memory: stack accesses with sp out
+// of range run off the end of memory, never the start.
 typedef struct {
+    uint64_t cycles;        // opcode_info[].cycles charged since init_cpu()
+    uint64_t cycle_limit;   // end of the current scheduler slice
     uint8_t memory[MEM_SIZE];
     uint16_t pc;
     uint16_t sp;
@@ -130,41 +113,128 @@ typedef struct {
     int running;
 } CPU;
 
-// Screen buffer
+// Predecoded instruction cache entry
+// One entry per memory address. An entry holds the handler index for the
+// instruction starting at that address plus its operands already parsed,
+// so the fast engine never re-reads operand bytes or re-checks bounds.
+// Anything the fast engine does not handle decodes to DK_FALLBACK and is
+// executed by execute_instruction() itself.
 typedef struct {
-    char chars[SCREEN_HEIGHT][SCREEN_WIDTH];
-    uint8_t colors[SCREEN_HEIGHT][SCREEN_WIDTH]; // Color attributes
-    uint8_t pixels[PIXEL_HEIGHT][PIXEL_WIDTH];
+    uint16_t a, b, c;   // pre-parsed operands
+    uint8_t kind;       // handler index (DK_*)
+    uint8_t len;        // instruction length in bytes
+} DecodedOp;
+
+// Changed screen regions, one [lo, hi) span per row; a row is clean when
+// lo >= hi. full asks for everything to be repainted.
+typedef struct {
+    uint8_t text_lo[SCREEN_HEIGHT];
+    uint8_t text_hi[SCREEN_HEIGHT];
+    uint16_t pix_lo[PIXEL_HEIGHT];
+    uint16_t pix_hi[PIXEL_HEIGHT];
+    int full;
+} Damage;
+
+// Packed pixel framebuffer, rows of fb_stride() bytes: 1 bpp with the
+// leftmost pixel in the top bit, or 4 bpp palette indices with the
+// leftmost pixel in the high nibble
+#define PIXEL_BYTES (PIXEL_HEIGHT * PIXEL_WIDTH / 2)
+
+static inline int fb_stride(int depth) {
+    return depth == 4 ? PIXEL_WIDTH / 2 : PIXEL_WIDTH / 8;
+}
+
+// Pixel value: 0 or 1 at 1 bpp, a palette index at 4 bpp
+static inline int fb_get(const uint8_t *pixels, int depth, int x, int y) {
+    const uint8_t *row = pixels + y * fb_stride(depth);
+    if (depth == 4) return (x & 1) ? row[x >> 1] & 0x0F : row[x >> 1] >> 4;
+    return (row[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+// Screen buffer. Text is a ring of text_rows rows: screen row y is ring
+// row (top + y) % text_rows, so scrolling just advances top, and the rows
+// behind it are the scrollback history.
+typedef struct {
+    char *chars;            // text_rows * SCREEN_WIDTH
+    uint8_t *colors;        // Color attributes, same layout
+    int text_rows;          // SCREEN_HEIGHT + scrollback
+    int top;                // ring row shown as screen row 0
+    int history;            // rows scrolled off the top that are still kept
+    int view;               // rows the view is scrolled back, 0 = live
+    uint8_t pixels[PIXEL_BYTES];
+    int pixel_depth;        // bits per pixel, 1 or 4
     int cursor_x;
     int cursor_y;
     int cursor_visible;
-    int dirty;
+    int dirty;              // changed since the last present_screen()
     int pixel_mode;
     uint8_t current_color;
+    Damage damage;          // what changed since the last present_screen()
 } VScreen;
 
-// File system
+// What the renderer sees: a copy of the visible parts of VScreen
+typedef struct {
+    char chars[SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint8_t colors[SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint8_t pixels[PIXEL_BYTES];
+    int pixel_depth;
+    int cursor_x;
+    int cursor_y;
+    int cursor_visible;
+    int pixel_mode;
+    Damage damage;          // relative to the last frame the renderer took
+} Frame;
+
+// File system. A scan records only metadata; contents are mapped on
+// first use by file_data() and stay mapped until the next scan. Files the
+// shell writes live in a FileBuffer, shared by every File and queued
+// write that refers to it, until the flusher thread has them on disk.
+typedef struct {
+    atomic_int refs;
+    size_t size;
+    uint8_t data[];
+} FileBuffer;
+
 typedef struct {
     char name[64];
-    uint8_t *data;
+    uint8_t *data;          // NULL until file_data() maps it
+    FileBuffer *cache;      // contents written by us, served instead of the disk
+    uint64_t write_seq;     // last queued disk operation on this name
+    int member;             // program number + 1 in the archive this name is under
     size_t size;
     time_t modified;
 } File;
 
+// files is looked up by name through index, an open-addressed hash table
+// whose slots hold a file number + 1, 0 for never used or FS_DELETED.
+#define FS_DELETED (-1)
+
 typedef struct {
-    File files[64];
+    File *files;
     int file_count;
+    int file_capacity;
+    int *index;
+    int index_size;         // power of two
+    int index_used;         // slots not 0, deleted ones included
     char root_dir[MAX_PATH_LEN];
 } FileSystem;
 
-// Input handling
+// Input handling. The window thread fills this in from key events and
+// signals changed; the CPU thread sleeps on it rather than polling.
 typedef struct {
     char buffer[INPUT_BUFFER_SIZE];
     int pos;
     int ready;
-    char last_char;
-    int char_ready;
+    char keys[KEY_QUEUE_SIZE];      // typed characters for READ_CHAR and KEY_PRESSED
+    int key_head;
+    int key_count;
+    char echo[INPUT_BUFFER_SIZE];   // keys to echo, '\b' for backspace
+    int echo_len;
+    int scroll;                     // rows to scroll the view back (+) or forward (-)
+    int window_shown;               // the window is up, see window_opened()
+    unsigned events;                // bumped with every change
     pthread_mutex_t mutex;
+    pthread_cond_t changed;
 } InputBuffer;
 
 // Command history
@@ -174,22 +244,267 @@ typedef struct {
     int current;
 } History;
 
+// One virtual machine: everything a program can see or change, plus the
+// engines' caches of its memory. The emulator's own machine is
+// main_machine; headless pools make one per worker thread.
+typedef struct {
+    CPU cpu;
+    VScreen screen;
+    InputBuffer input_buf;
+    uint32_t rand_state;            // OP_RANDOM's generator
+    // Program time, see program_ms()
+    uint64_t clock_start;           // cpu.cycles (virtual) or host us at the start
+    uint64_t slept_ms;              // virtual time skipped by SLEEP_MS
+    uint64_t wake_us;               // host deadline of the last SLEEP_MS
+    // The extra entry past the end of memory is a permanent DK_WRAP
+    // sentinel, so falling off the last instruction wraps pc to 0 without
+    // a bounds check.
+    DecodedOp decode_cache[MEM_SIZE + 1];
+    uint8_t decoded_pages[MEM_SIZE / 256];
+    struct JitState *jit;           // allocated by jit_init()
+    struct Profile *profile;        // non-NULL while profiling, see run_profiled()
+    struct Trace *trace;            // non-NULL while recording or replaying
+    struct Export *export;          // non-NULL while exported, see export_attach()
+    struct Banks *banks;            // allocated when a program first banks memory
+} Machine;
+
 // Global state
-CPU cpu;
-VScreen screen;
+Machine main_machine;
 FileSystem fs;
 char current_dir[MAX_PATH_LEN];
 int window_running = 1;
+int headless = 0;           // --headless: no window, no waiting
 int os_mode = 1;
-InputBuffer input_buf;
 History history;
 time_t boot_time;
+int scrollback_lines = 500;         // text rows kept above the screen
+
+// The machine this thread runs. Every thread starts on main_machine, so
+// the window thread's input reaches it; pool workers switch to their own.
+// Code names the machine's parts through these, as plain globals, and
+// every function from execute_instruction() and run_slice() down to
+// putchar_screen() works on the current machine. To run another machine,
+// make it current on the running thread first, as machine_new() does;
+// only functions that take a Machine * (export_detach(), machine_free())
+// work on one that is not current.
+_Thread_local Machine *machine = &main_machine;
+#define cpu             (machine->cpu)
+#define screen          (machine->screen)
+#define input_buf       (machine->input_buf)
+#define decode_cache    (machine->decode_cache)
+#define decoded_pages   (machine->decoded_pages)
+
+// Triple-buffered frame handoff. Only the CPU thread writes screen; it
+// copies it into frames[frame_back] and swaps that slot into
+// frame_latest. The renderer swaps frame_latest with frame_front when
+// FRAME_FRESH is set and draws only frames[frame_front]. Each side owns
+// its slot outright, so a frame is never read while it is being written
+// and neither side ever waits for the other.
+#define FRAME_FRESH 4
+Frame frames[3];
+int frame_back = 0;                 // CPU thread
+int frame_front = 1;                // renderer
+atomic_uint frame_latest = 2;
+
+// Renderer side: take the newest published frame, if there is one
+int acquire_frame(void) {
+    if (!(atomic_load(&frame_latest) & FRAME_FRESH)) return 0;
+    frame_front = (int)(atomic_exchange(&frame_latest, (unsigned)frame_front) & 3);
+    return 1;
+}
+
+// Renderer wakeup. The window thread sleeps until the window system has
+// an event for it or present_screen() publishes a frame and calls
+// wake_renderer(); frame_wake_pending keeps that to one wakeup per sleep.
+atomic_int frame_wake_pending;
+#ifdef _WIN32
+HANDLE frame_wake;
+#else
+int frame_wake[2] = {-1, -1};      // pipe: the renderer selects on [0]
+#endif
+
+void init_renderer_wake(void) {
+#ifdef _WIN32
+    frame_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    if (pipe(frame_wake) == 0) {
+        fcntl(frame_wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(frame_wake[1], F_SETFL, O_NONBLOCK);
+    }
+#endif
+}
+
+void wake_renderer(void) {
+    if (atomic_exchange(&frame_wake_pending, 1)) return;
+#ifdef _WIN32
+    if (frame_wake) SetEvent(frame_wake);
+#else
+    if (frame_wake[1] >= 0) {
+        char c = 0;
+        ssize_t n = write(frame_wake[1], &c, 1);
+        (void)n;
+    }
+#endif
+}
+
+// Renderer side, once awake: let the next publish wake it again
+static void renderer_woken(void) {
+#ifndef _WIN32
+    char drain[64];
+    while (read(frame_wake[0], drain, sizeof(drain)) > 0) {}
+#endif
+    atomic_store(&frame_wake_pending, 0);
+}
+
+// Window thread side of keyboard echo: the CPU thread draws it
+static void queue_echo(char c) {
+    if (input_buf.echo_len < INPUT_BUFFER_SIZE) {
+        input_buf.echo[input_buf.echo_len++] = c;
+    }
+}
+
+// Window thread side of typed characters; a full queue drops the newest
+static void queue_key(char c) {
+    if (input_buf.key_count < KEY_QUEUE_SIZE) {
+        input_buf.keys[(input_buf.key_head + input_buf.key_count++) % KEY_QUEUE_SIZE] = c;
+    }
+}
+
+// Tell a waiting CPU thread that input changed. Called with the mutex held.
+static void input_changed(void) {
+    input_buf.events++;
+    pthread_cond_broadcast(&input_buf.changed);
+}
+
+// Window thread: report the window up, or that it could not be opened
+static void window_opened(int ok) {
+    pthread_mutex_lock(&input_buf.mutex);
+    if (ok) input_buf.window_shown = 1;
+    else window_running = 0;
+    input_changed();
+    pthread_mutex_unlock(&input_buf.mutex);
+}
+
+// Take the oldest typed character, or 0. Called with the mutex held.
+static char take_key(void) {
+    if (input_buf.key_count == 0) return 0;
+    char c = input_buf.keys[input_buf.key_head];
+    input_buf.key_head = (input_buf.key_head + 1) % KEY_QUEUE_SIZE;
+    input_buf.key_count--;
+    return c;
+}
+
+// Software compositing shared by the backends. Both keep a 32-bit canvas
+// the size of the window and repaint damaged spans into it: text through
+// a glyph atlas, pixels scaled up into blocks. The backend fills in the
+// palette and the glyph masks from its own font, then builds the atlas.
+#define CANVAS_WIDTH  (SCREEN_WIDTH * CHAR_WIDTH)
+#define CANVAS_HEIGHT (SCREEN_HEIGHT * CHAR_HEIGHT)
+#define PIXEL_SCALE   (CANVAS_WIDTH / PIXEL_WIDTH)
+#define GLYPH_FIRST   32
+#define GLYPH_COUNT   95
+
+// Canvas area touched by a repaint; empty when x0 >= x1
+typedef struct {
+    int x0, y0, x1, y1;
+} Band;
+
+uint32_t canvas_palette[16];
+uint32_t canvas_black;
+uint8_t glyph_masks[GLYPH_COUNT][CHAR_HEIGHT];  // bit 7 is the leftmost column
+// Every printable glyph prerendered in every palette color, so a cell is
+// CHAR_HEIGHT row copies
+uint32_t glyph_atlas[16][GLYPH_COUNT][CHAR_HEIGHT][CHAR_WIDTH];
+
+void build_glyph_atlas(void) {
+    for (int color = 0; color < 16; color++) {
+        for (int g = 0; g < GLYPH_COUNT; g++) {
+            for (int y = 0; y < CHAR_HEIGHT; y++) {
+                for (int x = 0; x < CHAR_WIDTH; x++) {
+                    glyph_atlas[color][g][y][x] = (glyph_masks[g][y] & (0x80 >> x))
+                        ? canvas_palette[color] : canvas_black;
+                }
+            }
+        }
+    }
+}
+
+static void band_add(Band *b, int x0, int y0, int x1, int y1) {
+    if (b->x0 >= b->x1) {
+        b->x0 = x0; b->y0 = y0; b->x1 = x1; b->y1 = y1;
+        return;
+    }
+    if (x0 < b->x0) b->x0 = x0;
+    if (y0 < b->y0) b->y0 = y0;
+    if (x1 > b->x1) b->x1 = x1;
+    if (y1 > b->y1) b->y1 = y1;
+}
+
+// Composite the damaged text spans of f; stride is in pixels
+Band compose_text(uint32_t *canvas, size_t stride, const Frame *f, int full) {
+    const Damage *d = &f->damage;
+    Band band = {0, 0, 0, 0};
+
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        int x0 = full ? 0 : d->text_lo[y];
+        int x1 = full ? SCREEN_WIDTH : d->text_hi[y];
+        if (x0 >= x1) continue;
+
+        uint32_t *row = canvas + (size_t)y * CHAR_HEIGHT * stride;
+        for (int x = x0; x < x1; x++) {
+            unsigned char c = (unsigned char)f->chars[y][x];
+            uint32_t *dst = row + x * CHAR_WIDTH;
+            if (x == f->cursor_x && y == f->cursor_y && f->cursor_visible) {
+                c = '_';
+            }
+            if (c > GLYPH_FIRST && c < GLYPH_FIRST + GLYPH_COUNT) {
+                const uint32_t (*src)[CHAR_WIDTH] = glyph_atlas[f->colors[y][x] & 15][c - GLYPH_FIRST];
+                for (int i = 0; i < CHAR_HEIGHT; i++) {
+                    memcpy(dst + i * stride, src[i], sizeof(src[i]));
+                }
+            } else {
+                for (int i = 0; i < CHAR_HEIGHT; i++) {
+                    for (int j = 0; j < CHAR_WIDTH; j++) dst[i * stride + j] = canvas_black;
+                }
+            }
+        }
+        band_add(&band, x0 * CHAR_WIDTH, y * CHAR_HEIGHT, x1 * CHAR_WIDTH, (y + 1) * CHAR_HEIGHT);
+    }
+    return band;
+}
+
+// Scale the damaged pixel rows of f into PIXEL_SCALE blocks. 1 bpp pixels
+// that are set use on; 4 bpp pixels index canvas_palette.
+Band scale_pixels(uint32_t *canvas, size_t stride, const Frame *f, int full, uint32_t on) {
+    const Damage *d = &f->damage;
+    Band band = {0, 0, 0, 0};
+
+    for (int y = 0; y < PIXEL_HEIGHT; y++) {
+        int x0 = full ? 0 : d->pix_lo[y];
+        int x1 = full ? PIXEL_WIDTH : d->pix_hi[y];
+        if (x0 >= x1) continue;
+
+        uint32_t *row = canvas + (size_t)y * PIXEL_SCALE * stride;
+        for (int x = x0; x < x1; x++) {
+            int v = fb_get(f->pixels, f->pixel_depth, x, y);
+            uint32_t c = f->pixel_depth == 4 ? canvas_palette[v] : v ? on : canvas_black;
+            for (int i = 0; i < PIXEL_SCALE; i++) row[x * PIXEL_SCALE + i] = c;
+        }
+        for (int i = 1; i < PIXEL_SCALE; i++) {
+            memcpy(row + i * stride + x0 * PIXEL_SCALE, row + x0 * PIXEL_SCALE,
+                   (size_t)(x1 - x0) * PIXEL_SCALE * sizeof(uint32_t));
+        }
+        band_add(&band, x0 * PIXEL_SCALE, y * PIXEL_SCALE, x1 * PIXEL_SCALE, (y + 1) * PIXEL_SCALE);
+    }
+    return band;
+}
 
 #ifdef _WIN32
 HWND hwnd;
 HDC hdc_mem;
-HBITMAP hbm_mem;
+HBITMAP hbm_mem;            // top-down 32-bit DIB section, see win_canvas
 HFONT hfont;
+uint32_t *win_canvas;       // hbm_mem's pixels, CANVAS_WIDTH per row
 
 COLORREF get_color_rgb(uint8_t color) {
     switch(color) {
@@ -213,85 +528,162 @@ COLORREF get_color_rgb(uint8_t color) {
     }
 }
 
+// Pixel mode goes through a 32-bit top-down DIB that StretchDIBits
+// scales 2x into the memory DC
+uint32_t dib_pixels[PIXEL_HEIGHT][PIXEL_WIDTH];
+
+static void paint_pixels(const Frame *f, RECT *bounds) {
+    static BITMAPINFO bmi;
+    const Damage *d = &f->damage;
+    int y0 = PIXEL_HEIGHT, y1 = 0;
+
+    for (int y = 0; y < PIXEL_HEIGHT; y++) {
+        int x0 = d->full ? 0 : d->pix_lo[y];
+        int x1 = d->full ? PIXEL_WIDTH : d->pix_hi[y];
+        if (x0 >= x1) continue;
+        for (int x = x0; x < x1; x++) {
+            int v = fb_get(f->pixels, f->pixel_depth, x, y);
+            // 1 bpp pixels are RGB(100, 200, 255)
+            dib_pixels[y][x] = f->pixel_depth == 4 ? canvas_palette[v] : v ? 0x0064C8FF : 0;
+        }
+        if (y < y0) y0 = y;
+        y1 = y + 1;
+    }
+    if (y0 >= y1) return;
+
+    if (!bmi.bmiHeader.biSize) {
+        bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        bmi.bmiHeader.biWidth = PIXEL_WIDTH;
+        bmi.bmiHeader.biHeight = -PIXEL_HEIGHT;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+    }
+    SetStretchBltMode(hdc_mem, COLORONCOLOR);
+    StretchDIBits(hdc_mem, 0, 0, SCREEN_WIDTH * CHAR_WIDTH, SCREEN_HEIGHT * CHAR_HEIGHT,
+                  0, 0, PIXEL_WIDTH, PIXEL_HEIGHT, dib_pixels, &bmi, DIB_RGB_COLORS, SRCCOPY);
+
+    RECT band = {0, y0 * CHAR_HEIGHT * SCREEN_HEIGHT / PIXEL_HEIGHT,
+                 SCREEN_WIDTH * CHAR_WIDTH, y1 * CHAR_HEIGHT * SCREEN_HEIGHT / PIXEL_HEIGHT};
+    UnionRect(bounds, bounds, &band);
+}
+
+// Repaint the damaged spans of f into the memory DC. Returns the window
+// area that changed.
+static RECT paint_frame(const Frame *f) {
+    RECT bounds = {0, 0, 0, 0};
+
+    if (f->pixel_mode) {
+        paint_pixels(f, &bounds);
+        return bounds;
+    }
+
+    // Finish any GDI drawing into the DIB section before writing it directly
+    GdiFlush();
+    Band b = compose_text(win_canvas, CANVAS_WIDTH, f, f->damage.full);
+    if (b.x0 < b.x1) SetRect(&bounds, b.x0, b.y0, b.x1, b.y1);
+    return bounds;
+}
+
+// Take the cell masks for the printable characters from hfont, drawn
+// white on black into a scratch DIB
+static void load_glyphs(void) {
+    int w = GLYPH_COUNT * CHAR_WIDTH * 2;
+    BITMAPINFO bmi;
+    void *bits;
+
+    memset(&bmi, 0, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = w;
+    bmi.bmiHeader.biHeight = -CHAR_HEIGHT;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    HDC dc = CreateCompatibleDC(hdc_mem);
+    HBITMAP bm = CreateDIBSection(dc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (bm) {
+        HGDIOBJ old_bm = SelectObject(dc, bm);
+        HGDIOBJ old_font = SelectObject(dc, hfont);
+        PatBlt(dc, 0, 0, w, CHAR_HEIGHT, BLACKNESS);
+        SetBkMode(dc, TRANSPARENT);
+        SetTextColor(dc, RGB(255, 255, 255));
+        for (int g = 0; g < GLYPH_COUNT; g++) {
+            char c = (char)(GLYPH_FIRST + g);
+            TextOutA(dc, g * CHAR_WIDTH * 2, 0, &c, 1);
+        }
+        GdiFlush();
+
+        const uint32_t *px = bits;
+        for (int g = 0; g < GLYPH_COUNT; g++) {
+            for (int y = 0; y < CHAR_HEIGHT; y++) {
+                for (int x = 0; x < CHAR_WIDTH; x++) {
+                    // Threshold the green channel in case of antialiasing
+                    if (((px[y * w + g * CHAR_WIDTH * 2 + x] >> 8) & 0xFF) >= 0x80) {
+                        glyph_masks[g][y] |= 0x80 >> x;
+                    }
+                }
+            }
+        }
+        SelectObject(dc, old_font);
+        SelectObject(dc, old_bm);
+        DeleteObject(bm);
+    }
+    DeleteDC(dc);
+
+    for (int i = 0; i < 16; i++) {
+        COLORREF c = get_color_rgb(i);
+        canvas_palette[i] = (uint32_t)GetRValue(c) << 16 | (uint32_t)GetGValue(c) << 8 | GetBValue(c);
+    }
+    canvas_black = 0;
+    build_glyph_atlas();
+}
+
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     switch (uMsg) {
         case WM_DESTROY:
+            pthread_mutex_lock(&input_buf.mutex);
             window_running = 0;
+            input_changed();
+            pthread_mutex_unlock(&input_buf.mutex);
             PostQuitMessage(0);
             return 0;
         case WM_CHAR:
+            pthread_mutex_lock(&input_buf.mutex);
             if (wParam == VK_RETURN) {
-                pthread_mutex_lock(&input_buf.mutex);
                 input_buf.buffer[input_buf.pos] = '\0';
                 input_buf.ready = 1;
-                input_buf.last_char = '\n';
-                input_buf.char_ready = 1;
-                pthread_mutex_unlock(&input_buf.mutex);
+                queue_key('\n');
             } else if (wParam == VK_BACK) {
-                pthread_mutex_lock(&input_buf.mutex);
                 if (input_buf.pos > 0) {
                     input_buf.pos--;
-                    if (screen.cursor_x > 0) screen.cursor_x--;
-                    screen.chars[screen.cursor_y][screen.cursor_x] = ' ';
-                    screen.dirty = 1;
+                    queue_echo('\b');
                 }
-                pthread_mutex_unlock(&input_buf.mutex);
             } else if (wParam >= 32 && wParam < 127) {
-                pthread_mutex_lock(&input_buf.mutex);
                 if (input_buf.pos < INPUT_BUFFER_SIZE - 1) {
                     input_buf.buffer[input_buf.pos++] = (char)wParam;
-                    input_buf.last_char = (char)wParam;
-                    input_buf.char_ready = 1;
-                    if (screen.cursor_x < SCREEN_WIDTH) {
-                        screen.chars[screen.cursor_y][screen.cursor_x++] = (char)wParam;
-                        screen.dirty = 1;
-                    }
+                    queue_echo((char)wParam);
                 }
-                pthread_mutex_unlock(&input_buf.mutex);
+                queue_key((char)wParam);
             }
+            input_changed();
+            pthread_mutex_unlock(&input_buf.mutex);
             return 0;
+        case WM_KEYDOWN:
+            if (wParam == VK_PRIOR || wParam == VK_NEXT) {
+                pthread_mutex_lock(&input_buf.mutex);
+                input_buf.scroll += wParam == VK_PRIOR ? SCREEN_HEIGHT - 1 : -(SCREEN_HEIGHT - 1);
+                input_changed();
+                pthread_mutex_unlock(&input_buf.mutex);
+                return 0;
+            }
+            break;
         case WM_PAINT: {
             PAINTSTRUCT ps;
             HDC hdc = BeginPaint(hwnd, &ps);
-            
-            HFONT old_font = (HFONT)SelectObject(hdc_mem, hfont);
-            
-            if (screen.pixel_mode) {
-                for (int y = 0; y < PIXEL_HEIGHT; y++) {
-                    for (int x = 0; x < PIXEL_WIDTH; x++) {
-                        int px = x * CHAR_WIDTH * SCREEN_WIDTH / PIXEL_WIDTH;
-                        int py = y * CHAR_HEIGHT * SCREEN_HEIGHT / PIXEL_HEIGHT;
-                        COLORREF color = screen.pixels[y][x] ? RGB(100, 200, 255) : RGB(0, 0, 0);
-                        SetPixel(hdc_mem, px, py, color);
-                    }
-                }
-            } else {
-                for (int y = 0; y < SCREEN_HEIGHT; y++) {
-                    for (int x = 0; x < SCREEN_WIDTH; x++) {
-                        RECT rect = {x * CHAR_WIDTH, y * CHAR_HEIGHT, 
-                                    (x + 1) * CHAR_WIDTH, (y + 1) * CHAR_HEIGHT};
-                        
-                        HBRUSH brush = CreateSolidBrush(RGB(0, 0, 0));
-                        FillRect(hdc_mem, &rect, brush);
-                        DeleteObject(brush);
-                        
-                        COLORREF text_color = get_color_rgb(screen.colors[y][x]);
-                        SetTextColor(hdc_mem, text_color);
-                        SetBkMode(hdc_mem, TRANSPARENT);
-                        
-                        char c = screen.chars[y][x];
-                        if (x == screen.cursor_x && y == screen.cursor_y && screen.cursor_visible) {
-                            c = '_';
-                        }
-                        TextOutA(hdc_mem, x * CHAR_WIDTH, y * CHAR_HEIGHT, &c, 1);
-                    }
-                }
-            }
-            
-            SelectObject(hdc_mem, old_font);
-            BitBlt(hdc, 0, 0, SCREEN_WIDTH * CHAR_WIDTH, SCREEN_HEIGHT * CHAR_HEIGHT,
-                   hdc_mem, 0, 0, SRCCOPY);
-            
+            BitBlt(hdc, ps.rcPaint.left, ps.rcPaint.top,
+                   ps.rcPaint.right - ps.rcPaint.left, ps.rcPaint.bottom - ps.rcPaint.top,
+                   hdc_mem, ps.rcPaint.left, ps.rcPaint.top, SRCCOPY);
             EndPaint(hwnd, &ps);
             return 0;
         }
@@ -320,22 +712,32 @@ void* window_thread(void* arg) {
     
     if (!hwnd) {
         fprintf(stderr, "Failed to create window\n");
+        window_opened(0);
         return NULL;
     }
     
     HDC hdc = GetDC(hwnd);
     hdc_mem = CreateCompatibleDC(hdc);
-    hbm_mem = CreateCompatibleBitmap(hdc, SCREEN_WIDTH * CHAR_WIDTH, 
-                                     SCREEN_HEIGHT * CHAR_HEIGHT);
+    BITMAPINFO bmi;
+    memset(&bmi, 0, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = CANVAS_WIDTH;
+    bmi.bmiHeader.biHeight = -CANVAS_HEIGHT;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    hbm_mem = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, (void **)&win_canvas, NULL, 0);
     SelectObject(hdc_mem, hbm_mem);
     ReleaseDC(hwnd, hdc);
     
     hfont = CreateFontA(16, 8, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
                       DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
                       DEFAULT_QUALITY, FIXED_PITCH | FF_MODERN, "Courier New");
+    load_glyphs();
     
     ShowWindow(hwnd, SW_SHOW);
     UpdateWindow(hwnd);
+    window_opened(1);
     
     MSG msg;
     while (window_running) {
@@ -350,13 +752,18 @@ void* window_thread(void* arg) {
         
         if (!window_running) break;
         
-        if (screen.dirty) {
-            InvalidateRect(hwnd, NULL, FALSE);
-            UpdateWindow(hwnd);
-            screen.dirty = 0;
+        if (acquire_frame()) {
+            RECT changed = paint_frame(&frames[frame_front]);
+            if (!IsRectEmpty(&changed)) {
+                InvalidateRect(hwnd, &changed, FALSE);
+                UpdateWindow(hwnd);
+            }
         }
         
-        Sleep(16);
+        // Sleep until a message arrives or a frame is published
+        MsgWaitForMultipleObjects(frame_wake ? 1 : 0, &frame_wake, FALSE,
+                                  frame_wake ? INFINITE : 16, QS_ALLINPUT);
+        renderer_woken();
     }
     
     return NULL;
@@ -366,6 +773,14 @@ void* window_thread(void* arg) {
 Display *display;
 Window window;
 GC gc;
+
+// The window contents as a 32-bit XImage, in shared memory when the
+// server supports MIT-SHM. NULL when the visual has no 32-bit ZPixmap
+// format; paint_frame() then falls back to core drawing requests.
+XImage *canvas_image;
+int cell_font;              // the GC font is monospaced at CHAR_WIDTH
+XShmSegmentInfo canvas_shm;
+int canvas_use_shm;
 XFontStruct *font;
 XColor xcolors[16];
 
@@ -392,11 +807,229 @@ void init_x11_colors(void) {
     }
 }
 
+static int shm_failed;
+
+static int shm_error_handler(Display *d, XErrorEvent *e) {
+    (void)d;
+    (void)e;
+    shm_failed = 1;
+    return 0;
+}
+
+static XImage *create_shm_image(Visual *visual, int depth, int w, int h) {
+    XImage *img = XShmCreateImage(display, visual, depth, ZPixmap, NULL, &canvas_shm, w, h);
+    if (!img) return NULL;
+
+    canvas_shm.shmid = shmget(IPC_PRIVATE, (size_t)img->bytes_per_line * h, IPC_CREAT | 0600);
+    if (canvas_shm.shmid < 0) {
+        XDestroyImage(img);
+        return NULL;
+    }
+    canvas_shm.shmaddr = img->data = shmat(canvas_shm.shmid, NULL, 0);
+    canvas_shm.readOnly = False;
+
+    // Attaching fails asynchronously on remote displays
+    int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(shm_error_handler);
+    shm_failed = 0;
+    if (canvas_shm.shmaddr != (char *)-1) {
+        XShmAttach(display, &canvas_shm);
+        XSync(display, False);
+    } else {
+        shm_failed = 1;
+    }
+    XSetErrorHandler(old_handler);
+    // Marked for removal now, freed once both sides detach
+    shmctl(canvas_shm.shmid, IPC_RMID, NULL);
+
+    if (shm_failed) {
+        if (canvas_shm.shmaddr != (char *)-1) shmdt(canvas_shm.shmaddr);
+        img->data = NULL;
+        XDestroyImage(img);
+        return NULL;
+    }
+    return img;
+}
+
+void free_canvas(void) {
+    if (!canvas_image) return;
+    if (canvas_use_shm) {
+        XShmDetach(display, &canvas_shm);
+        shmdt(canvas_shm.shmaddr);
+        canvas_image->data = NULL;
+        canvas_use_shm = 0;
+    }
+    XDestroyImage(canvas_image);
+    canvas_image = NULL;
+}
+
+void init_canvas(void) {
+    int scr = DefaultScreen(display);
+    Visual *visual = DefaultVisual(display, scr);
+    int depth = DefaultDepth(display, scr);
+    int w = SCREEN_WIDTH * CHAR_WIDTH, h = SCREEN_HEIGHT * CHAR_HEIGHT;
+
+    if (depth < 24) return;
+
+    if (XShmQueryExtension(display)) {
+        canvas_image = create_shm_image(visual, depth, w, h);
+        canvas_use_shm = canvas_image != NULL;
+    }
+    if (!canvas_image) {
+        canvas_image = XCreateImage(display, visual, depth, ZPixmap, 0, NULL, w, h, 32, 0);
+        if (!canvas_image) return;
+        canvas_image->data = malloc((size_t)canvas_image->bytes_per_line * h);
+        if (!canvas_image->data) {
+            XDestroyImage(canvas_image);
+            canvas_image = NULL;
+            return;
+        }
+    }
+    if (canvas_image->bits_per_pixel != 32) {
+        free_canvas();
+    }
+}
+
+// Send a canvas band to the server in one request
+static void put_canvas(Band b) {
+    if (b.x0 >= b.x1) return;
+    if (canvas_use_shm) {
+        XShmPutImage(display, window, gc, canvas_image, b.x0, b.y0, b.x0, b.y0,
+                     b.x1 - b.x0, b.y1 - b.y0, False);
+        // The server reads the image asynchronously; wait before reusing it
+        XSync(display, False);
+    } else {
+        XPutImage(display, window, gc, canvas_image, b.x0, b.y0, b.x0, b.y0,
+                  b.x1 - b.x0, b.y1 - b.y0);
+    }
+}
+
+// Take the cell masks for the printable characters from the default
+// font, drawn the way XDrawString has always drawn cells
+static void load_glyphs(void) {
+    int scr = DefaultScreen(display);
+    int w = GLYPH_COUNT * CHAR_WIDTH * 2;
+    unsigned long black = BlackPixel(display, scr);
+    Pixmap pm = XCreatePixmap(display, window, w, CHAR_HEIGHT, DefaultDepth(display, scr));
+
+    XSetForeground(display, gc, black);
+    XFillRectangle(display, pm, gc, 0, 0, w, CHAR_HEIGHT);
+    XSetForeground(display, gc, WhitePixel(display, scr));
+    for (int g = 0; g < GLYPH_COUNT; g++) {
+        char c = (char)(GLYPH_FIRST + g);
+        XDrawString(display, pm, gc, g * CHAR_WIDTH * 2, 12, &c, 1);
+    }
+
+    XImage *img = XGetImage(display, pm, 0, 0, w, CHAR_HEIGHT, AllPlanes, ZPixmap);
+    if (img) {
+        for (int g = 0; g < GLYPH_COUNT; g++) {
+            for (int y = 0; y < CHAR_HEIGHT; y++) {
+                for (int x = 0; x < CHAR_WIDTH; x++) {
+                    if (XGetPixel(img, g * CHAR_WIDTH * 2 + x, y) != black) {
+                        glyph_masks[g][y] |= 0x80 >> x;
+                    }
+                }
+            }
+        }
+        XDestroyImage(img);
+    }
+    XFreePixmap(display, pm);
+
+    for (int i = 0; i < 16; i++) canvas_palette[i] = (uint32_t)get_x11_color(i);
+    canvas_black = (uint32_t)black;
+    build_glyph_atlas();
+}
+
+// Repaint the damaged spans of f, or all of it when full is set (the
+// window contents were lost)
+static void paint_frame(const Frame *f, int full) {
+    const Damage *d = &f->damage;
+    unsigned long black = BlackPixel(display, DefaultScreen(display));
+
+    full |= d->full;
+    if (canvas_image) {
+        uint32_t *canvas = (uint32_t *)canvas_image->data;
+        size_t stride = (size_t)canvas_image->bytes_per_line / 4;
+        if (f->pixel_mode) {
+            put_canvas(scale_pixels(canvas, stride, f, full, canvas_palette[COLOR_BRIGHT_CYAN]));
+        } else {
+            put_canvas(compose_text(canvas, stride, f, full));
+        }
+        return;
+    }
+    if (full) {
+        XSetForeground(display, gc, black);
+        XFillRectangle(display, window, gc, 0, 0,
+                       SCREEN_WIDTH * CHAR_WIDTH, SCREEN_HEIGHT * CHAR_HEIGHT);
+    }
+
+    if (f->pixel_mode) {
+        for (int y = 0; y < PIXEL_HEIGHT; y++) {
+            int x0 = full ? 0 : d->pix_lo[y];
+            int x1 = full ? PIXEL_WIDTH : d->pix_hi[y];
+            if (x0 >= x1) continue;
+            int py = y * CHAR_HEIGHT * SCREEN_HEIGHT / PIXEL_HEIGHT;
+            if (!full) {
+                int px0 = x0 * CHAR_WIDTH * SCREEN_WIDTH / PIXEL_WIDTH;
+                int px1 = x1 * CHAR_WIDTH * SCREEN_WIDTH / PIXEL_WIDTH;
+                XSetForeground(display, gc, black);
+                XFillRectangle(display, window, gc, px0, py, px1 - px0, 1);
+            }
+            int ink = -1;
+            for (int x = x0; x < x1; x++) {
+                int v = fb_get(f->pixels, f->pixel_depth, x, y);
+                if (v) {
+                    int color = f->pixel_depth == 4 ? v : COLOR_BRIGHT_CYAN;
+                    int px = x * CHAR_WIDTH * SCREEN_WIDTH / PIXEL_WIDTH;
+                    if (color != ink) XSetForeground(display, gc, get_x11_color(ink = color));
+                    XDrawPoint(display, window, gc, px, py);
+                }
+            }
+        }
+        return;
+    }
+
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        int x0 = full ? 0 : d->text_lo[y];
+        int x1 = full ? SCREEN_WIDTH : d->text_hi[y];
+        if (x0 >= x1) continue;
+        if (!full) {
+            XSetForeground(display, gc, black);
+            XFillRectangle(display, window, gc, x0 * CHAR_WIDTH, y * CHAR_HEIGHT,
+                           (x1 - x0) * CHAR_WIDTH, CHAR_HEIGHT);
+        }
+        // Without a canvas, set the color once per run and, when the font
+        // advances by exactly one cell, draw the whole run in one call
+        char text[SCREEN_WIDTH];
+        memcpy(text, f->chars[y], SCREEN_WIDTH);
+        if (y == f->cursor_y && f->cursor_visible && f->cursor_x < SCREEN_WIDTH) {
+            text[f->cursor_x] = '_';
+        }
+        for (int x = x0; x < x1; ) {
+            int start = x;
+            uint8_t color = f->colors[y][x];
+            while (x < x1 && f->colors[y][x] == color) x++;
+            XSetForeground(display, gc, get_x11_color(color));
+            if (cell_font) {
+                XDrawString(display, window, gc, start * CHAR_WIDTH, y * CHAR_HEIGHT + 12,
+                            text + start, x - start);
+            } else {
+                for (int i = start; i < x; i++) {
+                    if (text[i] != ' ') {
+                        XDrawString(display, window, gc, i * CHAR_WIDTH, y * CHAR_HEIGHT + 12,
+                                    text + i, 1);
+                    }
+                }
+            }
+        }
+    }
+}
+
 void* window_thread(void* arg) {
     (void)arg;
     display = XOpenDisplay(NULL);
     if (!display) {
         fprintf(stderr, "Cannot open X display\n");
+        window_opened(0);
         return NULL;
     }
     
@@ -412,22 +1045,33 @@ void* window_thread(void* arg) {
     XStoreName(display, window, "MicroComputer");
     
     gc = XCreateGC(display, window, 0, NULL);
-    font = XLoadQueryFont(display, "fixed");
+    // Prefer a font that matches the 8x16 cell
+    font = XLoadQueryFont(display, "8x16");
+    if (!font) font = XLoadQueryFont(display, "fixed");
     if (font) XSetFont(display, gc, font->fid);
+    cell_font = font && font->min_bounds.width == CHAR_WIDTH &&
+                font->max_bounds.width == CHAR_WIDTH;
     
     init_x11_colors();
+    init_canvas();
+    if (canvas_image) load_glyphs();
     
     XMapWindow(display, window);
     XFlush(display);
+    window_opened(1);
     
     XEvent event;
+    int redraw = 1;
     while (window_running) {
         while (XPending(display) > 0) {
             XNextEvent(display, &event);
             if (event.type == DestroyNotify) {
+                pthread_mutex_lock(&input_buf.mutex);
                 window_running = 0;
+                input_changed();
+                pthread_mutex_unlock(&input_buf.mutex);
             } else if (event.type == Expose) {
-                screen.dirty = 1;
+                redraw = 1;
             } else if (event.type == KeyPress) {
                 char buf[32];
                 KeySym keysym;
@@ -438,88 +1082,145 @@ void* window_thread(void* arg) {
                 if (keysym == XK_Return || keysym == XK_KP_Enter) {
                     input_buf.buffer[input_buf.pos] = '\0';
                     input_buf.ready = 1;
-                    input_buf.last_char = '\n';
-                    input_buf.char_ready = 1;
+                    queue_key('\n');
                 } else if (keysym == XK_BackSpace) {
                     if (input_buf.pos > 0) {
                         input_buf.pos--;
-                        if (screen.cursor_x > 0) screen.cursor_x--;
-                        screen.chars[screen.cursor_y][screen.cursor_x] = ' ';
-                        screen.dirty = 1;
+                        queue_echo('\b');
                     }
+                } else if (keysym == XK_Prior || keysym == XK_KP_Prior) {
+                    input_buf.scroll += SCREEN_HEIGHT - 1;
+                } else if (keysym == XK_Next || keysym == XK_KP_Next) {
+                    input_buf.scroll -= SCREEN_HEIGHT - 1;
                 } else if (len > 0 && buf[0] >= 32 && buf[0] < 127) {
                     if (input_buf.pos < INPUT_BUFFER_SIZE - 1) {
                         input_buf.buffer[input_buf.pos++] = buf[0];
-                        input_buf.last_char = buf[0];
-                        input_buf.char_ready = 1;
-                        if (screen.cursor_x < SCREEN_WIDTH) {
-                            screen.chars[screen.cursor_y][screen.cursor_x++] = buf[0];
-                            screen.dirty = 1;
-                        }
+                        queue_echo(buf[0]);
                     }
+                    queue_key(buf[0]);
                 }
                 
+                input_changed();
                 pthread_mutex_unlock(&input_buf.mutex);
             }
         }
         
-        if (screen.dirty) {
-            XSetForeground(display, gc, BlackPixel(display, DefaultScreen(display)));
-            XFillRectangle(display, window, gc, 0, 0, 
-                          SCREEN_WIDTH * CHAR_WIDTH, SCREEN_HEIGHT * CHAR_HEIGHT);
-            
-            if (screen.pixel_mode) {
-                XSetForeground(display, gc, get_x11_color(COLOR_BRIGHT_CYAN));
-                for (int y = 0; y < PIXEL_HEIGHT; y++) {
-                    for (int x = 0; x < PIXEL_WIDTH; x++) {
-                        if (screen.pixels[y][x]) {
-                            int px = x * CHAR_WIDTH * SCREEN_WIDTH / PIXEL_WIDTH;
-                            int py = y * CHAR_HEIGHT * SCREEN_HEIGHT / PIXEL_HEIGHT;
-                            XDrawPoint(display, window, gc, px, py);
-                        }
-                    }
-                }
-            } else {
-                for (int y = 0; y < SCREEN_HEIGHT; y++) {
-                    for (int x = 0; x < SCREEN_WIDTH; x++) {
-                        char c = screen.chars[y][x];
-                        if (x == screen.cursor_x && y == screen.cursor_y && screen.cursor_visible) {
-                            c = '_';
-                        }
-                        if (c != ' ') {
-                            XSetForeground(display, gc, get_x11_color(screen.colors[y][x]));
-                            XDrawString(display, window, gc, 
-                                      x * CHAR_WIDTH, y * CHAR_HEIGHT + 12,
-                                      &c, 1);
-                        }
-                    }
-                }
-            }
+        if (acquire_frame() || redraw) {
+            paint_frame(&frames[frame_front], redraw);
+            redraw = 0;
             XFlush(display);
-            screen.dirty = 0;
         }
+        if (!window_running || XPending(display) > 0) continue;
         
-        sleep_us(16000);
+        // Sleep until the server sends an event or a frame is published
+        int xfd = ConnectionNumber(display);
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(xfd, &fds);
+        struct timeval tick = {0, 16000};   // no wake pipe: look for frames each tick
+        if (frame_wake[0] >= 0) FD_SET(frame_wake[0], &fds);
+        select((xfd > frame_wake[0] ? xfd : frame_wake[0]) + 1, &fds, NULL, NULL,
+               frame_wake[0] >= 0 ? NULL : &tick);
+        renderer_woken();
     }
     
+    free_canvas();
     XCloseDisplay(display);
     return NULL;
 }
 #endif
 
 void putchar_screen(char c);
+void present_screen(void);
+void export_screen(void);
 
-void init_screen(void) {
-    memset(&screen, 0, sizeof(VScreen));
+// Damage tracking. Everything that writes screen reports the cells or
+// pixels it touched, so the renderers only repaint changed spans.
+static void damage_clear(Damage *d) {
+    memset(d->text_lo, 0xFF, sizeof(d->text_lo));
+    memset(d->text_hi, 0, sizeof(d->text_hi));
+    memset(d->pix_lo, 0xFF, sizeof(d->pix_lo));
+    memset(d->pix_hi, 0, sizeof(d->pix_hi));
+    d->full = 0;
+}
+
+static void damage_merge(Damage *d, const Damage *src) {
     for (int y = 0; y < SCREEN_HEIGHT; y++) {
-        for (int x = 0; x < SCREEN_WIDTH; x++) {
-            screen.chars[y][x] = ' ';
-            screen.colors[y][x] = COLOR_WHITE;
+        if (src->text_lo[y] < d->text_lo[y]) d->text_lo[y] = src->text_lo[y];
+        if (src->text_hi[y] > d->text_hi[y]) d->text_hi[y] = src->text_hi[y];
+    }
+    for (int y = 0; y < PIXEL_HEIGHT; y++) {
+        if (src->pix_lo[y] < d->pix_lo[y]) d->pix_lo[y] = src->pix_lo[y];
+        if (src->pix_hi[y] > d->pix_hi[y]) d->pix_hi[y] = src->pix_hi[y];
+    }
+    d->full |= src->full;
+}
+
+void damage_text(int y, int x0, int x1) {
+    Damage *d = &screen.damage;
+    if (y < 0 || y >= SCREEN_HEIGHT) return;
+    if (x0 < 0) x0 = 0;
+    if (x1 > SCREEN_WIDTH) x1 = SCREEN_WIDTH;
+    if (x0 >= x1) return;
+    if (x0 < d->text_lo[y]) d->text_lo[y] = (uint8_t)x0;
+    if (x1 > d->text_hi[y]) d->text_hi[y] = (uint8_t)x1;
+    screen.dirty = 1;
+}
+
+void damage_pixels(int y, int x0, int x1) {
+    Damage *d = &screen.damage;
+    if (x0 < d->pix_lo[y]) d->pix_lo[y] = (uint16_t)x0;
+    if (x1 > d->pix_hi[y]) d->pix_hi[y] = (uint16_t)x1;
+    screen.dirty = 1;
+}
+
+void damage_full(void) {
+    screen.damage.full = 1;
+    screen.dirty = 1;
+}
+
+// Text row y of the screen; negative rows reach into the scrollback
+static inline int text_row_index(int y) {
+    int r = (screen.top + y) % screen.text_rows;
+    return r < 0 ? r + screen.text_rows : r;
+}
+
+static inline char *text_row(int y) {
+    return screen.chars + (size_t)text_row_index(y) * SCREEN_WIDTH;
+}
+
+static inline uint8_t *color_row(int y) {
+    return screen.colors + (size_t)text_row_index(y) * SCREEN_WIDTH;
+}
+
+void init_screen(void) {
+    char *chars = screen.chars;
+    uint8_t *colors = screen.colors;
+    int rows = SCREEN_HEIGHT + scrollback_lines;
+
+    if (!chars || screen.text_rows != rows) {
+        free(chars);
+        free(colors);
+        chars = malloc((size_t)rows * SCREEN_WIDTH);
+        colors = malloc((size_t)rows * SCREEN_WIDTH);
+        if (!chars || !colors) {
+            fprintf(stderr, "Out of memory for %d rows of scrollback\n", scrollback_lines);
+            exit(1);
         }
     }
+
+    memset(&screen, 0, sizeof(VScreen));
+    screen.chars = chars;
+    screen.colors = colors;
+    screen.text_rows = rows;
+    damage_clear(&screen.damage);
+    damage_full();
+    memset(chars, ' ', (size_t)rows * SCREEN_WIDTH);
+    memset(colors, COLOR_WHITE, (size_t)rows * SCREEN_WIDTH);
     screen.cursor_visible = 1;
     screen.dirty = 1;
     screen.pixel_mode = 0;
+    screen.pixel_depth = 1;
     screen.current_color = COLOR_WHITE;
 }
 
@@ -527,25 +1228,177 @@ void clear_screen_display(void) {
     init_screen();
 }
 
-void clear_pixels(void) {
-    memset(screen.pixels, 0, sizeof(screen.pixels));
-    screen.dirty = 1;
+// Pixel drawing. Primitives clip once and then work on whole spans of a
+// row: masked edge bytes (or nibbles) around a memset of the middle.
+
+// Color primitives draw in: set at 1 bpp, the text color at 4 bpp
+static int fb_ink(void) {
+    return screen.pixel_depth == 4 ? screen.current_color & 0x0F : 1;
 }
 
-void set_pixel(int x, int y, int value) {
-    if (x >= 0 && x < PIXEL_WIDTH && y >= 0 && y < PIXEL_HEIGHT) {
-        screen.pixels[y][x] = value ? 1 : 0;
-        screen.dirty = 1;
+// Clip a rectangle to the framebuffer; returns 0 if nothing is left
+static int fb_clip(int *x, int *y, int *w, int *h) {
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*w > PIXEL_WIDTH - *x) *w = PIXEL_WIDTH - *x;
+    if (*h > PIXEL_HEIGHT - *y) *h = PIXEL_HEIGHT - *y;
+    return *w > 0 && *h > 0;
+}
+
+// Fill pixels [x0, x1) of row y, already clipped, with v
+static void fb_span(int y, int x0, int x1, int v) {
+    uint8_t *row = screen.pixels + y * fb_stride(screen.pixel_depth);
+
+    damage_pixels(y, x0, x1);
+    if (screen.pixel_depth == 4) {
+        v &= 0x0F;
+        if (x0 & 1) {
+            row[x0 >> 1] = (row[x0 >> 1] & 0xF0) | v;
+            x0++;
+        }
+        if ((x1 & 1) && x0 < x1) {
+            row[x1 >> 1] = (row[x1 >> 1] & 0x0F) | v << 4;
+            x1--;
+        }
+        if (x0 < x1) memset(row + (x0 >> 1), v * 0x11, (size_t)(x1 - x0) >> 1);
+    } else {
+        uint8_t fill = v ? 0xFF : 0x00;
+        int b0 = x0 >> 3, b1 = (x1 - 1) >> 3;
+        uint8_t m0 = 0xFF >> (x0 & 7);
+        uint8_t m1 = (uint8_t)(0xFF << (7 - ((x1 - 1) & 7)));
+        if (b0 == b1) {
+            m0 &= m1;
+            row[b0] = (row[b0] & ~m0) | (fill & m0);
+            return;
+        }
+        row[b0] = (row[b0] & ~m0) | (fill & m0);
+        memset(row + b0 + 1, fill, (size_t)(b1 - b0 - 1));
+        row[b1] = (row[b1] & ~m1) | (fill & m1);
+    }
+}
+
+void fb_fill(int x, int y, int w, int h, int v) {
+    if (!fb_clip(&x, &y, &w, &h)) return;
+    for (int i = 0; i < h; i++) {
+        fb_span(y + i, x, x + w, v);
+    }
+}
+
+// Switch the framebuffer format; the contents are cleared
+void set_pixel_depth(int depth) {
+    screen.pixel_depth = depth == 4 ? 4 : 1;
+    memset(screen.pixels, 0, sizeof(screen.pixels));
+    damage_full();
+}
+
+void clear_pixels(void) {
+    memset(screen.pixels, 0, (size_t)PIXEL_HEIGHT * fb_stride(screen.pixel_depth));
+    for (int y = 0; y < PIXEL_HEIGHT; y++) {
+        damage_pixels(y, 0, PIXEL_WIDTH);
+    }
+}
+
+void set_pixel(int x, int y, int value) {
+    if (x >= 0 && x < PIXEL_WIDTH && y >= 0 && y < PIXEL_HEIGHT) {
+        int v = screen.pixel_depth == 4 ? value & 0x0F : value != 0;
+        if (fb_get(screen.pixels, screen.pixel_depth, x, y) == v) return;
+        fb_span(y, x, x + 1, v);
+    }
+}
+
+// 8 bits of a 1 bpp row starting at bit off, which may be negative;
+// bits outside the row read as 0
+static uint8_t fb_bits_at(const uint8_t *row, int nbytes, int off) {
+    int k = off >= 0 ? off >> 3 : -((-off + 7) >> 3);
+    int s = off & 7;
+    unsigned hi = (k >= 0 && k < nbytes) ? row[k] : 0;
+    unsigned lo = (k + 1 >= 0 && k + 1 < nbytes) ? row[k + 1] : 0;
+    return (uint8_t)((hi << 8 | lo) >> (8 - s));
+}
+
+// Copy a w x h image in the current pixel format (rows of src_stride
+// bytes) to (x, y). With transparent set, 0 pixels leave the framebuffer
+// alone. 1 bpp rows are shifted into place a byte at a time; 4 bpp rows
+// with matching nibble alignment are copied with memcpy.
+void fb_blit(int x, int y, int w, int h, const uint8_t *src, int src_stride, int transparent) {
+    int sx = x < 0 ? -x : 0, sy = y < 0 ? -y : 0;
+    if (!fb_clip(&x, &y, &w, &h)) return;
+
+    int depth = screen.pixel_depth, stride = fb_stride(depth);
+    for (int i = 0; i < h; i++) {
+        const uint8_t *s_row = src + (size_t)(sy + i) * src_stride;
+        uint8_t *d_row = screen.pixels + (y + i) * stride;
+        int x0 = x, x1 = x + w;
+
+        damage_pixels(y + i, x0, x1);
+        if (depth == 1) {
+            for (int b = x0 >> 3; b <= (x1 - 1) >> 3; b++) {
+                uint8_t m = 0xFF;
+                if (b == x0 >> 3) m &= 0xFF >> (x0 & 7);
+                if (b == (x1 - 1) >> 3) m &= (uint8_t)(0xFF << (7 - ((x1 - 1) & 7)));
+                uint8_t bits = fb_bits_at(s_row, src_stride, sx + b * 8 - x0);
+                if (transparent) {
+                    d_row[b] |= bits & m;
+                } else {
+                    d_row[b] = (d_row[b] & ~m) | (bits & m);
+                }
+            }
+        } else if (!transparent && !((x0 ^ sx) & 1)) {
+            int d = x0, s2 = sx;
+            if (d & 1) {
+                d_row[d >> 1] = (d_row[d >> 1] & 0xF0) | (s_row[s2 >> 1] & 0x0F);
+                d++;
+                s2++;
+            }
+            int n = (x1 - d) >> 1;
+            memcpy(d_row + (d >> 1), s_row + (s2 >> 1), (size_t)n);
+            if ((x1 - d) & 1) {
+                int last = x1 - 1, sl = s2 + (last - d);
+                d_row[last >> 1] = (d_row[last >> 1] & 0x0F) | (s_row[sl >> 1] & 0xF0);
+            }
+        } else {
+            for (int j = 0; j < w; j++) {
+                int px = sx + j;
+                int v = (px & 1) ? s_row[px >> 1] & 0x0F : s_row[px >> 1] >> 4;
+                if (transparent && !v) continue;
+                int dx = x0 + j;
+                if (dx & 1) {
+                    d_row[dx >> 1] = (d_row[dx >> 1] & 0xF0) | v;
+                } else {
+                    d_row[dx >> 1] = (d_row[dx >> 1] & 0x0F) | v << 4;
+                }
+            }
+        }
     }
 }
 
+// Sprite flags
+#define SPRITE_TRANSPARENT 0x01     // 0 pixels leave the background alone
+
+// Draw the w x h bitmap at memory[addr], stored in the current pixel
+// format with each row padded to a whole byte. Rows that would run past
+// the end of memory are dropped.
+void draw_sprite(uint16_t addr, int x, int y, int w, int h, int flags) {
+    int stride = (w * screen.pixel_depth + 7) / 8;
+    if (w <= 0 || h <= 0) return;
+    if ((MEM_SIZE - addr) / stride < h) h = (MEM_SIZE - addr) / stride;
+    fb_blit(x, y, w, h, &cpu.memory[addr], stride, flags & SPRITE_TRANSPARENT);
+}
+
 void draw_line(int x0, int y0, int x1, int y1) {
     int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
     int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
     int err = dx + dy, e2;
     
+    int ink = fb_ink();
+
+    if (y0 == y1) {
+        int lo = x0 < x1 ? x0 : x1;
+        fb_fill(lo, y0, dx + 1, 1, ink);
+        return;
+    }
     while (1) {
-        set_pixel(x0, y0, 1);
+        set_pixel(x0, y0, ink);
         if (x0 == x1 && y0 == y1) break;
         e2 = 2 * err;
         if (e2 >= dy) { err += dy; x0 += sx; }
@@ -554,37 +1407,32 @@ void draw_line(int x0, int y0, int x1, int y1) {
 }
 
 void draw_rect(int x, int y, int w, int h) {
-    for (int i = 0; i < w; i++) {
-        set_pixel(x + i, y, 1);
-        set_pixel(x + i, y + h - 1, 1);
-    }
-    for (int i = 0; i < h; i++) {
-        set_pixel(x, y + i, 1);
-        set_pixel(x + w - 1, y + i, 1);
-    }
+    int ink = fb_ink();
+    if (w <= 0 || h <= 0) return;
+    fb_fill(x, y, w, 1, ink);
+    fb_fill(x, y + h - 1, w, 1, ink);
+    fb_fill(x, y, 1, h, ink);
+    fb_fill(x + w - 1, y, 1, h, ink);
 }
 
 void fill_rect(int x, int y, int w, int h) {
-    for (int i = 0; i < h; i++) {
-        for (int j = 0; j < w; j++) {
-            set_pixel(x + j, y + i, 1);
-        }
-    }
+    fb_fill(x, y, w, h, fb_ink());
 }
 
 void draw_circle(int cx, int cy, int radius) {
     int x = radius, y = 0;
     int err = 0;
+    int ink = fb_ink();
     
     while (x >= y) {
-        set_pixel(cx + x, cy + y, 1);
-        set_pixel(cx + y, cy + x, 1);
-        set_pixel(cx - y, cy + x, 1);
-        set_pixel(cx - x, cy + y, 1);
-        set_pixel(cx - x, cy - y, 1);
-        set_pixel(cx - y, cy - x, 1);
-        set_pixel(cx + y, cy - x, 1);
-        set_pixel(cx + x, cy - y, 1);
+        set_pixel(cx + x, cy + y, ink);
+        set_pixel(cx + y, cy + x, ink);
+        set_pixel(cx - y, cy + x, ink);
+        set_pixel(cx - x, cy + y, ink);
+        set_pixel(cx - x, cy - y, ink);
+        set_pixel(cx - y, cy - x, ink);
+        set_pixel(cx + y, cy - x, ink);
+        set_pixel(cx + x, cy - y, ink);
         
         if (err <= 0) {
             y += 1;
@@ -597,7 +1445,35 @@ void draw_circle(int cx, int cy, int radius) {
     }
 }
 
+// Shell output capture. While shell_out is set, what the shell prints
+// (os_mode 1) is appended to it instead of drawn: scripts collect each
+// command's output this way, and "> FILE" sends it to a file. Programs
+// still draw on the screen.
+typedef struct {
+    char *data;
+    size_t len, cap;
+} ShellOutput;
+
+_Thread_local ShellOutput *shell_out;
+
+static void shell_append(ShellOutput *o, const void *p, size_t n) {
+    if (o->len + n > o->cap) {
+        size_t cap = o->cap ? o->cap : 256;
+        while (cap < o->len + n) cap *= 2;
+        char *data = realloc(o->data, cap);
+        if (!data) return;
+        o->data = data;
+        o->cap = cap;
+    }
+    memcpy(o->data + o->len, p, n);
+    o->len += n;
+}
+
 void putchar_screen(char c) {
+    if (shell_out && os_mode) {
+        shell_append(shell_out, &c, 1);
+        return;
+    }
     if (c == '\n') {
         screen.cursor_y++;
         screen.cursor_x = 0;
@@ -613,20 +1489,23 @@ void putchar_screen(char c) {
             screen.cursor_y++;
         }
         if (screen.cursor_y >= SCREEN_HEIGHT) {
-            for (int y = 0; y < SCREEN_HEIGHT - 1; y++) {
-                memcpy(screen.chars[y], screen.chars[y+1], SCREEN_WIDTH);
-                memcpy(screen.colors[y], screen.colors[y+1], SCREEN_WIDTH);
-            }
-            memset(screen.chars[SCREEN_HEIGHT-1], ' ', SCREEN_WIDTH);
-            for (int x = 0; x < SCREEN_WIDTH; x++) {
-                screen.colors[SCREEN_HEIGHT-1][x] = screen.current_color;
-            }
+            // The old top row stays behind as scrollback; the row coming
+            // round is the oldest history row, reused as the new bottom
+            screen.top = text_row_index(1);
+            if (screen.history < screen.text_rows - SCREEN_HEIGHT) screen.history++;
+            memset(text_row(SCREEN_HEIGHT - 1), ' ', SCREEN_WIDTH);
+            memset(color_row(SCREEN_HEIGHT - 1), screen.current_color, SCREEN_WIDTH);
             screen.cursor_y = SCREEN_HEIGHT - 1;
+            for (int y = 0; y < SCREEN_HEIGHT; y++) {
+                damage_text(y, 0, SCREEN_WIDTH);
+            }
         }
-        screen.chars[screen.cursor_y][screen.cursor_x] = c;
-        screen.colors[screen.cursor_y][screen.cursor_x] = screen.current_color;
+        text_row(screen.cursor_y)[screen.cursor_x] = c;
+        color_row(screen.cursor_y)[screen.cursor_x] = screen.current_color;
+        damage_text(screen.cursor_y, screen.cursor_x, screen.cursor_x + 1);
         screen.cursor_x++;
     }
+    screen.view = 0;        // new output snaps the view back to live
     screen.dirty = 1;
 }
 
@@ -636,22 +1515,128 @@ void print_to_screen(const char *str) {
     }
 }
 
+// Draw keys echoed by the window thread since the last call
+static void apply_echo(void) {
+    char echo[INPUT_BUFFER_SIZE];
+    int n, scroll;
+
+    pthread_mutex_lock(&input_buf.mutex);
+    n = input_buf.echo_len;
+    memcpy(echo, input_buf.echo, n);
+    input_buf.echo_len = 0;
+    scroll = input_buf.scroll;
+    input_buf.scroll = 0;
+    pthread_mutex_unlock(&input_buf.mutex);
+
+    if (n > 0) screen.view = 0;
+    for (int i = 0; i < n; i++) {
+        if (echo[i] == '\b') {
+            if (screen.cursor_x > 0) screen.cursor_x--;
+            text_row(screen.cursor_y)[screen.cursor_x] = ' ';
+        } else if (screen.cursor_x < SCREEN_WIDTH) {
+            text_row(screen.cursor_y)[screen.cursor_x++] = echo[i];
+        }
+        damage_text(screen.cursor_y, screen.cursor_x - 1, screen.cursor_x + 1);
+    }
+
+    if (scroll) {
+        int view = screen.view + scroll;
+        if (view > screen.history) view = screen.history;
+        if (view < 0) view = 0;
+        screen.view = view;
+    }
+}
+
+// Publish the current screen to the renderer. Callers publish where the
+// screen is consistent: scheduler slice boundaries and yields.
+//
+// A frame's damage is relative to the last frame the renderer actually
+// took. While the previous publish is still unclaimed it may yet be
+// skipped, so its damage is carried into this one; once the renderer has
+// claimed it, the carry starts over. Headless runs have no renderer and
+// publish nothing.
+void present_screen(void) {
+    static Damage carry;
+    static int shown_x = -1, shown_y = -1, shown_visible, shown_mode = -1, shown_view;
+
+    if (headless) return;
+    apply_echo();
+    if (shown_x != screen.cursor_x || shown_y != screen.cursor_y ||
+        shown_visible != screen.cursor_visible) {
+        damage_text(shown_y, shown_x, shown_x + 1);
+        damage_text(screen.cursor_y, screen.cursor_x, screen.cursor_x + 1);
+        shown_x = screen.cursor_x;
+        shown_y = screen.cursor_y;
+        shown_visible = screen.cursor_visible;
+    }
+    if (shown_mode != screen.pixel_mode) {
+        damage_full();
+        shown_mode = screen.pixel_mode;
+    }
+    // Damage is kept in live screen rows; a scrolled-back view just
+    // repaints whole frames
+    if (shown_view != screen.view || (screen.view && screen.dirty)) {
+        damage_full();
+        shown_view = screen.view;
+    }
+    if (!screen.dirty) return;
+    screen.dirty = 0;
+
+    export_screen();
+    if (!(atomic_load(&frame_latest) & FRAME_FRESH)) damage_clear(&carry);
+    damage_merge(&carry, &screen.damage);
+    damage_clear(&screen.damage);
+
+    Frame *f = &frames[frame_back];
+    f->damage = carry;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        memcpy(f->chars[y], text_row(y - screen.view), SCREEN_WIDTH);
+        memcpy(f->colors[y], color_row(y - screen.view), SCREEN_WIDTH);
+    }
+    memcpy(f->pixels, screen.pixels, (size_t)PIXEL_HEIGHT * fb_stride(screen.pixel_depth));
+    f->pixel_depth = screen.pixel_depth;
+    f->cursor_x = screen.cursor_x;
+    f->cursor_y = screen.cursor_y + screen.view;
+    f->cursor_visible = screen.cursor_visible && f->cursor_y < SCREEN_HEIGHT;
+    f->pixel_mode = screen.pixel_mode;
+    frame_back = (int)(atomic_exchange(&frame_latest, (unsigned)frame_back | FRAME_FRESH) & 3);
+    wake_renderer();
+}
+
+// Publish the screen, then sleep. Used wherever the shell or a program
+// waits, so everything drawn before the wait becomes visible.
+// Headless runs never wait.
+void yield_ms(int ms) {
+    present_screen();
+    if (!headless) sleep_ms(ms);
+}
+
+// Sleep until *flag (an input_buf field) is set or the window closes,
+// republishing the screen after every input event so typing and
+// scrolling show at once. Called and returns with the mutex held.
+static void wait_for_input(const int *flag) {
+    while (!*flag && window_running) {
+        unsigned seen = input_buf.events;
+        pthread_mutex_unlock(&input_buf.mutex);
+        present_screen();
+        pthread_mutex_lock(&input_buf.mutex);
+        while (input_buf.events == seen && !*flag && window_running) {
+            pthread_cond_wait(&input_buf.changed, &input_buf.mutex);
+        }
+    }
+}
+
 char* read_line_from_screen(void) {
     static char line_buf[INPUT_BUFFER_SIZE];
     
     pthread_mutex_lock(&input_buf.mutex);
     input_buf.pos = 0;
     input_buf.ready = 0;
-    pthread_mutex_unlock(&input_buf.mutex);
-    
-    while (!input_buf.ready && window_running) {
-        sleep_ms(50);
-    }
-    
-    pthread_mutex_lock(&input_buf.mutex);
-    strcpy(line_buf, input_buf.buffer);
+    wait_for_input(&input_buf.ready);
+    strcpy(line_buf, input_buf.ready ? input_buf.buffer : "");
     input_buf.pos = 0;
     input_buf.ready = 0;
+    input_buf.key_count = 0;        // the line's keys are not a program's
     pthread_mutex_unlock(&input_buf.mutex);
     
     putchar_screen('\n');
@@ -659,18 +1644,284 @@ char* read_line_from_screen(void) {
     return line_buf;
 }
 
-void play_beep(int freq, int duration) {
-    (void)freq;
-    (void)duration;
+// Audio. A tone never holds up the CPU: queue_tone() drops a command into
+// a lock-free ring and returns, and a mixer thread renders AUDIO_VOICES
+// channels into the stream it feeds the sound device. Each channel plays
+// its tones back to back. The device library is loaded at run time (ALSA,
+// which PulseAudio and PipeWire serve too, or waveOut), so the build needs
+// no audio headers; without a device each tone is the old bell.
+#define AUDIO_RATE      22050
+#define AUDIO_VOICES    4
+#define AUDIO_PERIOD    512     // samples per device write, about 23 ms
+#define AUDIO_RING      64      // commands in flight (a power of two)
+#define AUDIO_QUEUE     32      // tones waiting on one channel
+#define AUDIO_LEVEL     6000    // peak of one channel; all four stay unclipped
+
+enum { WAVE_SQUARE, WAVE_TRIANGLE, WAVE_SAWTOOTH, WAVE_NOISE };
+
+typedef struct {
+    uint8_t voice, wave;
+    uint16_t freq;          // Hz; 0 is a rest
+    uint16_t duration;      // ms; 0 silences the channel and drops its queue
+} ToneCmd;
+
+typedef struct {
+    ToneCmd queue[AUDIO_QUEUE];
+    int head, count;
+    uint32_t left;          // samples left of the current tone
+    uint32_t phase, step;   // phase accumulator, one cycle per 2^32
+    uint8_t wave;
+    uint16_t noise;         // LFSR for WAVE_NOISE
+} Voice;
+
+static struct {
+    pthread_mutex_t mutex;  // only for the mixer to sleep on while silent
+    pthread_cond_t wake;
+    ToneCmd ring[AUDIO_RING];
+    atomic_uint head;       // advanced by the CPU thread alone
+    atomic_uint tail;       // advanced by the mixer alone
+    Voice voices[AUDIO_VOICES];     // the mixer's own
+} audio = { .mutex = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
 #ifdef _WIN32
-    Beep(freq, duration);
+// waveOut, looked up in winmm.dll rather than linked
+#define AUDIO_BUFFERS 4
+
+static __typeof__(&waveOutOpen) wave_open;
+static __typeof__(&waveOutPrepareHeader) wave_prepare;
+static __typeof__(&waveOutUnprepareHeader) wave_unprepare;
+static __typeof__(&waveOutWrite) wave_write;
+static HWAVEOUT wave_out;
+static WAVEHDR wave_hdr[AUDIO_BUFFERS];
+static int16_t wave_buf[AUDIO_BUFFERS][AUDIO_PERIOD];
+static int wave_next;
+
+static int audio_open(void) {
+    HMODULE winmm = LoadLibraryA("winmm.dll");
+    if (!winmm) return -1;
+    wave_open = (__typeof__(wave_open))(void *)GetProcAddress(winmm, "waveOutOpen");
+    wave_prepare = (__typeof__(wave_prepare))(void *)GetProcAddress(winmm, "waveOutPrepareHeader");
+    wave_unprepare = (__typeof__(wave_unprepare))(void *)GetProcAddress(winmm, "waveOutUnprepareHeader");
+    wave_write = (__typeof__(wave_write))(void *)GetProcAddress(winmm, "waveOutWrite");
+    if (!wave_open || !wave_prepare || !wave_unprepare || !wave_write) return -1;
+
+    WAVEFORMATEX fmt = { WAVE_FORMAT_PCM, 1, AUDIO_RATE, AUDIO_RATE * 2, 2, 16, 0 };
+    if (wave_open(&wave_out, WAVE_MAPPER, &fmt, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR) return -1;
+    for (int i = 0; i < AUDIO_BUFFERS; i++) wave_hdr[i].dwFlags = WHDR_DONE;
+    return 0;
+}
+
+// Waits for the oldest buffer to finish playing, then queues the next
+static void audio_write(const int16_t *samples) {
+    WAVEHDR *h = &wave_hdr[wave_next];
+    while (!(h->dwFlags & WHDR_DONE)) Sleep(1);
+    if (h->dwFlags & WHDR_PREPARED) wave_unprepare(wave_out, h, sizeof(*h));
+    memcpy(wave_buf[wave_next], samples, sizeof(wave_buf[0]));
+    h->lpData = (LPSTR)wave_buf[wave_next];
+    h->dwBufferLength = sizeof(wave_buf[0]);
+    h->dwFlags = 0;
+    wave_prepare(wave_out, h, sizeof(*h));
+    wave_write(wave_out, h, sizeof(*h));
+    wave_next = (wave_next + 1) % AUDIO_BUFFERS;
+}
+
+static void audio_bell(const ToneCmd *t) {
+    Beep(t->freq, t->duration);
+}
 #else
+// ALSA, through the handful of libasound calls it needs. The values are
+// SND_PCM_STREAM_PLAYBACK, SND_PCM_FORMAT_S16_LE and
+// SND_PCM_ACCESS_RW_INTERLEAVED.
+static struct {
+    int (*open)(void **pcm, const char *name, int stream, int mode);
+    int (*set_params)(void *pcm, int format, int access, unsigned channels,
+                      unsigned rate, int soft_resample, unsigned latency_us);
+    long (*writei)(void *pcm, const void *buf, unsigned long frames);
+    int (*recover)(void *pcm, int err, int silent);
+    void *pcm;
+} alsa;
+
+static int audio_open(void) {
+    void *lib = dlopen("libasound.so.2", RTLD_NOW);
+    if (!lib) return -1;
+    *(void **)&alsa.open = dlsym(lib, "snd_pcm_open");
+    *(void **)&alsa.set_params = dlsym(lib, "snd_pcm_set_params");
+    *(void **)&alsa.writei = dlsym(lib, "snd_pcm_writei");
+    *(void **)&alsa.recover = dlsym(lib, "snd_pcm_recover");
+    if (!alsa.open || !alsa.set_params || !alsa.writei || !alsa.recover) return -1;
+
+    if (alsa.open(&alsa.pcm, "default", 0, 0) < 0) return -1;
+    if (alsa.set_params(alsa.pcm, 2, 3, 1, AUDIO_RATE, 1, 60000) < 0) return -1;
+    return 0;
+}
+
+// Blocks while the device buffer is full, which is what paces the mixer.
+// The stream runs dry whenever every channel goes quiet; that underrun
+// is recovered from on the next write.
+static void audio_write(const int16_t *samples) {
+    unsigned long done = 0;
+    while (done < AUDIO_PERIOD) {
+        long n = alsa.writei(alsa.pcm, samples + done, AUDIO_PERIOD - done);
+        if (n < 0 && alsa.recover(alsa.pcm, (int)n, 1) < 0) return;
+        if (n > 0) done += (unsigned long)n;
+    }
+}
+
+static void audio_bell(const ToneCmd *t) {
+    (void)t;
     printf("\a");
     fflush(stdout);
+}
 #endif
+
+static void start_next_tone(Voice *v) {
+    ToneCmd *t = &v->queue[v->head];
+    v->head = (v->head + 1) % AUDIO_QUEUE;
+    v->count--;
+    v->left = (uint32_t)t->duration * AUDIO_RATE / 1000;
+    v->step = (uint32_t)(((uint64_t)t->freq << 32) / AUDIO_RATE);
+    v->wave = t->wave;
+    if (!v->noise) v->noise = 1;
 }
 
-void show_boot_animation(void) {
+// Moves queued commands onto their channels. Returns whether anything
+// is left to play.
+static int take_tones(int device) {
+    unsigned tail = atomic_load_explicit(&audio.tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&audio.head, memory_order_acquire);
+    for (; tail != head; tail++) {
+        ToneCmd *t = &audio.ring[tail % AUDIO_RING];
+        Voice *v = &audio.voices[t->voice];
+        if (!device) {
+            if (t->freq && t->duration) audio_bell(t);
+        } else if (!t->duration) {
+            v->count = 0;
+            v->left = 0;
+        } else if (v->count < AUDIO_QUEUE) {
+            v->queue[(v->head + v->count++) % AUDIO_QUEUE] = *t;
+        }
+    }
+    atomic_store_explicit(&audio.tail, tail, memory_order_release);
+
+    int playing = 0;
+    for (int i = 0; i < AUDIO_VOICES; i++) {
+        Voice *v = &audio.voices[i];
+        if (!v->left && v->count) start_next_tone(v);
+        playing |= v->left > 0;
+    }
+    return playing;
+}
+
+static inline int voice_sample(Voice *v) {
+    uint32_t phase = v->phase;
+    v->phase += v->step;
+    if (!v->step) return 0;
+    switch (v->wave) {
+        case WAVE_SQUARE:
+            return phase < 0x80000000u ? AUDIO_LEVEL : -AUDIO_LEVEL;
+        case WAVE_TRIANGLE: {
+            int p = (int)(phase >> 16);         // 0..65535
+            int tri = p < 32768 ? p * 2 - 32768 : (65535 - p) * 2 - 32768;
+            return tri * AUDIO_LEVEL / 32768;
+        }
+        case WAVE_SAWTOOTH:
+            return ((int)(phase >> 16) - 32768) * AUDIO_LEVEL / 32768;
+        default:
+            // A new pseudo-random level each cycle of the tone
+            if (v->phase < phase) {
+                v->noise = (uint16_t)((v->noise >> 1) ^ (-(v->noise & 1) & 0xB400u));
+            }
+            return v->noise & 1 ? AUDIO_LEVEL : -AUDIO_LEVEL;
+    }
+}
+
+static void mix_voices(int16_t *out) {
+    int32_t sum[AUDIO_PERIOD] = {0};
+    for (int i = 0; i < AUDIO_VOICES; i++) {
+        Voice *v = &audio.voices[i];
+        for (int n = 0; n < AUDIO_PERIOD; ) {
+            if (!v->left) {
+                if (!v->count) break;
+                start_next_tone(v);
+            }
+            uint32_t run = v->left < (uint32_t)(AUDIO_PERIOD - n) ? v->left : (uint32_t)(AUDIO_PERIOD - n);
+            for (uint32_t k = 0; k < run; k++) sum[n + k] += voice_sample(v);
+            v->left -= run;
+            n += run;
+        }
+    }
+    for (int n = 0; n < AUDIO_PERIOD; n++) out[n] = (int16_t)sum[n];
+}
+
+static void *mixer_thread(void *arg) {
+    (void)arg;
+    static int16_t samples[AUDIO_PERIOD];
+    int device = audio_open() == 0;
+    for (;;) {
+        if (take_tones(device)) {
+            mix_voices(samples);
+            audio_write(samples);
+            continue;
+        }
+        pthread_mutex_lock(&audio.mutex);
+        while (atomic_load(&audio.head) == atomic_load(&audio.tail)) {
+            pthread_cond_wait(&audio.wake, &audio.mutex);
+        }
+        pthread_mutex_unlock(&audio.mutex);
+    }
+    return NULL;
+}
+
+static pthread_once_t mixer_once = PTHREAD_ONCE_INIT;
+
+static void start_mixer(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, mixer_thread, NULL) == 0) pthread_detach(thread);
+}
+
+// Queue a tone on one channel and return at once. Tones past what the
+// ring holds are dropped. Only the CPU thread calls this.
+void queue_tone(int voice, int wave, int freq, int duration) {
+    if (headless) return;
+    pthread_once(&mixer_once, start_mixer);
+
+    unsigned head = atomic_load_explicit(&audio.head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&audio.tail, memory_order_acquire) == AUDIO_RING) return;
+    audio.ring[head % AUDIO_RING] = (ToneCmd){ (uint8_t)voice, (uint8_t)wave, (uint16_t)freq, (uint16_t)duration };
+    atomic_store_explicit(&audio.head, head + 1, memory_order_release);
+
+    pthread_mutex_lock(&audio.mutex);
+    pthread_cond_signal(&audio.wake);
+    pthread_mutex_unlock(&audio.mutex);
+}
+
+void play_beep(int freq, int duration) {
+    queue_tone(0, WAVE_SQUARE, freq, duration);
+}
+
+// Boot and loading animations. --boot full plays them; fast draws only
+// their final text, at once; none skips them. The text costs no more to
+// draw than a cached frame would to copy.
+enum { BOOT_FULL, BOOT_FAST, BOOT_NONE };
+int boot_mode = BOOT_FULL;
+const char *boot_names[] = {"full", "fast", "none"};
+
+int set_boot_mode(const char *name) {
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, boot_names[i]) == 0) {
+            boot_mode = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// A pause of the full animations, skipped by the others
+static void boot_pause(int ms) {
+    if (boot_mode == BOOT_FULL) yield_ms(ms);
+}
+
+void show_boot_logo(void) {
     // Cool pixel-based boot animation
     clear_pixels();
     screen.pixel_mode = 1;
@@ -687,30 +1938,32 @@ void show_boot_animation(void) {
             set_pixel(x, y, 1);
         }
         screen.dirty = 1;
-        sleep_ms(30);
+        yield_ms(30);
     }
     
     // Flash effect
     for (int i = 0; i < 3; i++) {
         clear_pixels();
         screen.dirty = 1;
-        sleep_ms(100);
+        yield_ms(100);
         for (int y = 0; y < PIXEL_HEIGHT; y++) {
             for (int x = 0; x < PIXEL_WIDTH; x++) {
                 if ((x + y) % 20 == 0) set_pixel(x, y, 1);
             }
         }
         screen.dirty = 1;
-        sleep_ms(100);
+        yield_ms(100);
     }
     
     screen.dirty = 1;
-    sleep_ms(1000);
+    yield_ms(1000);
     
     // Return to text mode
     clear_screen_display();
     screen.pixel_mode = 0;
-    
+}
+
+void show_boot_banner(void) {
     const char *spinner = "-\\|/";
     
     screen.current_color = COLOR_BRIGHT_YELLOW;
@@ -728,7 +1981,7 @@ void show_boot_animation(void) {
     print_to_screen("|\n");
     print_to_screen("    +--------------------------------------+\n");
     screen.dirty = 1;
-    sleep_ms(500);
+    boot_pause(500);
     
     screen.current_color = COLOR_GREEN;
     print_to_screen("\n    Initializing");
@@ -737,7 +1990,7 @@ void show_boot_animation(void) {
         char s[2] = {spinner[i % 4], 0};
         print_to_screen(s);
         screen.dirty = 1;
-        sleep_ms(80);
+        boot_pause(80);
         putchar_screen('\b');
     }
     
@@ -746,21 +1999,27 @@ void show_boot_animation(void) {
     for (int i = 0; i <= 30; i++) {
         print_to_screen("=");
         screen.dirty = 1;
-        sleep_ms(25);
+        boot_pause(25);
     }
     screen.current_color = COLOR_GREEN;
     print_to_screen("]\n");
     screen.dirty = 1;
-    sleep_ms(300);
+    boot_pause(300);
     
     screen.current_color = COLOR_BRIGHT_GREEN;
     print_to_screen("\n    > System Ready\n");
     screen.current_color = COLOR_WHITE;
     screen.dirty = 1;
-    sleep_ms(500);
+    boot_pause(500);
 }
 
-void show_loading_animation(const char *filename) {
+void show_boot_animation(void) {
+    if (boot_mode == BOOT_NONE) return;
+    if (boot_mode == BOOT_FULL) show_boot_logo();
+    show_boot_banner();
+}
+
+void show_loading_bar(void) {
     // Switch to pixel mode for cool loading animation
     screen.pixel_mode = 1;
     clear_pixels();
@@ -776,7 +2035,7 @@ void show_loading_animation(const char *filename) {
         set_pixel(260, y, 1);
     }
     screen.dirty = 1;
-    sleep_ms(200);
+    yield_ms(200);
     
     // Animated loading bar with wave effect
     for (int pass = 0; pass < 2; pass++) {
@@ -799,7 +2058,7 @@ void show_loading_animation(const char *filename) {
             }
             
             screen.dirty = 1;
-            sleep_ms(8);
+            yield_ms(8);
         }
     }
     
@@ -807,7 +2066,7 @@ void show_loading_animation(const char *filename) {
     for (int i = 0; i < 3; i++) {
         clear_pixels();
         screen.dirty = 1;
-        sleep_ms(50);
+        yield_ms(50);
         
         // Draw filled box
         for (int x = 60; x < 260; x++) {
@@ -816,14 +2075,16 @@ void show_loading_animation(const char *filename) {
             }
         }
         screen.dirty = 1;
-        sleep_ms(50);
+        yield_ms(50);
     }
     
-    sleep_ms(200);
-    
-    // Return to text mode
+    yield_ms(200);
+}
+
+void show_loading_animation(const char *filename) {
+    if (boot_mode == BOOT_NONE) return;
+    if (boot_mode == BOOT_FULL) show_loading_bar();
     clear_screen_display();
-    screen.pixel_mode = 0;
     
     screen.current_color = COLOR_BRIGHT_CYAN;
     print_to_screen("\n    Loading: ");
@@ -832,97 +2093,707 @@ void show_loading_animation(const char *filename) {
     screen.current_color = COLOR_BRIGHT_GREEN;
     print_to_screen(" [OK]\n");
     screen.current_color = COLOR_WHITE;
-    screen.dirty = 1;
-    sleep_ms(300);
+    boot_pause(300);
 }
 
+void watch_filesystem(void);
+void start_flusher(void);
+
 // File system functions
 void init_filesystem(void) {
     memset(&fs, 0, sizeof(FileSystem));
     snprintf(fs.root_dir, MAX_PATH_LEN, ".%sfs", PATH_SEP);
     strncpy(current_dir, "/", MAX_PATH_LEN - 1);
     mkdir(fs.root_dir, 0755);
+    watch_filesystem();
+    start_flusher();
 }
 
-int load_file_from_disk(const char *filename) {
+uint64_t writes_done(void);
+void wait_for_write(uint64_t seq);
+const uint8_t *member_data(File *f);
+
+// Contents of a file: the cached copy if we wrote it, otherwise the file
+// mapped read-only on first use, which the OS pages in as it is touched.
+// Returns NULL if the file can no longer be mapped.
+const uint8_t *file_data(File *f) {
+    static uint8_t empty[1];
     char path[MAX_PATH_LEN];
-    snprintf(path, MAX_PATH_LEN, "%s%s%s", fs.root_dir, PATH_SEP, filename);
-    
-    FILE *f = fopen(path, "rb");
-    if (!f) return -1;
-    
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    if (size < 0) {
-        fclose(f);
-        return -1;
+
+    if (f->cache) return f->cache->data;
+    if (f->data) return f->data;
+    if (f->member) return member_data(f);
+    if (f->size == 0) return empty;
+    // A queued copy onto this name has to land before the disk is current
+    if (f->write_seq > writes_done()) wait_for_write(f->write_seq);
+    snprintf(path, MAX_PATH_LEN, "%s%s%s", fs.root_dir, PATH_SEP, f->name);
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
     }
-    
-    uint8_t *data = (uint8_t*)malloc(size);
-    if (!data) {
-        fclose(f);
-        return -1;
+    CloseHandle(file);
+    if (!mapping) return NULL;
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data) return NULL;
+    f->size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *data = MAP_FAILED;
+    // The file may have changed since the scan; map what is there now
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     }
-    
-    fread(data, 1, size, f);
-    fclose(f);
-    
-    if (fs.file_count >= 64) {
-        free(data);
-        return -1;
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    f->size = (size_t)st.st_size;
+#endif
+    f->data = data;
+    return f->data;
+}
+
+FileBuffer *new_file_buffer(const uint8_t *data, size_t size) {
+    FileBuffer *b = malloc(sizeof(FileBuffer) + size);
+    if (!b) return NULL;
+    atomic_init(&b->refs, 1);
+    b->size = size;
+    memcpy(b->data, data, size);
+    return b;
+}
+
+static FileBuffer *ref_file_buffer(FileBuffer *b) {
+    atomic_fetch_add(&b->refs, 1);
+    return b;
+}
+
+void unref_file_buffer(FileBuffer *b) {
+    if (b && atomic_fetch_sub(&b->refs, 1) == 1) free(b);
+}
+
+// Drop a file's mapping and cached copy; the next file_data() maps it
+// again, after any write still queued for it
+void release_file(File *f) {
+    unref_file_buffer(f->cache);
+    f->cache = NULL;
+    if (!f->data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(f->data);
+#else
+    munmap(f->data, f->size);
+#endif
+    f->data = NULL;
+}
+
+// Files being written go under this suffix first and are never entries
+#define TMP_SUFFIX ".~tmp"
+
+// FNV-1a
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
     }
-    
-    struct stat st;
-    if (stat(path, &st) == 0) {
-        strncpy(fs.files[fs.file_count].name, filename, 63);
-        fs.files[fs.file_count].name[63] = '\0';
-        fs.files[fs.file_count].data = data;
-        fs.files[fs.file_count].size = size;
-        fs.files[fs.file_count].modified = st.st_mtime;
-        fs.file_count++;
-        return 0;
+    return h;
+}
+
+// Index slot holding name, or NULL
+static int *index_slot(const char *name) {
+    if (fs.index_size == 0) return NULL;
+    uint32_t mask = (uint32_t)fs.index_size - 1;
+    for (uint32_t i = name_hash(name) & mask;; i = (i + 1) & mask) {
+        int v = fs.index[i];
+        if (v == 0) return NULL;
+        if (v > 0 && strcmp(fs.files[v - 1].name, name) == 0) return &fs.index[i];
     }
-    
-    free(data);
-    return -1;
+}
+
+static void index_place(int file) {
+    uint32_t mask = (uint32_t)fs.index_size - 1;
+    uint32_t i = name_hash(fs.files[file].name) & mask;
+    while (fs.index[i] > 0) i = (i + 1) & mask;
+    if (fs.index[i] == 0) fs.index_used++;
+    fs.index[i] = file + 1;
+}
+
+// Size the index for file_count + 1 entries at most half full, dropping
+// deleted slots
+static int index_rebuild(void) {
+    int size = 64;
+    while (size < (fs.file_count + 1) * 2) size *= 2;
+    int *index = calloc(size, sizeof(int));
+    if (!index) return -1;
+    free(fs.index);
+    fs.index = index;
+    fs.index_size = size;
+    fs.index_used = 0;
+    for (int i = 0; i < fs.file_count; i++) index_place(i);
+    return 0;
 }
 
 File* find_file(const char *name) {
-    for (int i = 0; i < fs.file_count; i++) {
-        if (strcmp(fs.files[i].name, name) == 0) {
-            return &fs.files[i];
-        }
+    int *slot = index_slot(name);
+    return slot ? &fs.files[*slot - 1] : NULL;
+}
+
+// The entry for a name, created empty if there is none. Drops whatever
+// contents an existing entry had. NULL if the table cannot grow.
+File *file_entry(const char *filename) {
+    File *f = find_file(filename);
+    if (f) {
+        release_file(f);
+        return f;
     }
-    return NULL;
+    
+    if (fs.file_count == fs.file_capacity) {
+        int capacity = fs.file_capacity ? fs.file_capacity * 2 : 64;
+        File *files = realloc(fs.files, capacity * sizeof(File));
+        if (!files) return NULL;
+        fs.files = files;
+        fs.file_capacity = capacity;
+    }
+    if ((fs.index_used + 1) * 4 > fs.index_size * 3 && index_rebuild() != 0) return NULL;
+    
+    f = &fs.files[fs.file_count];
+    memset(f, 0, sizeof(File));
+    strncpy(f->name, filename, 63);
+    f->name[63] = '\0';
+    index_place(fs.file_count++);
+    return f;
 }
 
-int write_file(const char *filename, const uint8_t *data, size_t size) {
+void mount_archive(const char *filename);
+void unmount_archive(const char *filename);
+
+// Add a directory entry to the table, or refresh it if it is already
+// there. Only stats the file; nothing is read until file_data(), except
+// the tables of a ROM archive, which is mounted as a directory.
+int add_file_entry(const char *filename) {
     char path[MAX_PATH_LEN];
     snprintf(path, MAX_PATH_LEN, "%s%s%s", fs.root_dir, PATH_SEP, filename);
     
-    FILE *f = fopen(path, "wb");
-    if (!f) return -1;
+    size_t len = strlen(filename);
+    if (len >= sizeof(TMP_SUFFIX) - 1 && strcmp(filename + len - (sizeof(TMP_SUFFIX) - 1), TMP_SUFFIX) == 0) {
+        return -1;
+    }
     
-    fwrite(data, 1, size, f);
-    fclose(f);
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
     
+    File *f = file_entry(filename);
+    if (!f) return -1;
+    f->size = (size_t)st.st_size;
+    f->modified = st.st_mtime;
+    mount_archive(filename);
     return 0;
 }
 
-int delete_file(const char *filename) {
-    char path[MAX_PATH_LEN];
-    snprintf(path, MAX_PATH_LEN, "%s%s%s", fs.root_dir, PATH_SEP, filename);
+// Drop a directory entry. The last file moves into the hole, so File
+// pointers into the table are only good until the next add or remove.
+void remove_file_entry(const char *filename) {
+    int *slot = index_slot(filename);
+    if (!slot) return;
+    if (!strchr(filename, '/')) unmount_archive(filename);
+    slot = index_slot(filename);
     
-    return remove(path);
+    int i = *slot - 1, last = fs.file_count - 1;
+    *slot = FS_DELETED;
+    release_file(&fs.files[i]);
+    if (i != last) {
+        *index_slot(fs.files[last].name) = i + 1;
+        fs.files[i] = fs.files[last];
+    }
+    fs.file_count--;
 }
 
-void scan_filesystem(void) {
-    for (int i = 0; i < fs.file_count; i++) {
-        if (fs.files[i].data) free(fs.files[i].data);
+
+// ROM archives. One file holds many programs, each a set of segments
+// that are stored raw or LZ4-compressed and decompressed straight into
+// memory at their load address. A file named *.rom with a valid header is
+// mounted as a read-only directory of "<archive>/<program>" entries. All
+// fields are little-endian:
+//
+//   header   "MROM", version u16, programs u16, segments u16, reserved u16,
+//            FNV-1a u32 of the two tables
+//   program  name[24], entry u16, first segment u16, segments u16, reserved u16
+//   segment  load u16, codec u8, reserved u8, length u32, stored u32,
+//            offset u32, FNV-1a u32 of the stored bytes
+#define ROM_VERSION       1
+#define ROM_HEADER_SIZE   16
+#define ROM_PROGRAM_SIZE  32
+#define ROM_SEGMENT_SIZE  20
+#define ROM_RAW           0
+#define ROM_LZ4           1
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    int programs;
+    const uint8_t *program;     // program table
+    const uint8_t *segment;     // segment table
+} Archive;
+
+static uint16_t rd16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return (uint32_t)rd16(p) | (uint32_t)rd16(p + 2) << 16; }
+
+static uint32_t fnv1a_update(uint32_t h, const uint8_t *p, size_t n) {
+    while (n--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t fnv1a(const uint8_t *p, size_t n) {
+    return fnv1a_update(2166136261u, p, n);
+}
+
+// Check the header and tables; segments are checked as they are loaded
+int open_archive(const uint8_t *data, size_t size, Archive *a) {
+    if (size < ROM_HEADER_SIZE || memcmp(data, "MROM", 4) != 0 || rd16(data + 4) != ROM_VERSION) return -1;
+    int programs = rd16(data + 6), segments = rd16(data + 8);
+    size_t tables = (size_t)programs * ROM_PROGRAM_SIZE + (size_t)segments * ROM_SEGMENT_SIZE;
+    if (size - ROM_HEADER_SIZE < tables || fnv1a(data + ROM_HEADER_SIZE, tables) != rd32(data + 12)) return -1;
+    
+    a->data = data;
+    a->size = size;
+    a->programs = programs;
+    a->program = data + ROM_HEADER_SIZE;
+    a->segment = a->program + (size_t)programs * ROM_PROGRAM_SIZE;
+    for (int i = 0; i < programs; i++) {
+        const uint8_t *p = a->program + i * ROM_PROGRAM_SIZE;
+        if ((uint32_t)rd16(p + 26) + rd16(p + 28) > (uint32_t)segments) return -1;
+    }
+    for (int i = 0; i < segments; i++) {
+        const uint8_t *g = a->segment + i * ROM_SEGMENT_SIZE;
+        uint32_t length = rd32(g + 4), stored = rd32(g + 8), offset = rd32(g + 12);
+        if (rd16(g) + (uint64_t)length > MEM_SIZE || g[2] > ROM_LZ4) return -1;
+        if (offset > size || stored > size - offset) return -1;
+        if (g[2] == ROM_RAW && stored != length) return -1;
+    }
+    return 0;
+}
+
+// LZ4 block format. Returns the number of bytes produced, or -1 if the
+// input is malformed or would not fit in dst_len.
+int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len) {
+    const uint8_t *ip = src, *iend = src + src_len;
+    uint8_t *op = dst, *oend = dst + dst_len;
+    
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) break;      // the last sequence has no match
+        
+        if (iend - ip < 2) return -1;
+        size_t offset = rd16(ip);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        len = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (size_t)(oend - op)) return -1;
+        const uint8_t *match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            while (len--) *op++ = *match++;     // overlapping: repeats a pattern
+        }
+    }
+    return (int)(op - dst);
+}
+
+// Decompress a program's segments into mem, which spans the whole
+// address space. Returns the entry point, or -1 on a bad segment.
+int load_archive_program(const Archive *a, int program, uint8_t *mem) {
+    const uint8_t *p = a->program + program * ROM_PROGRAM_SIZE;
+    int first = rd16(p + 26), count = rd16(p + 28);
+    
+    for (int i = first; i < first + count; i++) {
+        const uint8_t *g = a->segment + i * ROM_SEGMENT_SIZE;
+        uint16_t load = rd16(g);
+        uint32_t length = rd32(g + 4), stored = rd32(g + 8);
+        const uint8_t *src = a->data + rd32(g + 12);
+        
+        if (fnv1a(src, stored) != rd32(g + 16)) return -1;
+        if (g[2] == ROM_RAW) {
+            memcpy(mem + load, src, length);
+        } else if (lz4_decompress(src, stored, mem + load, length) != (int)length) {
+            return -1;
+        }
+    }
+    return rd16(p + 24);
+}
+
+// Size of a program laid out as a flat image from address 0
+static size_t archive_image_size(const Archive *a, int program) {
+    const uint8_t *p = a->program + program * ROM_PROGRAM_SIZE;
+    int first = rd16(p + 26), count = rd16(p + 28);
+    size_t end = 0;
+    for (int i = first; i < first + count; i++) {
+        const uint8_t *g = a->segment + i * ROM_SEGMENT_SIZE;
+        if (rd16(g) + (size_t)rd32(g + 4) > end) end = rd16(g) + (size_t)rd32(g + 4);
+    }
+    return end;
+}
+
+static int is_archive_name(const char *name) {
+    size_t len = strlen(name);
+    return !strchr(name, '/') && len > 4 && strcmp(name + len - 4, ".rom") == 0;
+}
+
+// Archive holding a member entry (the part of its name before '/')
+static int member_archive(const File *f, Archive *a) {
+    char name[64];
+    const char *slash = strchr(f->name, '/');
+    snprintf(name, sizeof(name), "%.*s", (int)(slash - f->name), f->name);
+    File *arc = find_file(name);
+    const uint8_t *data = arc ? file_data(arc) : NULL;
+    if (!data || open_archive(data, arc->size, a) != 0 || f->member > a->programs) return -1;
+    return 0;
+}
+
+// A member's contents as a flat image, decompressed once and cached
+const uint8_t *member_data(File *f) {
+    Archive a;
+    if (member_archive(f, &a) != 0) return NULL;
+    
+    FileBuffer *b = malloc(sizeof(FileBuffer) + MEM_SIZE);
+    if (!b) return NULL;
+    atomic_init(&b->refs, 1);
+    b->size = f->size;
+    memset(b->data, 0, MEM_SIZE);
+    if (load_archive_program(&a, f->member - 1, b->data) < 0) {
+        free(b);
+        return NULL;
+    }
+    f->cache = b;
+    return b->data;
+}
+
+void unmount_archive(const char *filename) {
+    size_t len = strlen(filename);
+    for (int i = fs.file_count - 1; i >= 0; i--) {
+        if (fs.files[i].member && strncmp(fs.files[i].name, filename, len) == 0 &&
+            fs.files[i].name[len] == '/') {
+            remove_file_entry(fs.files[i].name);
+        }
+    }
+}
+
+// List an archive's programs as entries; replaces any earlier listing
+void mount_archive(const char *filename) {
+    Archive a;
+    char name[64];
+    
+    if (!is_archive_name(filename)) return;
+    unmount_archive(filename);
+    File *f = find_file(filename);
+    const uint8_t *data = f ? file_data(f) : NULL;
+    if (!data || open_archive(data, f->size, &a) != 0) return;
+    
+    time_t modified = f->modified;
+    for (int i = 0; i < a.programs; i++) {
+        const uint8_t *p = a.program + i * ROM_PROGRAM_SIZE;
+        snprintf(name, sizeof(name), "%s/%.24s", filename, (const char *)p);
+        File *m = file_entry(name);
+        if (!m) break;
+        m->member = i + 1;
+        m->size = archive_image_size(&a, i);
+        m->modified = modified;
+    }
+}
+
+// Write-back. Shell writes update the table and cache at once and queue
+// the disk work, which the flusher thread does in order. A write queued
+// behind an unstarted write of the same name replaces it, unless an
+// operation in between reads or removes that name. Each operation gets a
+// sequence number; a File's write_seq says which one it is waiting on.
+enum { WB_WRITE, WB_COPY, WB_DELETE };
+
+typedef struct {
+    int op;
+    uint64_t seq;
+    char name[64];
+    char src[64];           // WB_COPY source
+    FileBuffer *buf;        // WB_WRITE contents
+} WriteOp;
+
+static struct {
+    WriteOp *ops;
+    int count, capacity;
+    uint64_t next_seq;
+    uint64_t done_seq;      // every operation up to this one is finished
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+} wb = { NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+uint64_t writes_done(void) {
+    pthread_mutex_lock(&wb.mutex);
+    uint64_t seq = wb.done_seq;
+    pthread_mutex_unlock(&wb.mutex);
+    return seq;
+}
+
+void wait_for_write(uint64_t seq) {
+    pthread_mutex_lock(&wb.mutex);
+    while (wb.done_seq < seq) pthread_cond_wait(&wb.done, &wb.mutex);
+    pthread_mutex_unlock(&wb.mutex);
+}
+
+// Wait until everything queued so far is on disk
+void flush_writes(void) {
+    pthread_mutex_lock(&wb.mutex);
+    uint64_t seq = wb.next_seq;
+    pthread_mutex_unlock(&wb.mutex);
+    wait_for_write(seq);
+}
+
+// Queue a disk operation; takes over the reference to buf. Returns its
+// sequence number, or 0 if it could not be queued.
+static uint64_t queue_write(int op, const char *name, const char *src, FileBuffer *buf) {
+    uint64_t seq = 0;
+    pthread_mutex_lock(&wb.mutex);
+    if (op == WB_WRITE) {
+        for (int i = wb.count - 1; i >= 0; i--) {
+            WriteOp *w = &wb.ops[i];
+            int same = strcmp(w->name, name) == 0;
+            if (same && w->op == WB_WRITE) {
+                unref_file_buffer(w->buf);
+                w->buf = buf;
+                seq = w->seq;
+                goto out;
+            }
+            if (same || (w->op == WB_COPY && strcmp(w->src, name) == 0)) break;
+        }
+    }
+    if (wb.count == wb.capacity) {
+        int capacity = wb.capacity ? wb.capacity * 2 : 16;
+        WriteOp *ops = realloc(wb.ops, capacity * sizeof(WriteOp));
+        if (!ops) {
+            unref_file_buffer(buf);
+            goto out;
+        }
+        wb.ops = ops;
+        wb.capacity = capacity;
+    }
+    WriteOp *w = &wb.ops[wb.count++];
+    w->op = op;
+    w->seq = seq = ++wb.next_seq;
+    snprintf(w->name, sizeof(w->name), "%s", name);
+    snprintf(w->src, sizeof(w->src), "%s", src ? src : "");
+    w->buf = buf;
+    pthread_cond_signal(&wb.work);
+out:
+    pthread_mutex_unlock(&wb.mutex);
+    return seq;
+}
+
+// Write a whole file without truncating the old one in place: POSIX writes
+// a temporary and renames it over the target, so mappings of the old
+// contents stay valid. Windows cannot replace a mapped file, so the shell
+// drops the target's mapping before queueing the write.
+static int flush_file(const char *path, const uint8_t *data, size_t size) {
+    char tmp[MAX_PATH_LEN + 8];
+#ifdef _WIN32
+    snprintf(tmp, sizeof(tmp), "%s", path);
+#else
+    snprintf(tmp, sizeof(tmp), "%s" TMP_SUFFIX, path);
+#endif
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    
+    size_t written = fwrite(data, 1, size, f);
+    if (fclose(f) != 0 || written != size) {
+        remove(tmp);
+        return -1;
+    }
+    
+#ifndef _WIN32
+    if (rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Copy file to file inside the OS: CopyFile on Windows, copy_file_range
+// on Linux (which reflinks on filesystems that share extents), and a
+// read/write loop where neither is available
+static int flush_copy(const char *src, const char *dst) {
+#ifdef _WIN32
+    return CopyFileA(src, dst, FALSE) ? 0 : -1;
+#else
+    char tmp[MAX_PATH_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s" TMP_SUFFIX, dst);
+    
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    
+    int ok = 1;
+    ssize_t n = -1;
+#ifdef SYS_copy_file_range
+    while ((n = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t)1 << 30, 0)) > 0) {
+    }
+#endif
+    if (n < 0) {
+        // Not supported here (old kernel, or across filesystems): copy by hand
+        char buf[65536];
+        lseek(in, 0, SEEK_SET);
+        lseek(out, 0, SEEK_SET);
+        if (ftruncate(out, 0) != 0) ok = 0;
+        while (ok && (n = read(in, buf, sizeof(buf))) > 0) {
+            if (write(out, buf, (size_t)n) != n) ok = 0;
+        }
+        if (n < 0) ok = 0;
+    }
+    close(in);
+    if (close(out) != 0) ok = 0;
+    
+    if (!ok || rename(tmp, dst) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+void* flusher_thread(void* arg) {
+    (void)arg;
+    
+    for (;;) {
+        pthread_mutex_lock(&wb.mutex);
+        while (wb.count == 0) pthread_cond_wait(&wb.work, &wb.mutex);
+        WriteOp w = wb.ops[0];
+        memmove(wb.ops, wb.ops + 1, --wb.count * sizeof(WriteOp));
+        pthread_mutex_unlock(&wb.mutex);
+        
+        char path[MAX_PATH_LEN], src[MAX_PATH_LEN];
+        int err = 0;
+        snprintf(path, MAX_PATH_LEN, "%s%s%s", fs.root_dir, PATH_SEP, w.name);
+        if (w.op == WB_WRITE) {
+            err = flush_file(path, w.buf->data, w.buf->size);
+        } else if (w.op == WB_COPY) {
+            snprintf(src, MAX_PATH_LEN, "%s%s%s", fs.root_dir, PATH_SEP, w.src);
+            err = flush_copy(src, path);
+        } else {
+            err = remove(path) != 0 && errno != ENOENT;
+        }
+        if (err) fprintf(stderr, "Write-back of %s failed\n", w.name);
+        unref_file_buffer(w.buf);
+        
+        pthread_mutex_lock(&wb.mutex);
+        wb.done_seq = w.seq;
+        pthread_cond_broadcast(&wb.done);
+        pthread_mutex_unlock(&wb.mutex);
+    }
+    return NULL;
+}
+
+static int flusher_started;
+
+void start_flusher(void) {
+    pthread_t thread;
+    if (flusher_started) return;
+    if (pthread_create(&thread, NULL, flusher_thread, NULL) == 0) {
+        pthread_detach(thread);
+        flusher_started = 1;
+    }
+}
+
+// Write a whole file. The table and cache change now; the disk follows.
+// Names under an archive are read-only.
+int write_file(const char *filename, const uint8_t *data, size_t size) {
+    if (strchr(filename, '/')) return -1;
+    
+    FileBuffer *buf = new_file_buffer(data, size);
+    if (!buf) return -1;
+    
+    File *f = file_entry(filename);
+    if (!f) {
+        unref_file_buffer(buf);
+        return -1;
+    }
+    f->cache = buf;
+    f->size = size;
+    f->modified = time(NULL);
+    f->write_seq = queue_write(WB_WRITE, filename, NULL, ref_file_buffer(buf));
+    return f->write_seq ? 0 : -1;
+}
+
+// Copy src to dst. Cached contents are shared rather than copied; a file
+// that is only on disk is copied there by the flusher.
+int copy_file(const char *src, const char *dst) {
+    File *f = find_file(src);
+    if (!f || strchr(dst, '/')) return -1;
+    if (strcmp(src, dst) == 0) return 0;
+    if (f->member && !file_data(f)) return -1;     // unpack into the cache
+    
+    FileBuffer *buf = f->cache ? ref_file_buffer(f->cache) : NULL;
+    size_t size = f->size;
+    File *d = file_entry(dst);     // may move f
+    if (!d) {
+        unref_file_buffer(buf);
+        return -1;
+    }
+    d->size = size;
+    d->modified = time(NULL);
+    if (buf) {
+        d->cache = buf;
+        d->write_seq = queue_write(WB_WRITE, dst, NULL, ref_file_buffer(buf));
+    } else {
+        d->write_seq = queue_write(WB_COPY, dst, src, NULL);
+    }
+    return d->write_seq ? 0 : -1;
+}
+
+int delete_file(const char *filename) {
+    if (!find_file(filename) || strchr(filename, '/')) return -1;
+    remove_file_entry(filename);
+    return queue_write(WB_DELETE, filename, NULL, NULL) ? 0 : -1;
+}
+
+void scan_filesystem(void) {
+    flush_writes();
+    for (int i = 0; i < fs.file_count; i++) {
+        release_file(&fs.files[i]);
     }
     fs.file_count = 0;
+    index_rebuild();
     
 #ifdef _WIN32
     WIN32_FIND_DATAA find_data;
@@ -933,7 +2804,7 @@ void scan_filesystem(void) {
     if (hFind != INVALID_HANDLE_VALUE) {
         do {
             if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                load_file_from_disk(find_data.cFileName);
+                add_file_entry(find_data.cFileName);
             }
         } while (FindNextFileA(hFind, &find_data));
         FindClose(hFind);
@@ -944,7 +2815,7 @@ void scan_filesystem(void) {
         struct dirent *entry;
         while ((entry = readdir(dir)) != NULL) {
             if (entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN) {
-                load_file_from_disk(entry->d_name);
+                add_file_entry(entry->d_name);
             }
         }
         closedir(dir);
@@ -952,45 +2823,949 @@ void scan_filesystem(void) {
 #endif
 }
 
+// Directory watching. The OS queues change notifications for fs.root_dir
+// in the background; sync_filesystem() drains them on the shell thread,
+// which owns fs, and re-stats just the names they mention. If the queue
+// overflows, or there is no watcher, the table is left to the next scan.
+#ifdef _WIN32
+static HANDLE watch_dir = INVALID_HANDLE_VALUE;
+static OVERLAPPED watch_overlapped;
+static DWORD watch_buf[4096];
+
+static int watch_arm(void) {
+    return ReadDirectoryChangesW(watch_dir, watch_buf, sizeof(watch_buf), FALSE,
+                                 FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE |
+                                 FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                 NULL, &watch_overlapped, NULL) ? 0 : -1;
+}
+
+void watch_filesystem(void) {
+    watch_dir = CreateFileA(fs.root_dir, FILE_LIST_DIRECTORY,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                            OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (watch_dir == INVALID_HANDLE_VALUE) return;
+    watch_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!watch_overlapped.hEvent || watch_arm() != 0) {
+        CloseHandle(watch_dir);
+        watch_dir = INVALID_HANDLE_VALUE;
+    }
+}
+#elif defined(__linux__)
+static int watch_fd = -1;
+
+void watch_filesystem(void) {
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) return;
+    if (inotify_add_watch(watch_fd, fs.root_dir, IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE |
+                          IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+}
+#else
+void watch_filesystem(void) {
+}
+#endif
+
+// A watched name changed: pick up whatever is there now, unless a write
+// of ours to it is still queued and will decide that anyway
+static void file_changed(const char *name) {
+    File *f = find_file(name);
+    if (f && f->write_seq > writes_done()) return;
+    if (add_file_entry(name) != 0) remove_file_entry(name);
+}
+
+void sync_filesystem(void) {
+#ifdef _WIN32
+    DWORD bytes;
+    if (watch_dir == INVALID_HANDLE_VALUE) return;
+    while (GetOverlappedResult(watch_dir, &watch_overlapped, &bytes, FALSE)) {
+        if (bytes == 0) {
+            scan_filesystem();      // the notification buffer overflowed
+        } else {
+            const uint8_t *p = (const uint8_t *)watch_buf;
+            for (;;) {
+                const FILE_NOTIFY_INFORMATION *info = (const FILE_NOTIFY_INFORMATION *)p;
+                char name[MAX_PATH_LEN];
+                int n = WideCharToMultiByte(CP_ACP, 0, info->FileName,
+                                            (int)(info->FileNameLength / sizeof(WCHAR)),
+                                            name, sizeof(name) - 1, NULL, NULL);
+                if (n > 0) {
+                    name[n] = '\0';
+                    file_changed(name);
+                }
+                if (!info->NextEntryOffset) break;
+                p += info->NextEntryOffset;
+            }
+        }
+        ResetEvent(watch_overlapped.hEvent);
+        if (watch_arm() != 0) {
+            CloseHandle(watch_dir);
+            watch_dir = INVALID_HANDLE_VALUE;
+            return;
+        }
+    }
+#elif defined(__linux__)
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    if (watch_fd < 0) return;
+    while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                scan_filesystem();
+            } else if (ev->len > 0) {
+                file_changed(ev->name);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#endif
+}
+
+// Predecoded instruction cache: handler kinds of a DecodedOp
+enum {
+    DK_UNDECODED = 0,
+    DK_FALLBACK,
+    DK_WRAP,
+    DK_HALT,
+    DK_PRINT_CHAR,
+    DK_SET_PIXEL,
+    DK_LOAD_REG,
+    DK_STORE_REG,
+    DK_PUSH,
+    DK_POP,
+    DK_ADD,
+    DK_SUB,
+    DK_MUL,
+    DK_DIV,
+    DK_MOD,
+    DK_AND,
+    DK_OR,
+    DK_XOR,
+    DK_NOT,
+    DK_SHL,
+    DK_SHR,
+    DK_CMP,
+    DK_JMP,
+    DK_JZ,
+    DK_JNZ,
+    DK_JG,
+    DK_JL,
+    DK_CALL,
+    DK_RET,
+    DK_LOAD_MEM,
+    DK_STORE_MEM,
+    DK_COPY_MEM,
+    DK_ADDI,
+    DK_CMPI,
+    DK_DJNZ,
+    DK_CJNE,
+    DK_LOAD_IDX,
+    DK_STORE_IDX,
+    DK_FILL_MEM,
+    DK_CMP_MEM,
+    DK_FIND_BYTE,
+    DK_ADD_MEM,
+    DK_XOR_MEM,
+    DK_COUNT
+};
+
+// Longest instruction the predecoder turns into a fast entry (OP_COPY_MEM,
+// OP_CMP_MEM, OP_FIND_BYTE)
+#define DECODE_MAX_LEN OPLEN_COPY_MEM
+
+// Execution engines selectable from the command line
+#define ENGINE_INTERP    0
+#define ENGINE_PREDECODE 1
+#define ENGINE_JIT       2
+
+int cpu_engine = ENGINE_PREDECODE;
+
+// Scheduler settings, see run_program(). One instruction is one cycle.
+#define FRAME_INTERVAL_US  16667
+#define CLOCK_MAX_LAG_US   100000
+uint32_t cpu_slice_cycles = 10000;
+uint32_t cpu_clock_hz = 0;          // 0 runs unthrottled
+const char *profile_path = NULL;    // --profile: where run_program() reports
+const char *record_path = NULL;     // --record: where run_program() writes its trace
+
+void jit_flush(void);
+void jit_invalidate(uint32_t addr, uint32_t len);
+
+void flush_decode_cache(void) {
+    memset(decode_cache, 0, sizeof(decode_cache));
+    memset(decoded_pages, 0, sizeof(decoded_pages));
+    decode_cache[MEM_SIZE].kind = DK_WRAP;
+    if (cpu_engine == ENGINE_JIT) jit_flush();
+}
+
+// Called for every guest write to cpu.memory. Any entry whose instruction
+// could overlap [addr, addr + len) is dropped and re-decoded on next use.
+// Pages that have never been decoded (plain data) are skipped outright.
+void invalidate_decoded(uint32_t addr, uint32_t len) {
+    uint32_t start = addr >= DECODE_MAX_LEN - 1 ? addr - (DECODE_MAX_LEN - 1) : 0;
+    uint32_t end = addr + len;
+    if (end > MEM_SIZE) end = MEM_SIZE;
+    if (end <= start) return;
+
+    if (cpu_engine == ENGINE_JIT) jit_invalidate(addr, len);
+
+    for (uint32_t page = start >> 8; page <= (end - 1) >> 8; page++) {
+        if (!decoded_pages[page]) continue;
+        uint32_t lo = page << 8 > start ? page << 8 : start;
+        uint32_t hi = (page + 1) << 8 < end ? (page + 1) << 8 : end;
+        for (uint32_t i = lo; i < hi; i++) {
+            decode_cache[i].kind = DK_UNDECODED;
+        }
+    }
+}
+
+// OP_RANDOM draws from the machine's own generator, so machines running
+// side by side each get a repeatable sequence
+static uint32_t machine_rand(void) {
+    machine->rand_state = machine->rand_state * 1103515245u + 12345u;
+    return (machine->rand_state >> 16) & 0x7FFF;
+}
+
+// Program time. An interactive program sees the host clock. Headless
+// runs keep a virtual clock instead, so a run gives the same results
+// however fast the host is: it advances VCLOCK_HZ instructions per
+// second (--clock HZ if set) and a sleep moves it on without waiting.
+#define VCLOCK_HZ 1000000
+
+uint64_t host_time_us(void);
+
+// Restart program time at zero. Called when a program starts running.
+void start_program_clock(void) {
+    machine->clock_start = headless ? cpu.cycles : host_time_us();
+    machine->slept_ms = 0;
+    machine->wake_us = 0;
+}
+
+// Milliseconds since start_program_clock()
+uint64_t program_ms(void) {
+    if (!headless) return (host_time_us() - machine->clock_start) / 1000;
+    uint32_t hz = cpu_clock_hz ? cpu_clock_hz : VCLOCK_HZ;
+    return machine->slept_ms + (cpu.cycles - machine->clock_start) * 1000 / hz;
+}
+
+// OP_SLEEP_MS. On the host clock the CPU thread shows the screen and
+// waits for a deadline, waking at once if the window closes. Each
+// deadline counts on from the last one, so a loop that draws and then
+// sleeps keeps its frame rate however long the drawing took; a program
+// that has fallen too far behind starts over from now.
+void program_sleep(uint16_t ms) {
+    if (headless) {
+        machine->slept_ms += ms;
+        return;
+    }
+    present_screen();
+    uint64_t now = host_time_us();
+    if (machine->wake_us + CLOCK_MAX_LAG_US < now) machine->wake_us = now;
+    machine->wake_us += (uint64_t)ms * 1000;
+
+    pthread_mutex_lock(&input_buf.mutex);
+    while (window_running && (now = host_time_us()) < machine->wake_us) {
+        uint64_t wait = machine->wake_us - now;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t)(wait / 1000000);
+        ts.tv_nsec += (long)(wait % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&input_buf.changed, &input_buf.mutex, &ts);
+    }
+    pthread_mutex_unlock(&input_buf.mutex);
+}
+
 // CPU functions
+// Bank switching. BANK_WINDOWS windows of BANK_SIZE bytes from BANK_BASE
+// can each show one page of a backing store of BANK_PAGES pages (16 MiB),
+// selected with SET_BANK. Page BANK_NONE gives a window its own RAM back.
+// A switch copies the window out to its page and the new page in, so
+// every engine keeps addressing flat memory. A page uses memory only
+// while it holds something other than zeros, and the store and its
+// table are allocated only when a program first uses them. A page
+// mapped into a second window leaves the first, which gets its RAM back.
+#define BANK_BASE       0x8000
+#define BANK_SIZE       4096
+#define BANK_WINDOWS    4
+#define BANK_PAGES      4096
+#define BANK_NONE       0xFFFF
+#define BANK_SLOTS      (BANK_PAGES + BANK_WINDOWS)
+
+typedef struct Banks {
+    uint16_t map[BANK_WINDOWS];     // page shown in each window, or BANK_NONE
+    // slots[page]; slots[BANK_PAGES + w] keeps window w's RAM while it
+    // shows a page. NULL is a page of zeros.
+    uint8_t *slots[BANK_SLOTS];
+} Banks;
+
+static inline uint32_t bank_slot(int window, uint16_t page) {
+    return page == BANK_NONE ? BANK_PAGES + (uint32_t)window : page;
+}
+
+static int bank_is_zero(const uint8_t *p) {
+    return p[0] == 0 && memcmp(p, p + 1, BANK_SIZE - 1) == 0;
+}
+
+static Banks *banks_get(void) {
+    if (!machine->banks) {
+        Banks *b = calloc(1, sizeof(Banks));
+        if (!b) return NULL;
+        for (int w = 0; w < BANK_WINDOWS; w++) b->map[w] = BANK_NONE;
+        machine->banks = b;
+    }
+    return machine->banks;
+}
+
+// Drop the backing store; every window shows its RAM again
+void banks_free(void) {
+    Banks *b = machine->banks;
+    if (!b) return;
+    for (int i = 0; i < BANK_SLOTS; i++) free(b->slots[i]);
+    free(b);
+    machine->banks = NULL;
+}
+
+// Keep BANK_SIZE bytes from src in slot
+static int bank_store(Banks *b, uint32_t slot, const uint8_t *src) {
+    if (bank_is_zero(src)) {
+        free(b->slots[slot]);
+        b->slots[slot] = NULL;
+        return 0;
+    }
+    if (!b->slots[slot] && !(b->slots[slot] = malloc(BANK_SIZE))) return -1;
+    memcpy(b->slots[slot], src, BANK_SIZE);
+    return 0;
+}
+
+// Show page in window. Returns -1, with the window unchanged, when the
+// page it showed cannot be stored.
+int bank_map(int window, uint16_t page) {
+    Banks *b = banks_get();
+    if (!b) return -1;
+    if (b->map[window] == page) return 0;
+    for (int w = 0; page != BANK_NONE && w < BANK_WINDOWS; w++) {
+        if (w != window && b->map[w] == page && bank_map(w, BANK_NONE) != 0) return -1;
+    }
+
+    uint16_t addr = (uint16_t)(BANK_BASE + window * BANK_SIZE);
+    uint8_t *win = &cpu.memory[addr];
+    if (bank_store(b, bank_slot(window, b->map[window]), win) != 0) return -1;
+    const uint8_t *src = b->slots[bank_slot(window, page)];
+    if (src) memcpy(win, src, BANK_SIZE);
+    else memset(win, 0, BANK_SIZE);
+    b->map[window] = page;
+    invalidate_decoded(addr, BANK_SIZE);
+    return 0;
+}
+
+// A flat image may run past the end of memory: the rest fills pages 0 up
+static int load_banked(const uint8_t *data, size_t size) {
+    Banks *b = banks_get();
+    if (!b) return -1;
+    for (size_t off = 0; off < size; off += BANK_SIZE) {
+        uint8_t page[BANK_SIZE] = {0};
+        memcpy(page, data + off, size - off < BANK_SIZE ? size - off : BANK_SIZE);
+        if (bank_store(b, (uint32_t)(off / BANK_SIZE), page) != 0) return -1;
+    }
+    return 0;
+}
+
 void init_cpu(void) {
     memset(&cpu, 0, sizeof(CPU));
     cpu.sp = STACK_SIZE - 1;
+    banks_free();
+    flush_decode_cache();
+}
+
+// Load a flat program or an archive's first program into memory and
+// return its entry point, or -1
+int load_program_image(const uint8_t *data, size_t size) {
+    Archive a;
+    if (open_archive(data, size, &a) == 0) {
+        if (a.programs == 0) {
+            print_to_screen("Error: Archive is empty\n");
+            return -1;
+        }
+        int entry = load_archive_program(&a, 0, cpu.memory);
+        if (entry < 0) print_to_screen("Error: Corrupt archive segment\n");
+        return entry;
+    }
+    if (size > MEM_SIZE + (size_t)BANK_PAGES * BANK_SIZE) {
+        print_to_screen("Error: Program too large\n");
+        return -1;
+    }
+    if (size > MEM_SIZE && load_banked(data + MEM_SIZE, size - MEM_SIZE) != 0) {
+        print_to_screen("Error: Out of memory for banked pages\n");
+        return -1;
+    }
+    memcpy(cpu.memory, data, size < MEM_SIZE ? size : MEM_SIZE);
+    return 0;
 }
 
 int load_program(const char *filename) {
     File *f = find_file(filename);
     if (!f) return -1;
     
-    if (f->size > MEM_SIZE) {
-        print_to_screen("Error: Program too large\n");
-        return -1;
+    // Archive members, and archives themselves (their first program),
+    // decompress straight into memory
+    int entry;
+    if (f->member) {
+        Archive a;
+        if (member_archive(f, &a) != 0) return -1;
+        entry = load_archive_program(&a, f->member - 1, cpu.memory);
+        if (entry < 0) print_to_screen("Error: Corrupt archive segment\n");
+    } else {
+        const uint8_t *data = file_data(f);
+        if (!data) return -1;
+        entry = load_program_image(data, f->size);
     }
-    
-    memcpy(cpu.memory, f->data, f->size);
-    cpu.pc = 0;
+    if (entry < 0) return -1;
+    flush_decode_cache();
+    cpu.pc = (uint16_t)entry;
     cpu.running = 1;
     return 0;
 }
 
-void execute_instruction(void) {
-    if (cpu.pc >= MEM_SIZE) {
-        cpu.running = 0;
-        return;
+// Machine snapshots. A snapshot is every byte of guest-visible state laid
+// out as one flat image: the registers below, memory, the text ring from
+// its oldest history row down to the bottom screen row (chars, then
+// colors), and the pixel buffer. Taking or restoring one is a few
+// memcpys. The filesystem is not part of it; like a disk, it persists.
+// A machine that has banked memory adds the bank map, u16 per window,
+// a count u32 and that many stored slots, each its number u16 and
+// BANK_SIZE bytes. Slots of mapped pages are left out: the window holds
+// their contents.
+typedef struct {
+    uint64_t cycles;
+    uint16_t pc, sp, regs[8];
+    uint8_t flags, running;
+    uint8_t pixel_mode, pixel_depth, current_color, cursor_visible;
+    uint16_t cursor_x, cursor_y;
+    uint32_t history, text_rows;
+} MachineRegs;
+
+typedef struct {
+    size_t size;
+    uint8_t image[];
+} Snapshot;
+
+// Saved snapshots store only the 256-byte pages of the image that differ
+// from a blank machine: "MSNP", version u16, reserved u16, text rows u32,
+// image size u32, a bitmap of stored pages, then those pages.
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_HEADER     16
+#define SNAPSHOT_PAGE       256
+#define SNAPSHOT_MAX_ROWS   100000
+
+#define SNAPSHOT_BANKS_MAX  (2 * BANK_WINDOWS + 4 + (size_t)BANK_SLOTS * (2 + BANK_SIZE))
+
+static size_t snapshot_size(uint32_t text_rows) {
+    return sizeof(MachineRegs) + MEM_SIZE + 2 * (size_t)text_rows * SCREEN_WIDTH + PIXEL_BYTES;
+}
+
+// Is slot stored in a snapshot, rather than shown in a window?
+static int snapshot_keeps_slot(const Banks *b, uint32_t slot) {
+    if (!b->slots[slot]) return 0;
+    for (int w = 0; w < BANK_WINDOWS; w++) {
+        if (b->map[w] != BANK_NONE && b->map[w] == slot) return 0;
     }
-    
-    uint8_t opcode = cpu.memory[cpu.pc++];
+    return 1;
+}
+
+static size_t snapshot_banks_size(const Banks *b) {
+    if (!b) return 0;
+    size_t size = 2 * BANK_WINDOWS + 4;
+    for (uint32_t i = 0; i < BANK_SLOTS; i++) {
+        if (snapshot_keeps_slot(b, i)) size += 2 + BANK_SIZE;
+    }
+    return size;
+}
+
+// Check the bank part of an image, len bytes at p
+static int snapshot_banks_valid(const uint8_t *p, size_t len) {
+    uint32_t count;
+    if (len < 2 * BANK_WINDOWS + 4) return 0;
+    for (int w = 0; w < BANK_WINDOWS; w++) {
+        uint16_t page = rd16(p + 2 * w);
+        if (page >= BANK_PAGES && page != BANK_NONE) return 0;
+    }
+    memcpy(&count, p + 2 * BANK_WINDOWS, 4);
+    if (count > BANK_SLOTS || len != 2 * BANK_WINDOWS + 4 + (size_t)count * (2 + BANK_SIZE)) return 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (rd16(p + 2 * BANK_WINDOWS + 4 + (size_t)i * (2 + BANK_SIZE)) >= BANK_SLOTS) return 0;
+    }
+    return 1;
+}
+
+Snapshot *snapshot_take(void) {
+    uint32_t rows = (uint32_t)screen.text_rows;
+    const Banks *b = machine->banks;
+    size_t size = snapshot_size(rows) + snapshot_banks_size(b);
+    Snapshot *s = malloc(sizeof(Snapshot) + size);
+    if (!s) return NULL;
+    s->size = size;
+    
+    MachineRegs r;
+    memset(&r, 0, sizeof(r));
+    r.cycles = cpu.cycles;
+    r.pc = cpu.pc;
+    r.sp = cpu.sp;
+    memcpy(r.regs, cpu.regs, sizeof(r.regs));
+    r.flags = cpu.flags;
+    r.running = (uint8_t)cpu.running;
+    r.pixel_mode = (uint8_t)screen.pixel_mode;
+    r.pixel_depth = (uint8_t)screen.pixel_depth;
+    r.current_color = screen.current_color;
+    r.cursor_visible = (uint8_t)screen.cursor_visible;
+    r.cursor_x = (uint16_t)screen.cursor_x;
+    r.cursor_y = (uint16_t)screen.cursor_y;
+    r.history = (uint32_t)screen.history;
+    r.text_rows = rows;
+    
+    uint8_t *p = s->image;
+    memcpy(p, &r, sizeof(r));
+    p += sizeof(r);
+    memcpy(p, cpu.memory, MEM_SIZE);
+    p += MEM_SIZE;
+    int first = SCREEN_HEIGHT - (int)rows;
+    for (int y = first; y < SCREEN_HEIGHT; y++) {
+        memcpy(p + (size_t)(y - first) * SCREEN_WIDTH, text_row(y), SCREEN_WIDTH);
+        memcpy(p + (size_t)(rows + y - first) * SCREEN_WIDTH, color_row(y), SCREEN_WIDTH);
+    }
+    p += 2 * (size_t)rows * SCREEN_WIDTH;
+    memcpy(p, screen.pixels, PIXEL_BYTES);
+    p += PIXEL_BYTES;
+    if (b) {
+        uint32_t count = 0;
+        uint8_t *count_at = p + 2 * BANK_WINDOWS;
+        memcpy(p, b->map, 2 * BANK_WINDOWS);
+        p = count_at + 4;
+        for (uint32_t i = 0; i < BANK_SLOTS; i++) {
+            if (!snapshot_keeps_slot(b, i)) continue;
+            uint16_t slot = (uint16_t)i;
+            memcpy(p, &slot, 2);
+            memcpy(p + 2, b->slots[i], BANK_SIZE);
+            p += 2 + BANK_SIZE;
+            count++;
+        }
+        memcpy(count_at, &count, 4);
+    }
+    return s;
+}
+
+// Put the machine back as it was. A snapshot taken with a different
+// --scrollback keeps as much of its history as fits.
+void snapshot_restore(const Snapshot *s) {
+    MachineRegs r;
+    const uint8_t *p = s->image;
+    memcpy(&r, p, sizeof(r));
+    p += sizeof(r);
+    
+    cpu.cycles = r.cycles;
+    cpu.pc = r.pc;
+    cpu.sp = r.sp;
+    memcpy(cpu.regs, r.regs, sizeof(cpu.regs));
+    cpu.flags = r.flags;
+    cpu.running = r.running;
+    memcpy(cpu.memory, p, MEM_SIZE);
+    p += MEM_SIZE;
+    flush_decode_cache();
+    
+    int rows = (int)r.text_rows;
+    screen.top = 0;
+    screen.view = 0;
+    screen.history = (int)r.history < screen.text_rows - SCREEN_HEIGHT ?
+                     (int)r.history : screen.text_rows - SCREEN_HEIGHT;
+    for (int y = SCREEN_HEIGHT - screen.text_rows; y < SCREEN_HEIGHT; y++) {
+        int src = y - (SCREEN_HEIGHT - rows);
+        if (src >= 0) {
+            memcpy(text_row(y), p + (size_t)src * SCREEN_WIDTH, SCREEN_WIDTH);
+            memcpy(color_row(y), p + (size_t)(rows + src) * SCREEN_WIDTH, SCREEN_WIDTH);
+        } else {
+            memset(text_row(y), ' ', SCREEN_WIDTH);
+            memset(color_row(y), COLOR_WHITE, SCREEN_WIDTH);
+        }
+    }
+    p += 2 * (size_t)rows * SCREEN_WIDTH;
+    memcpy(screen.pixels, p, PIXEL_BYTES);
+    p += PIXEL_BYTES;
+    banks_free();
+    Banks *b = p < s->image + s->size ? banks_get() : NULL;
+    if (b) {
+        uint32_t count;
+        memcpy(b->map, p, 2 * BANK_WINDOWS);
+        memcpy(&count, p + 2 * BANK_WINDOWS, 4);
+        p += 2 * BANK_WINDOWS + 4;
+        for (uint32_t i = 0; i < count; i++, p += 2 + BANK_SIZE) {
+            uint32_t slot = rd16(p);
+            if (!b->slots[slot]) b->slots[slot] = malloc(BANK_SIZE);
+            if (b->slots[slot]) memcpy(b->slots[slot], p + 2, BANK_SIZE);
+        }
+    }
+    screen.pixel_mode = r.pixel_mode;
+    screen.pixel_depth = r.pixel_depth == 4 ? 4 : 1;
+    screen.current_color = r.current_color & 15;
+    screen.cursor_visible = r.cursor_visible;
+    screen.cursor_x = r.cursor_x < SCREEN_WIDTH ? r.cursor_x : SCREEN_WIDTH;
+    screen.cursor_y = r.cursor_y < SCREEN_HEIGHT ? r.cursor_y : SCREEN_HEIGHT;
+    damage_full();
+}
+
+void snapshot_free(Snapshot *s) {
+    free(s);
+}
+
+// The image of a blank machine with this many text rows, which saved
+// snapshots are stored relative to; any bank part is all zeros
+static void snapshot_blank(uint8_t *image, size_t size, uint32_t rows) {
+    size_t text = sizeof(MachineRegs) + MEM_SIZE;
+    memset(image, 0, size);
+    memset(image + text, ' ', (size_t)rows * SCREEN_WIDTH);
+    memset(image + text + (size_t)rows * SCREEN_WIDTH, COLOR_WHITE, (size_t)rows * SCREEN_WIDTH);
+}
+
+// The saved form of a snapshot, in a buffer the caller frees
+static uint8_t *snapshot_encode(const Snapshot *s, size_t *out_len) {
+    MachineRegs r;
+    memcpy(&r, s->image, sizeof(r));
+    size_t pages = (s->size + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE;
+    size_t bitmap = (pages + 7) / 8;
+    uint8_t *blank = malloc(s->size);
+    uint8_t *out = malloc(SNAPSHOT_HEADER + bitmap + s->size);
+    if (!blank || !out) {
+        free(blank);
+        free(out);
+        return NULL;
+    }
+    snapshot_blank(blank, s->size, r.text_rows);
+    
+    memset(out, 0, SNAPSHOT_HEADER + bitmap);
+    memcpy(out, "MSNP", 4);
+    out[4] = SNAPSHOT_VERSION;
+    memcpy(out + 8, &r.text_rows, 4);
+    uint32_t size = (uint32_t)s->size;
+    memcpy(out + 12, &size, 4);
+    
+    size_t len = SNAPSHOT_HEADER + bitmap;
+    for (size_t i = 0; i < pages; i++) {
+        size_t off = i * SNAPSHOT_PAGE;
+        size_t n = s->size - off < SNAPSHOT_PAGE ? s->size - off : SNAPSHOT_PAGE;
+        if (memcmp(s->image + off, blank + off, n) != 0) {
+            out[SNAPSHOT_HEADER + i / 8] |= (uint8_t)(1 << (i % 8));
+            memcpy(out + len, s->image + off, n);
+            len += n;
+        }
+    }
+    free(blank);
+    *out_len = len;
+    return out;
+}
+
+int snapshot_save(const Snapshot *s, const char *filename) {
+    size_t len;
+    uint8_t *out = snapshot_encode(s, &len);
+    if (!out) return -1;
+    int result = write_file(filename, out, len);
+    free(out);
+    return result;
+}
+
+// A snapshot from its saved form, or NULL if it is not one
+static Snapshot *snapshot_decode(const uint8_t *data, size_t data_size) {
+    if (data_size < SNAPSHOT_HEADER || memcmp(data, "MSNP", 4) != 0 ||
+        data[4] != SNAPSHOT_VERSION) {
+        return NULL;
+    }
+    
+    uint32_t rows, size;
+    memcpy(&rows, data + 8, 4);
+    memcpy(&size, data + 12, 4);
+    if (rows < SCREEN_HEIGHT || rows > SNAPSHOT_MAX_ROWS || size < snapshot_size(rows) ||
+        size - snapshot_size(rows) > SNAPSHOT_BANKS_MAX) {
+        return NULL;
+    }
+    size_t pages = (size + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE;
+    size_t bitmap = (pages + 7) / 8;
+    if (data_size < SNAPSHOT_HEADER + bitmap) return NULL;
+    
+    Snapshot *s = malloc(sizeof(Snapshot) + size);
+    if (!s) return NULL;
+    s->size = size;
+    snapshot_blank(s->image, size, rows);
+    
+    const uint8_t *p = data + SNAPSHOT_HEADER + bitmap, *end = data + data_size;
+    for (size_t i = 0; i < pages; i++) {
+        if (!(data[SNAPSHOT_HEADER + i / 8] & (1 << (i % 8)))) continue;
+        size_t off = i * SNAPSHOT_PAGE;
+        size_t n = size - off < SNAPSHOT_PAGE ? size - off : SNAPSHOT_PAGE;
+        if ((size_t)(end - p) < n) {
+            free(s);
+            return NULL;
+        }
+        memcpy(s->image + off, p, n);
+        p += n;
+    }
+    
+    MachineRegs r;
+    memcpy(&r, s->image, sizeof(r));
+    size_t base = snapshot_size(rows);
+    if (r.text_rows != rows ||
+        (size > base && !snapshot_banks_valid(s->image + base, size - base))) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+Snapshot *snapshot_load(const char *filename) {
+    File *f = find_file(filename);
+    const uint8_t *data = f ? file_data(f) : NULL;
+    return data ? snapshot_decode(data, f->size) : NULL;
+}
+
+// Traces. --record FILE logs every input a program reads from outside
+// the machine: the clock (GET_TIME, GET_TIME_MS) and the keyboard
+// (READ_CHAR, KEY_PRESSED), each stamped with the instruction count at
+// which it was read. OP_RANDOM needs no records; the trace holds the
+// generator's seed. --replay FILE runs the program again headless from
+// the same starting state with the same inputs, at full speed, and
+// checks that it ends in the same state.
+//
+// A record is written only when an opcode returns something other than
+// it did the last time, so a program polling the clock or the keyboard
+// costs one record per change rather than one per poll; between records
+// replay repeats the last value.
+//
+// "MTRC", version u16, reserved u16, seed u32, snapshot length u32, the
+// starting snapshot as savestate writes it, then the records: count
+// since the previous record (varint), opcode u8, value (varint). The
+// last record has opcode OP_HALT and no value. Its count is where the
+// run stopped, and it is followed by FNV-1a u32 hashes of the CPU
+// (registers and memory) and of the screen.
+#define TRACE_VERSION   1
+#define TRACE_HEADER    16
+
+typedef struct Trace {
+    uint8_t *data;
+    size_t size, capacity;
+    size_t pos;             // replay: read position
+    int replaying;
+    int failed;             // recording: ran out of memory
+    int diverged;           // replay: an input was read out of step
+    uint64_t last;          // count of the previous record
+    uint64_t next;          // replay: count of the pending record
+    uint8_t next_op;        // replay: its opcode
+    uint16_t values[256];   // what each opcode returned last
+} Trace;
+
+static void trace_put(Trace *t, const void *p, size_t n) {
+    if (t->size + n > t->capacity) {
+        size_t cap = t->capacity ? t->capacity : 4096;
+        while (cap < t->size + n) cap *= 2;
+        uint8_t *grown = realloc(t->data, cap);
+        if (!grown) {
+            t->failed = 1;
+            return;
+        }
+        t->data = grown;
+        t->capacity = cap;
+    }
+    memcpy(t->data + t->size, p, n);
+    t->size += n;
+}
+
+static void trace_put_varint(Trace *t, uint64_t v) {
+    uint8_t b[10];
+    size_t n = 0;
+    do {
+        b[n++] = (uint8_t)((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
+    trace_put(t, b, n);
+}
+
+static int trace_get_varint(Trace *t, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; t->pos < t->size && shift < 64; shift += 7) {
+        uint8_t b = t->data[t->pos++];
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+// Replay: read the count and opcode of the next record
+static int trace_next(Trace *t) {
+    uint64_t delta;
+    if (trace_get_varint(t, &delta) != 0 || t->pos >= t->size) return -1;
+    t->next = t->last += delta;
+    t->next_op = t->data[t->pos++];
+    return 0;
+}
+
+// Hashes of the CPU (registers and memory) and of the screen as shown
+static void machine_hashes(uint32_t hash[2]) {
+    uint8_t state[8] = {
+        (uint8_t)cpu.pc, (uint8_t)(cpu.pc >> 8), (uint8_t)cpu.sp, (uint8_t)(cpu.sp >> 8),
+        cpu.flags, (uint8_t)screen.pixel_mode, (uint8_t)screen.pixel_depth, 0
+    };
+    hash[0] = fnv1a_update(fnv1a(state, 5), (const uint8_t *)cpu.regs, sizeof(cpu.regs));
+    hash[0] = fnv1a_update(hash[0], cpu.memory, MEM_SIZE);
+    hash[1] = fnv1a(state + 5, 2);
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        hash[1] = fnv1a_update(hash[1], (const uint8_t *)text_row(y), SCREEN_WIDTH);
+        hash[1] = fnv1a_update(hash[1], color_row(y), SCREEN_WIDTH);
+    }
+    hash[1] = fnv1a_update(hash[1], screen.pixels, PIXEL_BYTES);
+}
+
+// Start recording the program about to run. The trace grows in memory
+// until trace_finish() writes it.
+int trace_start(void) {
+    Trace *t = calloc(1, sizeof(Trace));
+    Snapshot *s = t ? snapshot_take() : NULL;
+    size_t len = 0;
+    uint8_t *snap = s ? snapshot_encode(s, &len) : NULL;
+    if (s) snapshot_free(s);
+    if (!snap) {
+        free(t);
+        return -1;
+    }
+
+    uint8_t head[TRACE_HEADER] = "MTRC";
+    uint32_t n = (uint32_t)len;
+    head[4] = TRACE_VERSION;
+    memcpy(head + 8, &machine->rand_state, 4);
+    memcpy(head + 12, &n, 4);
+    trace_put(t, head, sizeof(head));
+    trace_put(t, snap, len);
+    free(snap);
+    if (t->failed) {
+        free(t->data);
+        free(t);
+        return -1;
+    }
+    t->last = cpu.cycles;
+    machine->trace = t;
+    return 0;
+}
+
+// Stop recording and write the trace to a host file
+int trace_finish(const char *path) {
+    Trace *t = machine->trace;
+    if (!t) return -1;
+    machine->trace = NULL;
+
+    uint32_t hash[2];
+    uint8_t op = OP_HALT;
+    machine_hashes(hash);
+    trace_put_varint(t, cpu.cycles - t->last);
+    trace_put(t, &op, 1);
+    trace_put(t, hash, sizeof(hash));
+
+    FILE *f = t->failed ? NULL : fopen(path, "wb");
+    int result = f && fwrite(t->data, 1, t->size, f) == t->size ? 0 : -1;
+    if (f && fclose(f) != 0) result = -1;
+    free(t->data);
+    free(t);
+    return result;
+}
+
+// Every input a program reads passes through here: logged while
+// recording, replaced by the recorded value while replaying. A replay
+// that reaches an input out of step with the trace stops the program.
+static uint16_t trace_input(uint8_t opcode, uint16_t value) {
+    Trace *t = machine->trace;
+    if (!t) return value;
+    if (!t->replaying) {
+        if (value != t->values[opcode]) {
+            trace_put_varint(t, cpu.cycles - t->last);
+            trace_put(t, &opcode, 1);
+            trace_put_varint(t, value);
+            t->last = cpu.cycles;
+            t->values[opcode] = value;
+        }
+        return value;
+    }
+    if (t->next_op != OP_HALT && t->next <= cpu.cycles) {
+        uint64_t v;
+        if (t->next < cpu.cycles || t->next_op != opcode ||
+            trace_get_varint(t, &v) != 0 || trace_next(t) != 0) {
+            t->diverged = 1;
+            cpu.running = 0;
+            return value;
+        }
+        t->values[opcode] = (uint16_t)v;
+    }
+    return t->values[opcode];
+}
+
+// Flags after comparing x with y: 0x01 zero (equal), 0x02 greater, 0x04 less
+static inline uint8_t compare_flags(uint16_t x, uint16_t y) {
+    return (x == y ? 0x01 : 0) | (x > y ? 0x02 : 0) | (x < y ? 0x04 : 0);
+}
+
+// Bulk memory operations. A range that runs past the end of memory is
+// clipped there, so a range may end on the last byte. The kernels are
+// libc calls or plain byte loops that the compiler vectorizes.
+static inline uint32_t mem_span(uint16_t addr, uint16_t len) {
+    return (uint32_t)addr + len > MEM_SIZE ? MEM_SIZE - addr : len;
+}
+
+// Span of a two-range operation: clipped at whichever range ends first
+static inline uint32_t mem_span2(uint16_t a, uint16_t b, uint16_t len) {
+    uint32_t n = mem_span(a, len), m = mem_span(b, len);
+    return n < m ? n : m;
+}
+
+// Flags for the first differing pair of bytes, as compare_flags() would
+// give; zero when the ranges are equal
+static inline uint8_t mem_compare(const uint8_t *mem, uint16_t a, uint16_t b, uint32_t len) {
+    int diff = memcmp(&mem[a], &mem[b], len);
+    return diff == 0 ? 0x01 : diff > 0 ? 0x02 : 0x04;
+}
+
+// Offset of the first byte equal to value, or len if there is none
+static inline uint32_t mem_find(const uint8_t *mem, uint16_t addr, uint32_t len, uint8_t value) {
+    const uint8_t *hit = memchr(&mem[addr], value, len);
+    return hit ? (uint32_t)(hit - &mem[addr]) : len;
+}
+
+static inline void mem_add(uint8_t *p, uint32_t len, uint8_t value) {
+    for (uint32_t i = 0; i < len; i++) p[i] += value;
+}
+
+static inline void mem_xor(uint8_t *p, uint32_t len, uint8_t value) {
+    for (uint32_t i = 0; i < len; i++) p[i] ^= value;
+}
+
+void execute_instruction(void) {
+    if (cpu.pc >= MEM_SIZE) {
+        cpu.running = 0;
+        return;
+    }
+    
+    uint8_t opcode = cpu.memory[cpu.pc++];
+    
+    // An instruction whose operands would run off the end of memory does
+    // nothing; only its opcode byte is consumed
+    if (cpu.pc + opcode_info[opcode].length > MEM_SIZE + 1) return;
     
     switch (opcode) {
         case OP_HALT:
             cpu.running = 0;
             break;
-        case OP_PRINT_CHAR:
-            if (cpu.pc < MEM_SIZE) {
-                char c = cpu.memory[cpu.pc++];
-                putchar_screen(c);
-            }
+        case OP_PRINT_CHAR: {
+            char c = cpu.memory[cpu.pc++];
+            putchar_screen(c);
             break;
+        }
         case OP_PRINT_STR:
             while (cpu.pc < MEM_SIZE && cpu.memory[cpu.pc]) {
                 putchar_screen(cpu.memory[cpu.pc++]);
@@ -1000,404 +3775,3079 @@ void execute_instruction(void) {
         case OP_CLEAR_SCREEN:
             clear_screen_display();
             break;
-        case OP_SET_COLOR:
-            if (cpu.pc < MEM_SIZE) {
-                uint8_t color = cpu.memory[cpu.pc++];
-                if (color < 16) {
-                    screen.current_color = color;
-                }
+        case OP_SET_COLOR: {
+            uint8_t color = cpu.memory[cpu.pc++];
+            if (color < 16) {
+                screen.current_color = color;
             }
             break;
-        case OP_GET_CURSOR:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint8_t reg_x = cpu.memory[cpu.pc++];
-                uint8_t reg_y = cpu.memory[cpu.pc++];
-                if (reg_x < 8) cpu.regs[reg_x] = screen.cursor_x;
-                if (reg_y < 8) cpu.regs[reg_y] = screen.cursor_y;
-            }
+        }
+        case OP_GET_CURSOR: {
+            uint8_t reg_x = cpu.memory[cpu.pc++];
+            uint8_t reg_y = cpu.memory[cpu.pc++];
+            if (reg_x < 8) cpu.regs[reg_x] = screen.cursor_x;
+            if (reg_y < 8) cpu.regs[reg_y] = screen.cursor_y;
             break;
-        case OP_SET_CURSOR:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint8_t x = cpu.memory[cpu.pc++];
-                uint8_t y = cpu.memory[cpu.pc++];
-                if (x < SCREEN_WIDTH) screen.cursor_x = x;
-                if (y < SCREEN_HEIGHT) screen.cursor_y = y;
-                screen.dirty = 1;
-            }
+        }
+        case OP_SET_CURSOR: {
+            uint8_t x = cpu.memory[cpu.pc++];
+            uint8_t y = cpu.memory[cpu.pc++];
+            if (x < SCREEN_WIDTH) screen.cursor_x = x;
+            if (y < SCREEN_HEIGHT) screen.cursor_y = y;
+            screen.dirty = 1;
             break;
-        case OP_DRAW_LINE:
-            if (cpu.pc + 7 < MEM_SIZE) {
-                uint16_t x0 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t y0 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t x1 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t y1 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                draw_line(x0, y0, x1, y1);
-                screen.pixel_mode = 1;
-            }
+        }
+        case OP_DRAW_LINE: {
+            uint16_t x0 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t y0 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t x1 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t y1 = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            draw_line(x0, y0, x1, y1);
+            screen.pixel_mode = 1;
             break;
-        case OP_DRAW_RECT:
-            if (cpu.pc + 7 < MEM_SIZE) {
-                uint16_t x = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t y = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t w = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t h = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                draw_rect(x, y, w, h);
-                screen.pixel_mode = 1;
-            }
+        }
+        case OP_DRAW_RECT: {
+            uint16_t x = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t y = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t w = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t h = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            draw_rect(x, y, w, h);
+            screen.pixel_mode = 1;
             break;
-        case OP_FILL_RECT:
-            if (cpu.pc + 7 < MEM_SIZE) {
-                uint16_t x = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t y = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t w = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t h = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                fill_rect(x, y, w, h);
-                screen.pixel_mode = 1;
-            }
+        }
+        case OP_FILL_RECT: {
+            uint16_t x = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t y = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t w = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t h = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            fill_rect(x, y, w, h);
+            screen.pixel_mode = 1;
             break;
-        case OP_DRAW_CIRCLE:
-            if (cpu.pc + 5 < MEM_SIZE) {
-                uint16_t cx = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t cy = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t r = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                draw_circle(cx, cy, r);
-                screen.pixel_mode = 1;
-            }
+        }
+        case OP_DRAW_CIRCLE: {
+            uint16_t cx = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t cy = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t r = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            draw_circle(cx, cy, r);
+            screen.pixel_mode = 1;
             break;
-        case OP_SLEEP_MS:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint16_t ms = cpu.memory[cpu.pc++];
-                ms |= (cpu.memory[cpu.pc++] << 8);
-                sleep_ms(ms);
-            }
+        }
+        case OP_SLEEP_MS: {
+            uint16_t ms = cpu.memory[cpu.pc++];
+            ms |= (cpu.memory[cpu.pc++] << 8);
+            program_sleep(ms);
             break;
-        case OP_BEEP:
-            if (cpu.pc + 3 < MEM_SIZE) {
-                uint16_t freq = cpu.memory[cpu.pc++];
-                freq |= (cpu.memory[cpu.pc++] << 8);
-                uint16_t duration = cpu.memory[cpu.pc++];
-                duration |= (cpu.memory[cpu.pc++] << 8);
-                play_beep(freq, duration);
-            }
+        }
+        case OP_BEEP: {
+            uint16_t freq = cpu.memory[cpu.pc++];
+            freq |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t duration = cpu.memory[cpu.pc++];
+            duration |= (cpu.memory[cpu.pc++] << 8);
+            play_beep(freq, duration);
             break;
-        case OP_GET_TIME:
-            if (cpu.pc < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                if (reg < 8) {
-                    time_t now = time(NULL);
-                    cpu.regs[reg] = (uint16_t)(now & 0xFFFF);
-                }
-            }
+        }
+        case OP_TONE: {
+            uint8_t voice = cpu.memory[cpu.pc++];
+            uint16_t freq = cpu.memory[cpu.pc++];
+            freq |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t duration = cpu.memory[cpu.pc++];
+            duration |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t wave = cpu.memory[cpu.pc++];
+            if (voice < AUDIO_VOICES && wave <= WAVE_NOISE) queue_tone(voice, wave, freq, duration);
             break;
-        case OP_RANDOM:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                uint16_t max = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                if (reg < 8) {
-                    cpu.regs[reg] = rand() % (max + 1);
-                }
+        }
+        case OP_GET_TIME: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8) {
+                uint64_t now = headless ? program_ms() / 1000 : (uint64_t)time(NULL);
+                cpu.regs[reg] = trace_input(opcode, (uint16_t)(now & 0xFFFF));
             }
             break;
-        case OP_SET_PIXEL:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint16_t x = cpu.memory[cpu.pc++];
-                x |= (cpu.memory[cpu.pc++] << 8);
-                uint16_t y = cpu.memory[cpu.pc++];
-                y |= (cpu.memory[cpu.pc++] << 8);
-                uint8_t val = cpu.memory[cpu.pc++];
-                set_pixel(x, y, val);
-                screen.pixel_mode = 1;
+        }
+        case OP_GET_TIME_MS: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8) cpu.regs[reg] = trace_input(opcode, (uint16_t)program_ms());
+            break;
+        }
+        case OP_RANDOM: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint16_t max = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            if (reg < 8) {
+                cpu.regs[reg] = machine_rand() % (max + 1);
             }
             break;
+        }
+        case OP_SET_PIXEL: {
+            uint16_t x = cpu.memory[cpu.pc++];
+            x |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t y = cpu.memory[cpu.pc++];
+            y |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t val = cpu.memory[cpu.pc++];
+            set_pixel(x, y, val);
+            screen.pixel_mode = 1;
+            break;
+        }
         case OP_CLEAR_PIXELS:
             clear_pixels();
             screen.pixel_mode = 0;
             break;
-        case OP_LOAD_REG:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                uint16_t val = cpu.memory[cpu.pc++];
-                val |= (cpu.memory[cpu.pc++] << 8);
-                if (reg < 8) cpu.regs[reg] = val;
-            }
+        // Sprites: bitmap address, then x and y as immediates or registers
+        // (signed, so sprites can be clipped at the left and top edges),
+        // width, height and SPRITE_* flags
+        case OP_DRAW_SPRITE: {
+            uint16_t addr = cpu.memory[cpu.pc] | (cpu.memory[cpu.pc + 1] << 8);
+            int16_t x = (int16_t)(cpu.memory[cpu.pc + 2] | (cpu.memory[cpu.pc + 3] << 8));
+            int16_t y = (int16_t)(cpu.memory[cpu.pc + 4] | (cpu.memory[cpu.pc + 5] << 8));
+            uint8_t w = cpu.memory[cpu.pc + 6];
+            uint8_t h = cpu.memory[cpu.pc + 7];
+            uint8_t flags = cpu.memory[cpu.pc + 8];
+            cpu.pc += 9;
+            draw_sprite(addr, x, y, w, h, flags);
+            screen.pixel_mode = 1;
             break;
-        case OP_STORE_REG:
-            if (cpu.pc < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                if (reg < 8 && cpu.pc + 1 < MEM_SIZE) {
-                    uint16_t addr = cpu.memory[cpu.pc++];
-                    addr |= (cpu.memory[cpu.pc++] << 8);
-                    if (addr + 1 < MEM_SIZE) {
-                        cpu.memory[addr] = cpu.regs[reg] & 0xFF;
-                        cpu.memory[addr + 1] = (cpu.regs[reg] >> 8) & 0xFF;
-                    }
-                }
+        }
+        case OP_DRAW_SPRITE_REG: {
+            uint16_t addr = cpu.memory[cpu.pc] | (cpu.memory[cpu.pc + 1] << 8);
+            uint8_t rx = cpu.memory[cpu.pc + 2];
+            uint8_t ry = cpu.memory[cpu.pc + 3];
+            uint8_t w = cpu.memory[cpu.pc + 4];
+            uint8_t h = cpu.memory[cpu.pc + 5];
+            uint8_t flags = cpu.memory[cpu.pc + 6];
+            cpu.pc += 7;
+            if (rx < 8 && ry < 8) {
+                draw_sprite(addr, (int16_t)cpu.regs[rx], (int16_t)cpu.regs[ry], w, h, flags);
+                screen.pixel_mode = 1;
             }
             break;
-        case OP_PUSH:
-            if (cpu.pc < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                if (reg < 8 && cpu.sp > 0) {
-                    cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp] = cpu.regs[reg] & 0xFF;
-                    cpu.sp--;
-                    cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp] = (cpu.regs[reg] >> 8) & 0xFF;
-                    cpu.sp--;
-                }
-            }
+        }
+        case OP_PIXEL_DEPTH: {
+            set_pixel_depth(cpu.memory[cpu.pc++]);
             break;
-        case OP_POP:
-            if (cpu.pc < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                if (reg < 8 && cpu.sp < STACK_SIZE - 1) {
-                    cpu.sp++;
-                    uint16_t val = cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp];
-                    cpu.sp++;
-                    val |= (cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp] << 8);
-                    cpu.regs[reg] = val;
-                }
-            }
+        }
+        case OP_LOAD_REG: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint16_t val = cpu.memory[cpu.pc++];
+            val |= (cpu.memory[cpu.pc++] << 8);
+            if (reg < 8) cpu.regs[reg] = val;
             break;
-        case OP_ADD:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8) {
-                    cpu.regs[dst] = cpu.regs[src1] + cpu.regs[src2];
+        }
+        case OP_STORE_REG: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8) {
+                uint16_t addr = cpu.memory[cpu.pc++];
+                addr |= (cpu.memory[cpu.pc++] << 8);
+                if (addr + 1 < MEM_SIZE) {
+                    cpu.memory[addr] = cpu.regs[reg] & 0xFF;
+                    cpu.memory[addr + 1] = (cpu.regs[reg] >> 8) & 0xFF;
+                    invalidate_decoded(addr, 2);
                 }
             }
             break;
-        case OP_SUB:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8) {
-                    cpu.regs[dst] = cpu.regs[src1] - cpu.regs[src2];
-                }
+        }
+        case OP_PUSH: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8 && STACK_CAN_PUSH(cpu.sp)) {
+                cpu.memory[STACK_ADDR(cpu.sp)] = cpu.regs[reg] & 0xFF;
+                cpu.sp--;
+                cpu.memory[STACK_ADDR(cpu.sp)] = (cpu.regs[reg] >> 8) & 0xFF;
+                invalidate_decoded(STACK_ADDR(cpu.sp), 2);
+                cpu.sp--;
             }
             break;
-        case OP_MUL:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8) {
-                    cpu.regs[dst] = cpu.regs[src1] * cpu.regs[src2];
-                }
+        }
+        case OP_POP: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8 && STACK_CAN_POP(cpu.sp)) {
+                cpu.sp++;
+                uint16_t val = cpu.memory[STACK_ADDR(cpu.sp)];
+                cpu.sp++;
+                val |= (cpu.memory[STACK_ADDR(cpu.sp)] << 8);
+                cpu.regs[reg] = val;
             }
             break;
-        case OP_DIV:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8 && cpu.regs[src2] != 0) {
-                    cpu.regs[dst] = cpu.regs[src1] / cpu.regs[src2];
-                }
+        }
+        case OP_ADD: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8) {
+                cpu.regs[dst] = cpu.regs[src1] + cpu.regs[src2];
             }
             break;
-        case OP_MOD:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8 && cpu.regs[src2] != 0) {
-                    cpu.regs[dst] = cpu.regs[src1] % cpu.regs[src2];
-                }
+        }
+        case OP_SUB: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8) {
+                cpu.regs[dst] = cpu.regs[src1] - cpu.regs[src2];
             }
             break;
-        case OP_AND:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8) {
-                    cpu.regs[dst] = cpu.regs[src1] & cpu.regs[src2];
-                }
+        }
+        case OP_MUL: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8) {
+                cpu.regs[dst] = cpu.regs[src1] * cpu.regs[src2];
             }
             break;
-        case OP_OR:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8) {
-                    cpu.regs[dst] = cpu.regs[src1] | cpu.regs[src2];
-                }
+        }
+        case OP_DIV: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8 && cpu.regs[src2] != 0) {
+                cpu.regs[dst] = cpu.regs[src1] / cpu.regs[src2];
             }
             break;
-        case OP_XOR:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (dst < 8 && src1 < 8 && src2 < 8) {
-                    cpu.regs[dst] = cpu.regs[src1] ^ cpu.regs[src2];
-                }
+        }
+        case OP_MOD: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8 && cpu.regs[src2] != 0) {
+                cpu.regs[dst] = cpu.regs[src1] % cpu.regs[src2];
             }
             break;
-        case OP_NOT:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src = cpu.memory[cpu.pc++];
-                if (dst < 8 && src < 8) {
-                    cpu.regs[dst] = ~cpu.regs[src];
-                }
+        }
+        case OP_AND: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8) {
+                cpu.regs[dst] = cpu.regs[src1] & cpu.regs[src2];
             }
             break;
-        case OP_SHL:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src = cpu.memory[cpu.pc++];
-                if (dst < 8 && src < 8) {
-                    cpu.regs[dst] = cpu.regs[dst] << cpu.regs[src];
-                }
+        }
+        case OP_OR: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8) {
+                cpu.regs[dst] = cpu.regs[src1] | cpu.regs[src2];
             }
             break;
-        case OP_SHR:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint8_t dst = cpu.memory[cpu.pc++];
-                uint8_t src = cpu.memory[cpu.pc++];
-                if (dst < 8 && src < 8) {
-                    cpu.regs[dst] = cpu.regs[dst] >> cpu.regs[src];
-                }
+        }
+        case OP_XOR: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (dst < 8 && src1 < 8 && src2 < 8) {
+                cpu.regs[dst] = cpu.regs[src1] ^ cpu.regs[src2];
             }
             break;
-        case OP_CMP:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint8_t src1 = cpu.memory[cpu.pc++];
-                uint8_t src2 = cpu.memory[cpu.pc++];
-                if (src1 < 8 && src2 < 8) {
-                    cpu.flags = 0;
-                    if (cpu.regs[src1] == cpu.regs[src2]) cpu.flags |= 0x01; // Zero
-                    if (cpu.regs[src1] > cpu.regs[src2]) cpu.flags |= 0x02;  // Greater
-                    if (cpu.regs[src1] < cpu.regs[src2]) cpu.flags |= 0x04;  // Less
-                }
+        }
+        case OP_NOT: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src = cpu.memory[cpu.pc++];
+            if (dst < 8 && src < 8) {
+                cpu.regs[dst] = ~cpu.regs[src];
             }
             break;
-        case OP_JMP:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint16_t addr = cpu.memory[cpu.pc++];
-                addr |= (cpu.memory[cpu.pc++] << 8);
-                if (addr < MEM_SIZE) cpu.pc = addr;
+        }
+        case OP_SHL: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src = cpu.memory[cpu.pc++];
+            if (dst < 8 && src < 8) {
+                cpu.regs[dst] = cpu.regs[dst] << cpu.regs[src];
             }
             break;
-        case OP_JZ:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint16_t addr = cpu.memory[cpu.pc++];
-                addr |= (cpu.memory[cpu.pc++] << 8);
-                if ((cpu.flags & 0x01) && addr < MEM_SIZE) cpu.pc = addr;
+        }
+        case OP_SHR: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint8_t src = cpu.memory[cpu.pc++];
+            if (dst < 8 && src < 8) {
+                cpu.regs[dst] = cpu.regs[dst] >> cpu.regs[src];
             }
             break;
-        case OP_JNZ:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint16_t addr = cpu.memory[cpu.pc++];
-                addr |= (cpu.memory[cpu.pc++] << 8);
-                if (!(cpu.flags & 0x01) && addr < MEM_SIZE) cpu.pc = addr;
+        }
+        case OP_CMP: {
+            uint8_t src1 = cpu.memory[cpu.pc++];
+            uint8_t src2 = cpu.memory[cpu.pc++];
+            if (src1 < 8 && src2 < 8) {
+                cpu.flags = compare_flags(cpu.regs[src1], cpu.regs[src2]);
             }
             break;
-        case OP_JG:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint16_t addr = cpu.memory[cpu.pc++];
-                addr |= (cpu.memory[cpu.pc++] << 8);
-                if ((cpu.flags & 0x02) && addr < MEM_SIZE) cpu.pc = addr;
-            }
+        }
+        // Fused forms of common sequences. ADDI is LOAD_REG + ADD, CMPI is
+        // LOAD_REG + CMP; both leave every register but dst untouched.
+        case OP_ADDI: {
+            uint8_t dst = cpu.memory[cpu.pc++];
+            uint16_t imm = cpu.memory[cpu.pc++];
+            imm |= (cpu.memory[cpu.pc++] << 8);
+            if (dst < 8) cpu.regs[dst] += imm;
             break;
-        case OP_JL:
-            if (cpu.pc + 1 < MEM_SIZE) {
-                uint16_t addr = cpu.memory[cpu.pc++];
-                addr |= (cpu.memory[cpu.pc++] << 8);
-                if ((cpu.flags & 0x04) && addr < MEM_SIZE) cpu.pc = addr;
-            }
+        }
+        case OP_CMPI: {
+            uint8_t src = cpu.memory[cpu.pc++];
+            uint16_t imm = cpu.memory[cpu.pc++];
+            imm |= (cpu.memory[cpu.pc++] << 8);
+            if (src < 8) cpu.flags = compare_flags(cpu.regs[src], imm);
+            break;
+        }
+        case OP_JMP: {
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if (addr < MEM_SIZE) cpu.pc = addr;
+            break;
+        }
+        case OP_JZ: {
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if ((cpu.flags & 0x01) && addr < MEM_SIZE) cpu.pc = addr;
+            break;
+        }
+        case OP_JNZ: {
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if (!(cpu.flags & 0x01) && addr < MEM_SIZE) cpu.pc = addr;
+            break;
+        }
+        case OP_JG: {
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if ((cpu.flags & 0x02) && addr < MEM_SIZE) cpu.pc = addr;
+            break;
+        }
+        case OP_JL: {
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if ((cpu.flags & 0x04) && addr < MEM_SIZE) cpu.pc = addr;
             break;
+        }
         case OP_CALL:
-            if (cpu.pc + 1 < MEM_SIZE && cpu.sp > 1) {
+            if (STACK_CAN_PUSH(cpu.sp)) {
                 uint16_t addr = cpu.memory[cpu.pc++];
                 addr |= (cpu.memory[cpu.pc++] << 8);
                 // Push return address
-                cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp] = cpu.pc & 0xFF;
+                cpu.memory[STACK_ADDR(cpu.sp)] = cpu.pc & 0xFF;
                 cpu.sp--;
-                cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp] = (cpu.pc >> 8) & 0xFF;
+                cpu.memory[STACK_ADDR(cpu.sp)] = (cpu.pc >> 8) & 0xFF;
+                invalidate_decoded(STACK_ADDR(cpu.sp), 2);
                 cpu.sp--;
                 if (addr < MEM_SIZE) cpu.pc = addr;
             }
             break;
         case OP_RET:
-            if (cpu.sp < STACK_SIZE - 1) {
+            if (STACK_CAN_POP(cpu.sp)) {
                 cpu.sp++;
-                uint16_t addr = cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp];
+                uint16_t addr = cpu.memory[STACK_ADDR(cpu.sp)];
                 cpu.sp++;
-                addr |= (cpu.memory[MEM_SIZE - STACK_SIZE + cpu.sp] << 8);
+                addr |= (cpu.memory[STACK_ADDR(cpu.sp)] << 8);
                 if (addr < MEM_SIZE) cpu.pc = addr;
             }
             break;
-        case OP_READ_CHAR:
-            if (cpu.pc < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                if (reg < 8) {
-                    pthread_mutex_lock(&input_buf.mutex);
-                    input_buf.char_ready = 0;
-                    pthread_mutex_unlock(&input_buf.mutex);
-                    
-                    while (!input_buf.char_ready && window_running) {
-                        sleep_ms(50);
-                    }
-                    
-                    pthread_mutex_lock(&input_buf.mutex);
-                    cpu.regs[reg] = input_buf.last_char;
-                    pthread_mutex_unlock(&input_buf.mutex);
-                }
+        // DJNZ is SUB reg, 1 + CMP reg, 0 + JNZ; CJNE is CMPI + JNZ
+        case OP_DJNZ: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if (reg < 8) {
+                cpu.flags = compare_flags(--cpu.regs[reg], 0);
+                if (cpu.regs[reg] != 0 && addr < MEM_SIZE) cpu.pc = addr;
             }
             break;
-        case OP_LOAD_MEM:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint8_t reg = cpu.memory[cpu.pc++];
-                uint16_t addr = cpu.memory[cpu.pc++];
-                addr |= (cpu.memory[cpu.pc++] << 8);
-                if (reg < 8 && addr + 1 < MEM_SIZE) {
-                    cpu.regs[reg] = cpu.memory[addr];
-                    cpu.regs[reg] |= (cpu.memory[addr + 1] << 8);
-                }
+        }
+        case OP_CJNE: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint16_t imm = cpu.memory[cpu.pc++];
+            imm |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if (reg < 8) {
+                cpu.flags = compare_flags(cpu.regs[reg], imm);
+                if (cpu.regs[reg] != imm && addr < MEM_SIZE) cpu.pc = addr;
+            }
+            break;
+        }
+        case OP_READ_CHAR: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8) {
+                pthread_mutex_lock(&input_buf.mutex);
+                if (!headless) wait_for_input(&input_buf.key_count);
+                uint16_t key = (uint8_t)take_key();
+                pthread_mutex_unlock(&input_buf.mutex);
+                cpu.regs[reg] = trace_input(opcode, key);
+            }
+            break;
+        }
+        case OP_KEY_PRESSED: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8) {
+                pthread_mutex_lock(&input_buf.mutex);
+                uint16_t key = (uint8_t)take_key();
+                pthread_mutex_unlock(&input_buf.mutex);
+                cpu.regs[reg] = trace_input(opcode, key);
+            }
+            break;
+        }
+        case OP_LOAD_MEM: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            if (reg < 8 && addr + 1 < MEM_SIZE) {
+                cpu.regs[reg] = cpu.memory[addr];
+                cpu.regs[reg] |= (cpu.memory[addr + 1] << 8);
+            }
+            break;
+        }
+        case OP_STORE_MEM: {
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8 && addr + 1 < MEM_SIZE) {
+                cpu.memory[addr] = cpu.regs[reg] & 0xFF;
+                cpu.memory[addr + 1] = (cpu.regs[reg] >> 8) & 0xFF;
+                invalidate_decoded(addr, 2);
+            }
+            break;
+        }
+        case OP_COPY_MEM: {
+            uint16_t src = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t dst = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint16_t len = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
+            uint32_t n = mem_span2(src, dst, len);
+            memmove(&cpu.memory[dst], &cpu.memory[src], n);
+            invalidate_decoded(dst, n);
+            break;
+        }
+        // Indexed forms address base + regs[idx], e.g. table[i]
+        case OP_LOAD_IDX: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint16_t base = cpu.memory[cpu.pc++];
+            base |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t idx = cpu.memory[cpu.pc++];
+            if (reg < 8 && idx < 8) {
+                uint32_t addr = (uint32_t)base + cpu.regs[idx];
+                if (addr + 1 < MEM_SIZE) {
+                    cpu.regs[reg] = cpu.memory[addr];
+                    cpu.regs[reg] |= (cpu.memory[addr + 1] << 8);
+                }
+            }
+            break;
+        }
+        case OP_STORE_IDX: {
+            uint16_t base = cpu.memory[cpu.pc++];
+            base |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t idx = cpu.memory[cpu.pc++];
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (reg < 8 && idx < 8) {
+                uint32_t addr = (uint32_t)base + cpu.regs[idx];
+                if (addr + 1 < MEM_SIZE) {
+                    cpu.memory[addr] = cpu.regs[reg] & 0xFF;
+                    cpu.memory[addr + 1] = (cpu.regs[reg] >> 8) & 0xFF;
+                    invalidate_decoded(addr, 2);
+                }
+            }
+            break;
+        }
+        case OP_FILL_MEM: {
+            uint16_t dst = cpu.memory[cpu.pc++];
+            dst |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t len = cpu.memory[cpu.pc++];
+            len |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t value = cpu.memory[cpu.pc++];
+            uint32_t n = mem_span(dst, len);
+            memset(&cpu.memory[dst], value, n);
+            invalidate_decoded(dst, n);
+            break;
+        }
+        // Sets the flags as CMP would for the first pair of bytes that differ
+        case OP_CMP_MEM: {
+            uint16_t a = cpu.memory[cpu.pc++];
+            a |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t b = cpu.memory[cpu.pc++];
+            b |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t len = cpu.memory[cpu.pc++];
+            len |= (cpu.memory[cpu.pc++] << 8);
+            cpu.flags = mem_compare(cpu.memory, a, b, mem_span2(a, b, len));
+            break;
+        }
+        // reg = offset of the first match (or the length); zero flag if found
+        case OP_FIND_BYTE: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint16_t addr = cpu.memory[cpu.pc++];
+            addr |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t len = cpu.memory[cpu.pc++];
+            len |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t value = cpu.memory[cpu.pc++];
+            if (reg < 8) {
+                uint32_t n = mem_span(addr, len);
+                uint32_t at = mem_find(cpu.memory, addr, n, value);
+                cpu.regs[reg] = (uint16_t)at;
+                cpu.flags = at < n ? 0x01 : 0;
+            }
+            break;
+        }
+        case OP_ADD_MEM:
+        case OP_XOR_MEM: {
+            uint16_t dst = cpu.memory[cpu.pc++];
+            dst |= (cpu.memory[cpu.pc++] << 8);
+            uint16_t len = cpu.memory[cpu.pc++];
+            len |= (cpu.memory[cpu.pc++] << 8);
+            uint8_t value = cpu.memory[cpu.pc++];
+            uint32_t n = mem_span(dst, len);
+            if (opcode == OP_ADD_MEM) mem_add(&cpu.memory[dst], n, value);
+            else mem_xor(&cpu.memory[dst], n, value);
+            invalidate_decoded(dst, n);
+            break;
+        }
+        // Show page reg in a bank window, BANK_NONE for its own RAM
+        case OP_SET_BANK: {
+            uint8_t window = cpu.memory[cpu.pc++];
+            uint8_t reg = cpu.memory[cpu.pc++];
+            if (window < BANK_WINDOWS && reg < 8 &&
+                (cpu.regs[reg] < BANK_PAGES || cpu.regs[reg] == BANK_NONE) &&
+                bank_map(window, cpu.regs[reg]) != 0) {
+                print_to_screen("Error: Out of memory for banked pages\n");
+                cpu.running = 0;
+            }
+            break;
+        }
+        case OP_GET_BANK: {
+            uint8_t reg = cpu.memory[cpu.pc++];
+            uint8_t window = cpu.memory[cpu.pc++];
+            if (reg < 8 && window < BANK_WINDOWS) {
+                cpu.regs[reg] = machine->banks ? machine->banks->map[window] : BANK_NONE;
+            }
+            break;
+        }
+        default: {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Error: Unknown opcode 0x%02X\n", opcode);
+            print_to_screen(msg);
+            cpu.running = 0;
+            break;
+        }
+    }
+}
+
+// What an instruction costs the scheduler. An unassigned opcode stops the
+// machine, and is charged one cycle for the attempt.
+static inline uint32_t opcode_cycles(uint8_t opcode) {
+    return opcode_info[opcode].cycles ? opcode_info[opcode].cycles : 1;
+}
+
+// Execute one instruction and charge it to cpu.cycles; returns its opcode
+static inline uint8_t step_instruction(void) {
+    uint8_t opcode = cpu.memory[cpu.pc];
+    execute_instruction();
+    cpu.cycles += opcode_cycles(opcode);
+    return opcode;
+}
+
+static uint16_t mem_word(uint32_t addr) {
+    return cpu.memory[addr] | (cpu.memory[addr + 1] << 8);
+}
+
+// Decode the instruction at pc into decode_cache[pc]. Operand bounds and
+// register numbers are checked here once, lengths coming from
+// opcode_info[] as the interpreter's do; any instruction whose checks
+// fail, or whose opcode has no fast handler, becomes DK_FALLBACK so the
+// reference interpreter keeps the exact edge-case behaviour.
+void predecode_at(uint16_t pc) {
+    DecodedOp *op = &decode_cache[pc];
+    uint32_t p = (uint32_t)pc + 1;
+    uint8_t opcode = cpu.memory[pc];
+    uint8_t length = opcode_info[opcode].length;
+    const uint8_t *m = cpu.memory;
+
+    op->kind = DK_FALLBACK;
+    op->len = 1;
+    op->a = op->b = op->c = 0;
+    decoded_pages[pc >> 8] = 1;
+    if (p + length > MEM_SIZE + 1) return;
+
+    switch (opcode) {
+        case OP_HALT:
+            op->kind = DK_HALT;
+            break;
+        case OP_PRINT_CHAR:
+            op->kind = DK_PRINT_CHAR;
+            op->a = m[p];
+            break;
+        case OP_SET_PIXEL:
+            op->kind = DK_SET_PIXEL;
+            op->a = mem_word(p);
+            op->b = mem_word(p + 2);
+            op->c = m[p + 4];
+            break;
+        case OP_LOAD_REG:
+            if (m[p] < 8) {
+                op->kind = DK_LOAD_REG;
+                op->a = m[p];
+                op->b = mem_word(p + 1);
+            }
+            break;
+        case OP_STORE_REG:
+            if (m[p] < 8 && mem_word(p + 1) + 1 < MEM_SIZE) {
+                op->kind = DK_STORE_REG;
+                op->a = m[p];
+                op->b = mem_word(p + 1);
+            }
+            break;
+        case OP_PUSH:
+        case OP_POP:
+            if (m[p] < 8) {
+                op->kind = opcode == OP_PUSH ? DK_PUSH : DK_POP;
+                op->a = m[p];
+            }
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_AND: case OP_OR: case OP_XOR:
+            if (m[p] < 8 && m[p + 1] < 8 && m[p + 2] < 8) {
+                op->kind = DK_ADD + (opcode - OP_ADD);
+                op->a = m[p];
+                op->b = m[p + 1];
+                op->c = m[p + 2];
+            }
+            break;
+        case OP_NOT: case OP_SHL: case OP_SHR: case OP_CMP:
+            if (m[p] < 8 && m[p + 1] < 8) {
+                op->kind = DK_NOT + (opcode - OP_NOT);
+                op->a = m[p];
+                op->b = m[p + 1];
+            }
+            break;
+        case OP_JMP: case OP_JZ: case OP_JNZ: case OP_JG: case OP_JL: case OP_CALL:
+            op->kind = DK_JMP + (opcode - OP_JMP);
+            op->a = mem_word(p);
+            break;
+        case OP_RET:
+            op->kind = DK_RET;
+            break;
+        case OP_ADDI: case OP_CMPI: case OP_DJNZ:
+            if (m[p] < 8) {
+                op->kind = opcode == OP_ADDI ? DK_ADDI : opcode == OP_CMPI ? DK_CMPI : DK_DJNZ;
+                op->a = m[p];
+                op->b = mem_word(p + 1);
+            }
+            break;
+        case OP_CJNE:
+            if (m[p] < 8) {
+                op->kind = DK_CJNE;
+                op->a = m[p];
+                op->b = mem_word(p + 1);
+                op->c = mem_word(p + 3);
+            }
+            break;
+        case OP_LOAD_IDX:
+            if (m[p] < 8 && m[p + 3] < 8) {
+                op->kind = DK_LOAD_IDX;
+                op->a = m[p];
+                op->b = mem_word(p + 1);
+                op->c = m[p + 3];
+            }
+            break;
+        case OP_STORE_IDX:
+            if (m[p + 2] < 8 && m[p + 3] < 8) {
+                op->kind = DK_STORE_IDX;
+                op->a = m[p + 3];
+                op->b = mem_word(p);
+                op->c = m[p + 2];
+            }
+            break;
+        // Bulk ranges are clipped here, once, so op->b/op->c hold the
+        // length actually touched
+        case OP_FILL_MEM:
+        case OP_ADD_MEM:
+        case OP_XOR_MEM:
+            op->kind = opcode == OP_FILL_MEM ? DK_FILL_MEM :
+                       opcode == OP_ADD_MEM ? DK_ADD_MEM : DK_XOR_MEM;
+            op->a = mem_word(p);
+            op->b = (uint16_t)mem_span(mem_word(p), mem_word(p + 2));
+            op->c = m[p + 4];
+            break;
+        case OP_CMP_MEM:
+            op->kind = DK_CMP_MEM;
+            op->a = mem_word(p);
+            op->b = mem_word(p + 2);
+            op->c = (uint16_t)mem_span2(op->a, op->b, mem_word(p + 4));
+            break;
+        case OP_FIND_BYTE:
+            // Four operands: the register shares a with the byte to find
+            if (m[p] < 8) {
+                op->kind = DK_FIND_BYTE;
+                op->a = m[p] | (m[p + 5] << 8);
+                op->b = mem_word(p + 1);
+                op->c = (uint16_t)mem_span(op->b, mem_word(p + 3));
+            }
+            break;
+        case OP_LOAD_MEM:
+        case OP_STORE_MEM: {
+            uint8_t reg = opcode == OP_LOAD_MEM ? m[p] : m[p + 2];
+            uint16_t addr = opcode == OP_LOAD_MEM ? mem_word(p + 1) : mem_word(p);
+            if (reg < 8 && addr + 1 < MEM_SIZE) {
+                op->kind = opcode == OP_LOAD_MEM ? DK_LOAD_MEM : DK_STORE_MEM;
+                op->a = reg;
+                op->b = addr;
+            }
+            break;
+        }
+        case OP_COPY_MEM: {
+            uint16_t src = mem_word(p);
+            uint16_t dst = mem_word(p + 2);
+            op->kind = DK_COPY_MEM;
+            op->a = src;
+            op->b = dst;
+            op->c = (uint16_t)mem_span2(src, dst, mem_word(p + 4));
+            break;
+        }
+    }
+    if (op->kind != DK_FALLBACK) op->len = length;
+}
+
+// Predecoded engine. With GCC/Clang each handler jumps straight to the
+// next one through a label table (direct threading); other compilers get
+// the same handlers as a switch in a loop. The engine walks decode_cache
+// directly: falling through to the next instruction is op += len, and
+// cpu.pc is only written back when control leaves the fast handlers.
+// The slice budget is counted down locally, by each handler's OPCYC_*,
+// and folded back into cpu.cycles on the way out; like the interpreter,
+// the last instruction may take the count past cycle_limit.
+#if defined(__GNUC__)
+    #define DK_THREADED 1
+#endif
+
+void run_predecoded(void) {
+    DecodedOp *op = &decode_cache[cpu.pc];
+    uint16_t *r = cpu.regs;
+    uint8_t *stack = &cpu.memory[MEM_SIZE - STACK_SIZE];
+    int64_t left;
+
+    if (!cpu.running || cpu.cycles >= cpu.cycle_limit) return;
+    left = (int64_t)(cpu.cycle_limit - cpu.cycles);
+
+#ifdef DK_THREADED
+    static const void *labels[DK_COUNT] = {
+        &&L_DK_UNDECODED, &&L_DK_FALLBACK, &&L_DK_WRAP, &&L_DK_HALT,
+        &&L_DK_PRINT_CHAR, &&L_DK_SET_PIXEL, &&L_DK_LOAD_REG, &&L_DK_STORE_REG,
+        &&L_DK_PUSH, &&L_DK_POP, &&L_DK_ADD, &&L_DK_SUB, &&L_DK_MUL,
+        &&L_DK_DIV, &&L_DK_MOD, &&L_DK_AND, &&L_DK_OR, &&L_DK_XOR,
+        &&L_DK_NOT, &&L_DK_SHL, &&L_DK_SHR, &&L_DK_CMP, &&L_DK_JMP,
+        &&L_DK_JZ, &&L_DK_JNZ, &&L_DK_JG, &&L_DK_JL, &&L_DK_CALL,
+        &&L_DK_RET, &&L_DK_LOAD_MEM, &&L_DK_STORE_MEM, &&L_DK_COPY_MEM,
+        &&L_DK_ADDI, &&L_DK_CMPI, &&L_DK_DJNZ, &&L_DK_CJNE,
+        &&L_DK_LOAD_IDX, &&L_DK_STORE_IDX, &&L_DK_FILL_MEM,
+        &&L_DK_CMP_MEM, &&L_DK_FIND_BYTE, &&L_DK_ADD_MEM, &&L_DK_XOR_MEM
+    };
+    #define DK_CASE(k)      L_##k:
+    #define DK_DISPATCH()   goto *labels[op->kind]
+#else
+    #define DK_CASE(k)      case k:
+    #define DK_DISPATCH()   goto dispatch
+#endif
+    // Every handler that retires an instruction leaves through DK_NEXT,
+    // with the cycles that instruction costs
+    #define DK_NEXT(cycles) do { if ((left -= (cycles)) <= 0) goto out; DK_DISPATCH(); } while (0)
+
+#ifdef DK_THREADED
+    DK_DISPATCH();
+#else
+dispatch:
+    switch (op->kind) {
+#endif
+
+    DK_CASE(DK_UNDECODED)
+        predecode_at((uint16_t)(op - decode_cache));
+        DK_DISPATCH();
+    DK_CASE(DK_FALLBACK)
+    fallback:
+        // cpu.cycles is kept up to date for the instruction: the virtual
+        // clock reads it
+        cpu.pc = (uint16_t)(op - decode_cache);
+        cpu.cycles = cpu.cycle_limit - left;
+        left -= opcode_cycles(cpu.memory[cpu.pc]);
+        execute_instruction();
+        if (!cpu.running || left <= 0) goto done;
+        op = &decode_cache[cpu.pc];
+        DK_DISPATCH();
+    DK_CASE(DK_WRAP)
+        // pc ran off the end of memory and wraps to 0, as uint16_t does
+        op = decode_cache;
+        DK_DISPATCH();
+    DK_CASE(DK_HALT)
+        cpu.pc = (uint16_t)(op - decode_cache + OPLEN_HALT);
+        cpu.running = 0;
+        left -= OPCYC_HALT;
+        goto done;
+    DK_CASE(DK_PRINT_CHAR)
+        putchar_screen((char)op->a);
+        op += OPLEN_PRINT_CHAR;
+        DK_NEXT(OPCYC_PRINT_CHAR);
+    DK_CASE(DK_SET_PIXEL)
+        set_pixel(op->a, op->b, op->c);
+        screen.pixel_mode = 1;
+        op += OPLEN_SET_PIXEL;
+        DK_NEXT(OPCYC_SET_PIXEL);
+    DK_CASE(DK_LOAD_REG)
+        r[op->a] = op->b;
+        op += OPLEN_LOAD_REG;
+        DK_NEXT(OPCYC_LOAD_REG);
+    DK_CASE(DK_STORE_REG)
+    DK_CASE(DK_STORE_MEM) {
+        _Static_assert(OPLEN_STORE_REG == OPLEN_STORE_MEM && OPCYC_STORE_REG == OPCYC_STORE_MEM,
+                       "STORE_REG shares this handler");
+        uint16_t addr = op->b, val = r[op->a];
+        op += OPLEN_STORE_MEM;
+        cpu.memory[addr] = val & 0xFF;
+        cpu.memory[addr + 1] = (val >> 8) & 0xFF;
+        invalidate_decoded(addr, 2);
+        DK_NEXT(OPCYC_STORE_MEM);
+    }
+    // Stack operations that would leave the stack page are left to the
+    // interpreter, which refuses them.
+    DK_CASE(DK_PUSH)
+        if (!STACK_CAN_PUSH(cpu.sp)) goto fallback;
+        stack[cpu.sp] = r[op->a] & 0xFF;
+        stack[cpu.sp - 1] = (r[op->a] >> 8) & 0xFF;
+        cpu.sp -= 2;
+        invalidate_decoded(MEM_SIZE - STACK_SIZE + cpu.sp + 1, 2);
+        op += OPLEN_PUSH;
+        DK_NEXT(OPCYC_PUSH);
+    DK_CASE(DK_POP)
+        if (!STACK_CAN_POP(cpu.sp)) goto fallback;
+        r[op->a] = stack[cpu.sp + 1] | (stack[cpu.sp + 2] << 8);
+        cpu.sp += 2;
+        op += OPLEN_POP;
+        DK_NEXT(OPCYC_POP);
+    DK_CASE(DK_CALL) {
+        uint16_t ret = (uint16_t)(op - decode_cache + OPLEN_CALL);
+        if (!STACK_CAN_PUSH(cpu.sp)) goto fallback;
+        stack[cpu.sp] = ret & 0xFF;
+        stack[cpu.sp - 1] = (ret >> 8) & 0xFF;
+        cpu.sp -= 2;
+        invalidate_decoded(MEM_SIZE - STACK_SIZE + cpu.sp + 1, 2);
+        op = &decode_cache[op->a];
+        DK_NEXT(OPCYC_CALL);
+    }
+    DK_CASE(DK_RET)
+        if (!STACK_CAN_POP(cpu.sp)) goto fallback;
+        op = &decode_cache[stack[cpu.sp + 1] | (stack[cpu.sp + 2] << 8)];
+        cpu.sp += 2;
+        DK_NEXT(OPCYC_RET);
+    DK_CASE(DK_ADD) r[op->a] = r[op->b] + r[op->c]; op += OPLEN_ADD; DK_NEXT(OPCYC_ADD);
+    DK_CASE(DK_SUB) r[op->a] = r[op->b] - r[op->c]; op += OPLEN_SUB; DK_NEXT(OPCYC_SUB);
+    DK_CASE(DK_MUL) r[op->a] = r[op->b] * r[op->c]; op += OPLEN_MUL; DK_NEXT(OPCYC_MUL);
+    DK_CASE(DK_DIV)
+        if (r[op->c] != 0) r[op->a] = r[op->b] / r[op->c];
+        op += OPLEN_DIV;
+        DK_NEXT(OPCYC_DIV);
+    DK_CASE(DK_MOD)
+        if (r[op->c] != 0) r[op->a] = r[op->b] % r[op->c];
+        op += OPLEN_MOD;
+        DK_NEXT(OPCYC_MOD);
+    DK_CASE(DK_AND) r[op->a] = r[op->b] & r[op->c]; op += OPLEN_AND; DK_NEXT(OPCYC_AND);
+    DK_CASE(DK_OR)  r[op->a] = r[op->b] | r[op->c]; op += OPLEN_OR; DK_NEXT(OPCYC_OR);
+    DK_CASE(DK_XOR) r[op->a] = r[op->b] ^ r[op->c]; op += OPLEN_XOR; DK_NEXT(OPCYC_XOR);
+    DK_CASE(DK_NOT) r[op->a] = ~r[op->b]; op += OPLEN_NOT; DK_NEXT(OPCYC_NOT);
+    DK_CASE(DK_SHL) r[op->a] = r[op->a] << r[op->b]; op += OPLEN_SHL; DK_NEXT(OPCYC_SHL);
+    DK_CASE(DK_SHR) r[op->a] = r[op->a] >> r[op->b]; op += OPLEN_SHR; DK_NEXT(OPCYC_SHR);
+    DK_CASE(DK_CMP)
+        cpu.flags = compare_flags(r[op->a], r[op->b]);
+        op += OPLEN_CMP;
+        DK_NEXT(OPCYC_CMP);
+    DK_CASE(DK_ADDI) r[op->a] += op->b; op += OPLEN_ADDI; DK_NEXT(OPCYC_ADDI);
+    DK_CASE(DK_CMPI)
+        cpu.flags = compare_flags(r[op->a], op->b);
+        op += OPLEN_CMPI;
+        DK_NEXT(OPCYC_CMPI);
+    DK_CASE(DK_DJNZ)
+        cpu.flags = compare_flags(--r[op->a], 0);
+        op = r[op->a] != 0 ? &decode_cache[op->b] : op + OPLEN_DJNZ;
+        DK_NEXT(OPCYC_DJNZ);
+    DK_CASE(DK_CJNE)
+        cpu.flags = compare_flags(r[op->a], op->b);
+        op = r[op->a] != op->b ? &decode_cache[op->c] : op + OPLEN_CJNE;
+        DK_NEXT(OPCYC_CJNE);
+    DK_CASE(DK_JMP) op = &decode_cache[op->a]; DK_NEXT(OPCYC_JMP);
+    DK_CASE(DK_JZ)  op = (cpu.flags & 0x01) ? &decode_cache[op->a] : op + OPLEN_JZ; DK_NEXT(OPCYC_JZ);
+    DK_CASE(DK_JNZ) op = !(cpu.flags & 0x01) ? &decode_cache[op->a] : op + OPLEN_JNZ; DK_NEXT(OPCYC_JNZ);
+    DK_CASE(DK_JG)  op = (cpu.flags & 0x02) ? &decode_cache[op->a] : op + OPLEN_JG; DK_NEXT(OPCYC_JG);
+    DK_CASE(DK_JL)  op = (cpu.flags & 0x04) ? &decode_cache[op->a] : op + OPLEN_JL; DK_NEXT(OPCYC_JL);
+    DK_CASE(DK_LOAD_MEM)
+        r[op->a] = cpu.memory[op->b] | (cpu.memory[op->b + 1] << 8);
+        op += OPLEN_LOAD_MEM;
+        DK_NEXT(OPCYC_LOAD_MEM);
+    DK_CASE(DK_COPY_MEM) {
+        uint16_t src = op->a, dst = op->b, len = op->c;
+        op += OPLEN_COPY_MEM;
+        memmove(&cpu.memory[dst], &cpu.memory[src], len);
+        invalidate_decoded(dst, len);
+        DK_NEXT(OPCYC_COPY_MEM);
+    }
+    DK_CASE(DK_LOAD_IDX) {
+        uint32_t addr = (uint32_t)op->b + r[op->c];
+        if (addr + 1 < MEM_SIZE) r[op->a] = cpu.memory[addr] | (cpu.memory[addr + 1] << 8);
+        op += OPLEN_LOAD_IDX;
+        DK_NEXT(OPCYC_LOAD_IDX);
+    }
+    DK_CASE(DK_STORE_IDX) {
+        uint32_t addr = (uint32_t)op->b + r[op->c];
+        uint16_t val = r[op->a];
+        op += OPLEN_STORE_IDX;
+        if (addr + 1 < MEM_SIZE) {
+            cpu.memory[addr] = val & 0xFF;
+            cpu.memory[addr + 1] = (val >> 8) & 0xFF;
+            invalidate_decoded(addr, 2);
+        }
+        DK_NEXT(OPCYC_STORE_IDX);
+    }
+    DK_CASE(DK_FILL_MEM) {
+        uint16_t dst = op->a, len = op->b;
+        uint8_t value = (uint8_t)op->c;
+        op += OPLEN_FILL_MEM;
+        memset(&cpu.memory[dst], value, len);
+        invalidate_decoded(dst, len);
+        DK_NEXT(OPCYC_FILL_MEM);
+    }
+    DK_CASE(DK_CMP_MEM)
+        cpu.flags = mem_compare(cpu.memory, op->a, op->b, op->c);
+        op += OPLEN_CMP_MEM;
+        DK_NEXT(OPCYC_CMP_MEM);
+    DK_CASE(DK_FIND_BYTE) {
+        uint32_t at = mem_find(cpu.memory, op->b, op->c, op->a >> 8);
+        r[op->a & 0xFF] = (uint16_t)at;
+        cpu.flags = at < op->c ? 0x01 : 0;
+        op += OPLEN_FIND_BYTE;
+        DK_NEXT(OPCYC_FIND_BYTE);
+    }
+    DK_CASE(DK_ADD_MEM) {
+        uint16_t dst = op->a, len = op->b;
+        uint8_t value = (uint8_t)op->c;
+        op += OPLEN_ADD_MEM;
+        mem_add(&cpu.memory[dst], len, value);
+        invalidate_decoded(dst, len);
+        DK_NEXT(OPCYC_ADD_MEM);
+    }
+    DK_CASE(DK_XOR_MEM) {
+        uint16_t dst = op->a, len = op->b;
+        uint8_t value = (uint8_t)op->c;
+        op += OPLEN_XOR_MEM;
+        mem_xor(&cpu.memory[dst], len, value);
+        invalidate_decoded(dst, len);
+        DK_NEXT(OPCYC_XOR_MEM);
+    }
+
+#ifndef DK_THREADED
+    }
+#endif
+out:
+    cpu.pc = (uint16_t)(op - decode_cache);
+done:
+    cpu.cycles = cpu.cycle_limit - left;
+    #undef DK_CASE
+    #undef DK_DISPATCH
+    #undef DK_NEXT
+}
+
+// Basic-block JIT (x86-64)
+// Hot block heads are translated to native code that works directly on
+// the CPU struct, whose address is kept in rbx. The decoder is
+// predecode_at(), so the JIT accepts exactly the instructions the fast
+// engine does. A block ends at a branch, call or return, or just before
+// any instruction it cannot translate (I/O, HALT, COPY_MEM, fallbacks);
+// it returns the next pc, with JIT_EXIT_INTERP set when the instruction
+// at that pc must go through execute_instruction() first. Each exit adds
+// the cycles of the instructions it retired, summed from opcode_info[] at
+// translation time, to cpu.cycles. A block, and each time round a block
+// that loops on itself, starts only while the slice has budget for all of
+// its instructions; otherwise it leaves to have the
+// interpreter step, so the JIT stops at cycle_limit like the other engines.
+#if defined(__x86_64__) || defined(_M_X64)
+    #define JIT_X86_64 1
+#endif
+
+#define JIT_CODE_SIZE      (4 * 1024 * 1024)
+#define JIT_MAX_BLOCKS     4096
+#define JIT_MAX_BLOCK_OPS  64
+// Room one translated instruction may need, with an exit after it. The
+// largest is a store whose target straddles two lines: two store checks,
+// each with a helper call and an exit, come to about 150 bytes.
+#define JIT_MAX_OP_BYTES   256
+#define JIT_HOT_THRESHOLD  8
+#define JIT_LINE_SHIFT     6
+#define JIT_EXIT_INTERP    0x10000u
+
+typedef uint32_t (*JitFn)(CPU *c);
+
+typedef struct {
+    uint16_t start;
+    uint16_t end;       // one past the last byte translated
+} JitBlock;
+
+#define JIT_NOCOMPILE ((JitFn)(uintptr_t)1)
+
+// Per machine: translated code embeds addresses from its own tables
+typedef struct JitState {
+    JitFn entry[MEM_SIZE];
+    uint8_t heat[MEM_SIZE];
+    uint8_t code_lines[MEM_SIZE >> JIT_LINE_SHIFT];
+    JitBlock blocks[JIT_MAX_BLOCKS];
+    int block_count;
+    uint8_t *code;
+    size_t code_used;
+} JitState;
+
+#define jit_entry       (machine->jit->entry)
+#define jit_heat        (machine->jit->heat)
+#define jit_code_lines  (machine->jit->code_lines)
+#define jit_blocks      (machine->jit->blocks)
+#define jit_block_count (machine->jit->block_count)
+#define jit_code        (machine->jit->code)
+#define jit_code_used   (machine->jit->code_used)
+
+void jit_flush(void) {
+    memset(jit_entry, 0, sizeof(jit_entry));
+    memset(jit_heat, 0, sizeof(jit_heat));
+    memset(jit_code_lines, 0, sizeof(jit_code_lines));
+    jit_block_count = 0;
+    jit_code_used = 0;
+}
+
+// Drop every block that translated any byte of [addr, addr + len)
+void jit_invalidate(uint32_t addr, uint32_t len) {
+    uint32_t end = addr + len > MEM_SIZE ? MEM_SIZE : addr + len;
+    int hit = 0;
+
+    for (uint32_t line = addr >> JIT_LINE_SHIFT; addr < end && line <= (end - 1) >> JIT_LINE_SHIFT; line++) {
+        if (jit_code_lines[line]) hit = 1;
+    }
+    if (!hit) return;
+
+    for (int i = 0; i < jit_block_count; i++) {
+        JitBlock *b = &jit_blocks[i];
+        if (b->start < end && addr < b->end) {
+            jit_entry[b->start] = NULL;
+            jit_heat[b->start] = 0;
+            jit_blocks[i--] = jit_blocks[--jit_block_count];
+        }
+    }
+}
+
+// Set up the JIT for the current machine
+int jit_init(void) {
+#ifndef JIT_X86_64
+    return -1;
+#else
+    JitState *j = calloc(1, sizeof(JitState));
+    if (!j) return -1;
+#ifdef _WIN32
+    j->code = VirtualAlloc(NULL, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE,
+                           PAGE_EXECUTE_READWRITE);
+    if (!j->code) {
+        free(j);
+        return -1;
+    }
+#else
+    void *mem = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(j);
+        return -1;
+    }
+    j->code = mem;
+#endif
+    machine->jit = j;
+    jit_flush();
+    return 0;
+#endif
+}
+
+void jit_release(void) {
+    JitState *j = machine->jit;
+    if (!j) return;
+#ifdef _WIN32
+    VirtualFree(j->code, 0, MEM_RELEASE);
+#else
+    munmap(j->code, JIT_CODE_SIZE);
+#endif
+    free(j);
+    machine->jit = NULL;
+}
+
+#ifdef JIT_X86_64
+static _Thread_local uint8_t *jit_out;
+
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+#define JIT_REG(n)   ((uint32_t)(offsetof(CPU, regs) + 2 * (n)))
+#define JIT_FLAGS    ((uint32_t)offsetof(CPU, flags))
+#define JIT_SP       ((uint32_t)offsetof(CPU, sp))
+#define JIT_CYCLES   ((uint32_t)offsetof(CPU, cycles))
+#define JIT_LIMIT    ((uint32_t)offsetof(CPU, cycle_limit))
+#define JIT_MEM(a)   ((uint32_t)(offsetof(CPU, memory) + (a)))
+#define JIT_STACK    JIT_MEM(MEM_SIZE - STACK_SIZE)
+
+static void emit8(uint8_t b) { *jit_out++ = b; }
+static void emit32(uint32_t v) { memcpy(jit_out, &v, 4); jit_out += 4; }
+static void emit64(uint64_t v) { memcpy(jit_out, &v, 8); jit_out += 8; }
+
+// Short forward jumps: emit the opcode now, fill in the offset later
+static uint8_t *emit_jump8(uint8_t opcode) {
+    emit8(opcode);
+    emit8(0);
+    return jit_out - 1;
+}
+
+static void patch_jump8(uint8_t *at) {
+    *at = (uint8_t)(jit_out - (at + 1));
+}
+
+// movzx r32, word [rbx + disp]
+static void emit_load16(int r, uint32_t disp) {
+    emit8(0x0F); emit8(0xB7); emit8(0x80 | r << 3 | 3); emit32(disp);
+}
+
+// mov word [rbx + disp], r16
+static void emit_store16(int r, uint32_t disp) {
+    emit8(0x66); emit8(0x89); emit8(0x80 | r << 3 | 3); emit32(disp);
+}
+
+// movzx r32, byte [rbx + rax + disp]
+static void emit_load8_rax(int r, uint32_t disp) {
+    emit8(0x0F); emit8(0xB6); emit8(0x84 | r << 3); emit8(0x03); emit32(disp);
+}
+
+// mov byte [rbx + rax + disp], r8
+static void emit_store8_rax(int r, uint32_t disp) {
+    emit8(0x88); emit8(0x84 | r << 3); emit8(0x03); emit32(disp);
+}
+
+static void emit_epilogue(void) {
+    emit8(0x48); emit8(0x83); emit8(0xC4); emit8(0x20);    // add rsp, 32
+    emit8(0x5B);                                            // pop rbx
+    emit8(0xC3);                                            // ret
+}
+
+static void emit_add_cycles(uint32_t n) {
+    if (n == 0) return;
+    emit8(0x48); emit8(0x81); emit8(0x83); emit32(JIT_CYCLES); emit32(n);  // add qword [cycles], n
+}
+
+// Leave the block with result in eax, charging count cycles for the
+// instructions it retired
+static void emit_exit(uint32_t result, uint32_t count) {
+    emit_add_cycles(count);
+    emit8(0xB8); emit32(result);                            // mov eax, result
+    emit_epilogue();
+}
+
+// Jump back to the top of the block, where the budget is checked again
+static void emit_loop_back(uint8_t *body, uint32_t count) {
+    emit_add_cycles(count);
+    emit8(0xE9); emit32((uint32_t)(body - (jit_out + 4)));  // jmp body
+}
+
+// Leave for the interpreter unless the slice has budget for the whole
+// block; returns where to patch in the block's cycles once they are known
+static uint8_t *emit_budget_check(uint16_t pc) {
+    emit8(0x48); emit8(0x8B); emit8(0x83); emit32(JIT_LIMIT);   // mov rax, [cycle_limit]
+    emit8(0x48); emit8(0x2B); emit8(0x83); emit32(JIT_CYCLES);  // sub rax, [cycles]
+    emit8(0x48); emit8(0x3D);                               // cmp rax, cycles
+    uint8_t *cycles = jit_out;
+    emit32(0);
+    uint8_t *skip = emit_jump8(0x73);                       // jae
+    emit_exit(pc | JIT_EXIT_INTERP, 0);
+    patch_jump8(skip);
+    return cycles;
+}
+
+// Call a C helper with up to three immediate integer arguments
+static void emit_call(const void *fn, uint32_t a0, uint32_t a1, uint32_t a2) {
+#ifdef _WIN32
+    emit8(0xB9); emit32(a0);                                // mov ecx, a0
+    emit8(0xBA); emit32(a1);                                // mov edx, a1
+    emit8(0x41); emit8(0xB8); emit32(a2);                   // mov r8d, a2
+#else
+    emit8(0xBF); emit32(a0);                                // mov edi, a0
+    emit8(0xBE); emit32(a1);                                // mov esi, a1
+    emit8(0xBA); emit32(a2);                                // mov edx, a2
+#endif
+    emit8(0x48); emit8(0xB8); emit64((uint64_t)(uintptr_t)fn);  // mov rax, fn
+    emit8(0xFF); emit8(0xD0);                               // call rax
+}
+
+// Exit through execute_instruction() unless sp is in the fast-path range:
+// 2 <= sp < STACK_SIZE for a push, sp < STACK_SIZE - 2 for a pop.
+// Leaves sp in eax.
+static void emit_sp_guard(int is_push, uint16_t pc, uint32_t count) {
+    emit_load16(JIT_EAX, JIT_SP);
+    if (is_push) {
+        emit8(0x8D); emit8(0x48); emit8(0xFE);              // lea ecx, [rax - 2]
+        emit8(0x81); emit8(0xF9); emit32(STACK_SIZE - 2);   // cmp ecx, imm32
+    } else {
+        emit8(0x3D); emit32(STACK_SIZE - 2);                // cmp eax, imm32
+    }
+    uint8_t *skip = emit_jump8(0x72);                       // jb
+    emit_exit(pc | JIT_EXIT_INTERP, count);
+    patch_jump8(skip);
+}
+
+static void jit_invalidate_decoded(uint32_t addr, uint32_t len) {
+    invalidate_decoded(addr, len);
+}
+
+// After a guest store: if a translated block covers the written bytes,
+// invalidate and leave the block, since it may have just rewritten itself
+static void emit_store_check(uint16_t addr, uint16_t next_pc, uint32_t count) {
+    uint32_t first = addr >> JIT_LINE_SHIFT;
+    uint32_t last = (uint32_t)(addr + 1) >> JIT_LINE_SHIFT;
+    for (uint32_t line = first; line <= last; line++) {
+        emit8(0x48); emit8(0xB8); emit64((uint64_t)(uintptr_t)&jit_code_lines[line]);
+        emit8(0x80); emit8(0x38); emit8(0x00);              // cmp byte [rax], 0
+        uint8_t *skip = emit_jump8(0x74);                   // je
+        emit_call((const void *)jit_invalidate_decoded, addr, 2, 0);
+        emit_exit(next_pc, count);
+        patch_jump8(skip);
+    }
+}
+
+// Set flags from comparing eax with ecx, as compare_flags() does
+static void emit_compare(void) {
+    emit8(0x39); emit8(0xC8);                               // cmp eax, ecx
+    emit8(0x0F); emit8(0x94); emit8(0xC2);                  // sete dl
+    emit8(0x0F); emit8(0x97); emit8(0xC0);                  // seta al
+    emit8(0x0F); emit8(0x92); emit8(0xC1);                  // setb cl
+    emit8(0x00); emit8(0xC0);                               // add al, al
+    emit8(0xC0); emit8(0xE1); emit8(0x02);                  // shl cl, 2
+    emit8(0x08); emit8(0xC2);                               // or dl, al
+    emit8(0x08); emit8(0xCA);                               // or dl, cl
+    emit8(0x88); emit8(0x93); emit32(JIT_FLAGS);            // mov [flags], dl
+}
+
+// End the block on a conditional branch to target, taken when the flag
+// bits in mask are set (or clear, with on_clear). Not taken exits at next.
+static void emit_branch(uint8_t mask, int on_clear, uint16_t target, uint16_t next,
+                        uint16_t pc, uint8_t *body, uint32_t count) {
+    emit8(0xF6); emit8(0x83); emit32(JIT_FLAGS); emit8(mask);  // test byte [flags], m
+    // Branch to the taken path; fall through exits at next
+    emit8(0x0F); emit8(on_clear ? 0x84 : 0x85);             // jz/jnz rel32
+    uint8_t *patch = jit_out;
+    emit32(0);
+    emit_exit(next, count);
+    uint32_t rel = (uint32_t)(jit_out - (patch + 4));
+    memcpy(patch, &rel, 4);
+    if (target == pc) {
+        emit_loop_back(body, count);
+    } else {
+        emit_exit(target, count);
+    }
+}
+
+static void jit_set_pixel(int x, int y, int value) {
+    set_pixel(x, y, value);
+    screen.pixel_mode = 1;
+}
+
+static void jit_putchar(int c) {
+    putchar_screen((char)c);
+}
+
+static void emit_alu(int kind, const DecodedOp *op) {
+    emit_load16(JIT_EAX, JIT_REG(op->b));
+    emit_load16(JIT_ECX, JIT_REG(op->c));
+    switch (kind) {
+        case DK_ADD: emit8(0x01); emit8(0xC8); break;      // add eax, ecx
+        case DK_SUB: emit8(0x29); emit8(0xC8); break;      // sub eax, ecx
+        case DK_MUL: emit8(0x0F); emit8(0xAF); emit8(0xC1); break;  // imul eax, ecx
+        case DK_AND: emit8(0x21); emit8(0xC8); break;
+        case DK_OR:  emit8(0x09); emit8(0xC8); break;
+        case DK_XOR: emit8(0x31); emit8(0xC8); break;
+        case DK_DIV:
+        case DK_MOD: {
+            emit8(0x85); emit8(0xC9);                       // test ecx, ecx
+            uint8_t *skip = emit_jump8(0x74);               // jz
+            emit8(0x31); emit8(0xD2);                       // xor edx, edx
+            emit8(0xF7); emit8(0xF1);                       // div ecx
+            emit_store16(kind == DK_DIV ? JIT_EAX : JIT_EDX, JIT_REG(op->a));
+            patch_jump8(skip);
+            return;
+        }
+    }
+    emit_store16(JIT_EAX, JIT_REG(op->a));
+}
+
+// Translate the block starting at pc. Returns the native entry point, or
+// JIT_NOCOMPILE when not even the first instruction can be translated.
+static JitFn jit_compile(uint16_t pc) {
+    if (jit_block_count >= JIT_MAX_BLOCKS ||
+        jit_code_used + 2 * JIT_MAX_OP_BYTES > JIT_CODE_SIZE) {
+        jit_flush();
+    }
+
+    uint8_t *entry = jit_code + jit_code_used;
+    uint8_t *body, *budget;
+    uint32_t addr = pc;
+    uint32_t cost = 0;      // cycles of the instructions translated so far
+    int ops = 0, done = 0;
+
+    jit_out = entry;
+    emit8(0x53);                                            // push rbx
+    emit8(0x48); emit8(0x83); emit8(0xEC); emit8(0x20);    // sub rsp, 32
+#ifdef _WIN32
+    emit8(0x48); emit8(0x89); emit8(0xCB);                  // mov rbx, rcx
+#else
+    emit8(0x48); emit8(0x89); emit8(0xFB);                  // mov rbx, rdi
+#endif
+    body = jit_out;
+    budget = emit_budget_check(pc);
+
+    while (!done) {
+        // Keep clear of the stack page so pushes never hit translated code,
+        // and end the block early rather than run out of code buffer
+        if (ops == JIT_MAX_BLOCK_OPS ||
+            addr + DECODE_MAX_LEN > MEM_SIZE - STACK_SIZE ||
+            jit_out + JIT_MAX_OP_BYTES > jit_code + JIT_CODE_SIZE) {
+            if (ops == 0) return JIT_NOCOMPILE;
+            emit_exit(addr | JIT_EXIT_INTERP, cost);
+            break;
+        }
+
+        predecode_at((uint16_t)addr);
+        DecodedOp *op = &decode_cache[addr];
+        uint16_t next = (uint16_t)(addr + op->len);
+        int kind = op->kind;
+        uint32_t cycles = cost + opcode_cycles(cpu.memory[addr]);  // with this one
+
+        switch (kind) {
+            case DK_LOAD_REG:
+                emit8(0x66); emit8(0xC7); emit8(0x83);      // mov word [rbx+d], imm16
+                emit32(JIT_REG(op->a)); emit8(op->b & 0xFF); emit8(op->b >> 8);
+                break;
+            case DK_STORE_REG:
+            case DK_STORE_MEM:
+                emit_load16(JIT_EAX, JIT_REG(op->a));
+                emit_store16(JIT_EAX, JIT_MEM(op->b));
+                emit_store_check(op->b, next, cycles);
+                break;
+            case DK_LOAD_MEM:
+                emit_load16(JIT_EAX, JIT_MEM(op->b));
+                emit_store16(JIT_EAX, JIT_REG(op->a));
+                break;
+            case DK_ADD: case DK_SUB: case DK_MUL: case DK_DIV: case DK_MOD:
+            case DK_AND: case DK_OR: case DK_XOR:
+                emit_alu(kind, op);
+                break;
+            case DK_NOT:
+                emit_load16(JIT_EAX, JIT_REG(op->b));
+                emit8(0xF7); emit8(0xD0);                   // not eax
+                emit_store16(JIT_EAX, JIT_REG(op->a));
+                break;
+            case DK_SHL:
+            case DK_SHR:
+                emit_load16(JIT_EAX, JIT_REG(op->a));
+                emit_load16(JIT_ECX, JIT_REG(op->b));
+                emit8(0xD3); emit8(kind == DK_SHL ? 0xE0 : 0xE8);  // shl/shr eax, cl
+                emit_store16(JIT_EAX, JIT_REG(op->a));
+                break;
+            case DK_CMP:
+                emit_load16(JIT_EAX, JIT_REG(op->a));
+                emit_load16(JIT_ECX, JIT_REG(op->b));
+                emit_compare();
+                break;
+            case DK_ADDI:
+                emit8(0x66); emit8(0x81); emit8(0x83);      // add word [rbx+d], imm16
+                emit32(JIT_REG(op->a)); emit8(op->b & 0xFF); emit8(op->b >> 8);
+                break;
+            case DK_CMPI:
+                emit_load16(JIT_EAX, JIT_REG(op->a));
+                emit8(0xB9); emit32(op->b);                 // mov ecx, imm
+                emit_compare();
+                break;
+            case DK_LOAD_IDX: {
+                emit_load16(JIT_EAX, JIT_REG(op->c));
+                emit8(0x05); emit32(op->b);                 // add eax, base
+                emit8(0x3D); emit32(MEM_SIZE - 1);          // cmp eax, MEM_SIZE - 1
+                uint8_t *skip = emit_jump8(0x73);           // jae: out of range, no-op
+                emit8(0x0F); emit8(0xB7); emit8(0x8C); emit8(0x03);  // movzx ecx, word [rbx+rax+d]
+                emit32(JIT_MEM(0));
+                emit_store16(JIT_ECX, JIT_REG(op->a));
+                patch_jump8(skip);
+                break;
+            }
+            case DK_SET_PIXEL:
+                emit_call((const void *)jit_set_pixel, op->a, op->b, op->c);
+                break;
+            case DK_PRINT_CHAR:
+                emit_call((const void *)jit_putchar, op->a, 0, 0);
+                break;
+            case DK_PUSH:
+                emit_sp_guard(1, (uint16_t)addr, cost);
+                emit_load16(JIT_ECX, JIT_REG(op->a));
+                emit_store8_rax(JIT_ECX, JIT_STACK);        // stack[sp] = lo
+                emit_store8_rax(5, JIT_STACK - 1);          // stack[sp-1] = ch
+                emit8(0x66); emit8(0x83); emit8(0xAB); emit32(JIT_SP); emit8(2);  // sub word [sp], 2
+                break;
+            case DK_POP:
+                emit_sp_guard(0, (uint16_t)addr, cost);
+                emit_load8_rax(JIT_ECX, JIT_STACK + 1);
+                emit_load8_rax(JIT_EDX, JIT_STACK + 2);
+                emit8(0xC1); emit8(0xE2); emit8(0x08);      // shl edx, 8
+                emit8(0x09); emit8(0xD1);                   // or ecx, edx
+                emit_store16(JIT_ECX, JIT_REG(op->a));
+                emit8(0x66); emit8(0x83); emit8(0x83); emit32(JIT_SP); emit8(2);  // add word [sp], 2
+                break;
+            case DK_JMP:
+                if (op->a == pc) {
+                    emit_loop_back(body, cycles);
+                } else {
+                    emit_exit(op->a, cycles);
+                }
+                done = 1;
+                break;
+            case DK_JZ: case DK_JNZ: case DK_JG: case DK_JL: {
+                static const uint8_t masks[] = { 0x01, 0x01, 0x02, 0x04 };
+                emit_branch(masks[kind - DK_JZ], kind == DK_JNZ, op->a, next, pc, body, cycles);
+                done = 1;
+                break;
+            }
+            case DK_DJNZ:
+                emit_load16(JIT_EAX, JIT_REG(op->a));
+                emit8(0xFF); emit8(0xC8);                   // dec eax
+                emit_store16(JIT_EAX, JIT_REG(op->a));
+                emit8(0x31); emit8(0xC9);                   // xor ecx, ecx
+                emit_compare();
+                emit_branch(0x01, 1, op->b, next, pc, body, cycles);
+                done = 1;
+                break;
+            case DK_CJNE:
+                emit_load16(JIT_EAX, JIT_REG(op->a));
+                emit8(0xB9); emit32(op->b);                 // mov ecx, imm
+                emit_compare();
+                emit_branch(0x01, 1, op->c, next, pc, body, cycles);
+                done = 1;
+                break;
+            case DK_CALL:
+                emit_sp_guard(1, (uint16_t)addr, cost);
+                emit8(0xB9); emit32(next);                  // mov ecx, return address
+                emit_store8_rax(JIT_ECX, JIT_STACK);
+                emit_store8_rax(5, JIT_STACK - 1);
+                emit8(0x66); emit8(0x83); emit8(0xAB); emit32(JIT_SP); emit8(2);
+                emit_exit(op->a, cycles);
+                done = 1;
+                break;
+            case DK_RET:
+                emit_sp_guard(0, (uint16_t)addr, cost);
+                emit_load8_rax(JIT_ECX, JIT_STACK + 1);
+                emit_load8_rax(JIT_EDX, JIT_STACK + 2);
+                emit8(0xC1); emit8(0xE2); emit8(0x08);      // shl edx, 8
+                emit8(0x09); emit8(0xD1);                   // or ecx, edx
+                emit8(0x66); emit8(0x83); emit8(0x83); emit32(JIT_SP); emit8(2);
+                emit_add_cycles(cycles);
+                emit8(0x89); emit8(0xC8);                   // mov eax, ecx
+                emit_epilogue();
+                done = 1;
+                break;
+            default:
+                // I/O and anything else goes back through the interpreter
+                if (ops == 0) return JIT_NOCOMPILE;
+                emit_exit(addr | JIT_EXIT_INTERP, cost);
+                next = (uint16_t)addr;
+                done = 1;
+                break;
+        }
+        ops++;
+        cost = cycles;
+        addr = next;
+    }
+
+    memcpy(budget, &cost, 4);
+
+    JitBlock *b = &jit_blocks[jit_block_count++];
+    b->start = pc;
+    b->end = (uint16_t)addr;
+    for (uint32_t line = pc >> JIT_LINE_SHIFT; line <= (addr - 1) >> JIT_LINE_SHIFT; line++) {
+        jit_code_lines[line] = 1;
+    }
+    jit_code_used += (size_t)(jit_out - entry);
+    return (JitFn)(void *)entry;
+}
+#endif
+
+// Is this opcode the last instruction of a basic block?
+static int ends_block(uint8_t opcode) {
+    return (opcode >= OP_JMP && opcode <= OP_CJNE) || opcode == OP_HALT;
+}
+
+void run_jit(void) {
+#ifdef JIT_X86_64
+    while (cpu.running && cpu.cycles < cpu.cycle_limit) {
+        uint16_t pc = cpu.pc;
+        JitFn fn = jit_entry[pc];
+
+        if (!fn && ++jit_heat[pc] >= JIT_HOT_THRESHOLD) {
+            fn = jit_entry[pc] = jit_compile(pc);
+        }
+
+        if (fn && fn != JIT_NOCOMPILE) {
+            uint32_t next = fn(&cpu);
+            cpu.pc = (uint16_t)next;
+            if ((next & JIT_EXIT_INTERP) && cpu.cycles < cpu.cycle_limit) {
+                step_instruction();
+            }
+            continue;
+        }
+
+        // Cold code: interpret up to the end of the basic block
+        uint8_t opcode;
+        do {
+            opcode = step_instruction();
+        } while (cpu.running && !ends_block(opcode) && cpu.cycles < cpu.cycle_limit);
+    }
+#endif
+}
+
+// Monotonic host time in microseconds
+uint64_t host_time_us(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// Profiler. While machine->profile is set, run_slice() runs the machine
+// on the loop below instead of an engine: the interpreter plus counts of
+// cycles per opcode, per address and per calling context. Calling
+// contexts form a tree of nodes, one per distinct chain of CALL targets,
+// with the program's entry point at the root; each cycle is charged to
+// the node on top of a shadow call stack that CALL pushes and RET pops.
+// Switched off, profiling costs one test per slice.
+#define PROFILE_MAX_NODES  65536
+#define PROFILE_MAX_DEPTH  1024
+#define PROFILE_TOP_PCS    32
+
+typedef struct {
+    uint16_t fn;            // CALL target, or the entry point at the root
+    int parent;             // -1 at the root
+    int child, sibling;     // first child, next sibling; -1 for none
+    uint64_t calls;
+    uint64_t self;          // cycles spent in this context itself
+} ProfileNode;
+
+typedef struct Profile {
+    uint64_t cycles;
+    uint64_t op_cycles[256];
+    uint64_t pc_cycles[MEM_SIZE];
+    ProfileNode *nodes;
+    int node_count;
+    int stack[PROFILE_MAX_DEPTH];
+    int depth;
+    int overflow;           // calls past PROFILE_MAX_DEPTH, charged to the caller
+} Profile;
+
+int profile_start(void) {
+    Profile *p = calloc(1, sizeof(Profile));
+    if (p) p->nodes = malloc(PROFILE_MAX_NODES * sizeof(ProfileNode));
+    if (!p || !p->nodes) {
+        free(p);
+        return -1;
+    }
+    p->nodes[0] = (ProfileNode){cpu.pc, -1, -1, -1, 1, 0};
+    p->node_count = 1;
+    machine->profile = p;
+    return 0;
+}
+
+static void profile_call(Profile *p, uint16_t target) {
+    int node = p->stack[p->depth];
+    if (p->depth + 1 >= PROFILE_MAX_DEPTH) {
+        p->overflow++;
+        return;
+    }
+
+    int c = p->nodes[node].child;
+    while (c >= 0 && p->nodes[c].fn != target) c = p->nodes[c].sibling;
+    if (c < 0) {
+        if (p->node_count == PROFILE_MAX_NODES) {
+            c = node;
+        } else {
+            c = p->node_count++;
+            p->nodes[c] = (ProfileNode){target, node, -1, p->nodes[node].child, 0, 0};
+            p->nodes[node].child = c;
+        }
+    }
+    p->nodes[c].calls++;
+    p->stack[++p->depth] = c;
+}
+
+static void run_profiled(void) {
+    Profile *p = machine->profile;
+    while (cpu.running && cpu.cycles < cpu.cycle_limit) {
+        uint16_t pc = cpu.pc, sp = cpu.sp;
+        uint8_t op = cpu.memory[pc];
+        uint32_t cycles = opcode_cycles(op);
+        p->op_cycles[op] += cycles;
+        p->pc_cycles[pc] += cycles;
+        p->nodes[p->stack[p->depth]].self += cycles;
+        p->cycles += cycles;
+        step_instruction();
+        if (cpu.sp != sp) {     // the CALL or RET went through
+            if (op == OP_CALL) profile_call(p, cpu.pc);
+            else if (op == OP_RET && p->overflow > 0) p->overflow--;
+            else if (op == OP_RET && p->depth > 0) p->depth--;
+        }
+    }
+}
+
+typedef struct {
+    uint16_t fn;
+    uint64_t calls, self, total;
+} ProfileFn;
+
+typedef struct {
+    uint16_t caller, callee;
+    uint64_t calls, total;
+} ProfileEdge;
+
+static int cmp_fn_total(const void *a, const void *b) {
+    const ProfileFn *x = a, *y = b;
+    return x->total < y->total ? 1 : x->total > y->total ? -1 : x->fn - y->fn;
+}
+
+static int cmp_edge(const void *a, const void *b) {
+    const ProfileEdge *x = a, *y = b;
+    if (x->caller != y->caller) return x->caller - y->caller;
+    return x->callee - y->callee;
+}
+
+static void profile_name(char *buf, size_t size, const Profile *p, uint16_t fn) {
+    if (fn == p->nodes[0].fn) snprintf(buf, size, "start_%04X", fn);
+    else snprintf(buf, size, "sub_%04X", fn);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+// Write the flat profile and call graph to path and folded stacks (one
+// "start;sub_XXXX;... cycles" line per context, for flamegraph.pl and
+// similar tools) to path.folded, then stop profiling.
+int profile_finish(const char *path) {
+    Profile *p = machine->profile;
+    if (!p) return -1;
+    machine->profile = NULL;
+
+    int n = p->node_count;
+    uint64_t *total = malloc(n * sizeof(uint64_t));
+    ProfileFn *fns = calloc(n, sizeof(ProfileFn));
+    ProfileEdge *edges = calloc(n, sizeof(ProfileEdge));
+    int *fn_of = malloc(MEM_SIZE * sizeof(int));
+    char folded_path[MAX_PATH_LEN + 8];
+    snprintf(folded_path, sizeof(folded_path), "%s.folded", path);
+    FILE *out = fopen(path, "w");
+    FILE *folded = out ? fopen(folded_path, "w") : NULL;
+    int status = total && fns && edges && fn_of && folded ? 0 : -1;
+
+    if (status == 0) {
+        // Children always come after their parents
+        for (int i = 0; i < n; i++) total[i] = p->nodes[i].self;
+        for (int i = n - 1; i > 0; i--) total[p->nodes[i].parent] += total[i];
+
+        // Per function: a context's total counts unless an ancestor is the
+        // same function, so recursion is not counted twice
+        int fn_count = 0, edge_count = 0;
+        for (int i = 0; i < MEM_SIZE; i++) fn_of[i] = -1;
+        for (int i = 0; i < n; i++) {
+            ProfileNode *node = &p->nodes[i];
+            if (fn_of[node->fn] < 0) {
+                fn_of[node->fn] = fn_count;
+                fns[fn_count++].fn = node->fn;
+            }
+            ProfileFn *f = &fns[fn_of[node->fn]];
+            int outer = 1;
+            for (int a = node->parent; a >= 0; a = p->nodes[a].parent) {
+                if (p->nodes[a].fn == node->fn) outer = 0;
+            }
+            f->calls += node->calls;
+            f->self += node->self;
+            if (outer) f->total += total[i];
+            if (node->parent >= 0) {
+                edges[edge_count++] = (ProfileEdge){p->nodes[node->parent].fn, node->fn,
+                                                    node->calls, total[i]};
+            }
+        }
+        qsort(edges, edge_count, sizeof(ProfileEdge), cmp_edge);
+        int merged = 0;
+        for (int i = 0; i < edge_count; i++) {
+            if (merged && edges[merged - 1].caller == edges[i].caller &&
+                edges[merged - 1].callee == edges[i].callee) {
+                edges[merged - 1].calls += edges[i].calls;
+                edges[merged - 1].total += edges[i].total;
+            } else {
+                edges[merged++] = edges[i];
+            }
+        }
+        edge_count = merged;
+
+        fprintf(out, "Flat profile: %llu cycles\n\n", (unsigned long long)p->cycles);
+        fprintf(out, "  opcode                    cycles      %%\n");
+        for (;;) {
+            int top = -1;
+            for (int op = 0; op < 256; op++) {
+                if (p->op_cycles[op] && (top < 0 || p->op_cycles[op] > p->op_cycles[top])) top = op;
+            }
+            if (top < 0) break;
+            fprintf(out, "  %02X %-16s %12llu  %5.1f\n", top, opcode_info[top].name ? opcode_info[top].name : "?",
+                    (unsigned long long)p->op_cycles[top], percent(p->op_cycles[top], p->cycles));
+            p->op_cycles[top] = 0;
+        }
+
+        fprintf(out, "\n  address  opcode                 cycles      %%\n");
+        for (int k = 0; k < PROFILE_TOP_PCS; k++) {
+            int top = -1;
+            for (int pc = 0; pc < MEM_SIZE; pc++) {
+                if (p->pc_cycles[pc] && (top < 0 || p->pc_cycles[pc] > p->pc_cycles[top])) top = pc;
+            }
+            if (top < 0) break;
+            const char *name = opcode_info[cpu.memory[top]].name;
+            fprintf(out, "  %04X     %-16s %12llu  %5.1f\n", top, name ? name : "?",
+                    (unsigned long long)p->pc_cycles[top], percent(p->pc_cycles[top], p->cycles));
+            p->pc_cycles[top] = 0;
+        }
+
+        qsort(fns, fn_count, sizeof(ProfileFn), cmp_fn_total);
+        fprintf(out, "\nCall graph: functions by total cycles, callers (<) and callees (>) below each\n\n");
+        fprintf(out, "  function          calls         self        total  total%%\n");
+        for (int i = 0; i < fn_count; i++) {
+            ProfileFn *f = &fns[i];
+            char name[16], other[16];
+            profile_name(name, sizeof(name), p, f->fn);
+            fprintf(out, "  %-12s %10llu %12llu %12llu  %5.1f\n", name, (unsigned long long)f->calls,
+                    (unsigned long long)f->self, (unsigned long long)f->total, percent(f->total, p->cycles));
+            for (int e = 0; e < edge_count; e++) {
+                if (edges[e].callee == f->fn) {
+                    profile_name(other, sizeof(other), p, edges[e].caller);
+                    fprintf(out, "    < %-10s %8llu %25llu\n", other, (unsigned long long)edges[e].calls,
+                            (unsigned long long)edges[e].total);
+                }
+            }
+            for (int e = 0; e < edge_count; e++) {
+                if (edges[e].caller == f->fn) {
+                    profile_name(other, sizeof(other), p, edges[e].callee);
+                    fprintf(out, "    > %-10s %8llu %25llu\n", other, (unsigned long long)edges[e].calls,
+                            (unsigned long long)edges[e].total);
+                }
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!p->nodes[i].self) continue;
+            int chain[PROFILE_MAX_DEPTH], len = 0;
+            for (int a = i; a >= 0 && len < PROFILE_MAX_DEPTH; a = p->nodes[a].parent) chain[len++] = a;
+            while (len--) {
+                char name[16];
+                profile_name(name, sizeof(name), p, p->nodes[chain[len]].fn);
+                fprintf(folded, "%s%c", name, len ? ';' : ' ');
+            }
+            fprintf(folded, "%llu\n", (unsigned long long)p->nodes[i].self);
+        }
+    }
+
+    if (out) fclose(out);
+    if (folded) fclose(folded);
+    free(total);
+    free(fns);
+    free(edges);
+    free(fn_of);
+    free(p->nodes);
+    free(p);
+    return status;
+}
+
+// Run the selected engine until cpu.cycle_limit is reached or the CPU halts
+void run_slice(void) {
+    if (machine->profile) {
+        run_profiled();
+    } else if (cpu_engine == ENGINE_JIT) {
+        run_jit();
+    } else if (cpu_engine == ENGINE_PREDECODE) {
+        run_predecoded();
+    } else {
+        while (cpu.running && cpu.cycles < cpu.cycle_limit) {
+            step_instruction();
+        }
+    }
+}
+
+// Screen export. --export-shm NAME and --export-port [ADDR:]PORT let
+// viewers outside the emulator watch its machines, in the formats
+// described in export.h. An exported machine publishes its live screen
+// into a triple buffer of its own, the same handoff present_screen()
+// makes to the renderer: wherever the window is refreshed, or once per
+// frame between slices of a headless run. The exporter thread takes the
+// newest frame of every machine, writes it into that machine's segment
+// and sends viewers only the damaged spans. The CPU threads never wait
+// on it, nor on a viewer; one that stops reading for a second is dropped.
+#define EXPORT_MAX_MACHINES 64
+#define EXPORT_MAX_VIEWERS  16
+#define EXPORT_MAX_SPANS    (2 * SCREEN_HEIGHT + PIXEL_HEIGHT)
+#define EXPORT_RLE_MAX(n)   ((n) + ((n) + 127) / 128)
+#define EXPORT_MSG_MAX      (6 + sizeof(ExportState) + \
+                             2 * SCREEN_HEIGHT * (6 + EXPORT_RLE_MAX(SCREEN_WIDTH)) + \
+                             PIXEL_HEIGHT * (6 + EXPORT_RLE_MAX(PIXEL_WIDTH / 2)))
+
+_Static_assert(EXPORT_TEXT_WIDTH == SCREEN_WIDTH && EXPORT_TEXT_HEIGHT == SCREEN_HEIGHT &&
+               EXPORT_PIXEL_HEIGHT == PIXEL_HEIGHT && EXPORT_PIXEL_BYTES == PIXEL_BYTES,
+               "export.h describes a different screen");
+
+#ifdef _WIN32
+typedef SOCKET ExportSocket;
+#define EXPORT_NO_SOCKET INVALID_SOCKET
+#define close_socket(s) closesocket(s)
+#else
+typedef int ExportSocket;
+#define EXPORT_NO_SOCKET (-1)
+#define close_socket(s) close(s)
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct Export {
+    int id;
+    Frame frames[3];
+    int back;                       // CPU thread
+    int front;                      // exporter
+    atomic_uint latest;
+    Damage carry;                   // as in present_screen()
+    uint64_t next_us;               // headless: when to publish next
+    int shown;                      // exporter: frames[front] holds a frame
+    atomic_int gone;                // machine freed, the exporter frees this
+    ExportScreen *shm;              // NULL without --export-shm
+#ifdef _WIN32
+    HANDLE shm_handle;
+#endif
+} Export;
+
+// A span of one row of a frame, bytes [lo, hi) of plane
+typedef struct {
+    uint8_t plane, row;
+    uint16_t lo, hi;
+    const uint8_t *bytes;           // the whole row
+} ExportSpan;
+
+const char *export_shm_name = NULL;     // --export-shm
+const char *export_address = NULL;      // --export-port
+
+struct {
+    pthread_mutex_t lock;           // guards machines[]
+    int running;
+    atomic_int stopping;
+    pthread_t thread;
+    Export *machines[EXPORT_MAX_MACHINES];
+    ExportSocket listener;
+    ExportSocket viewers[EXPORT_MAX_VIEWERS];
+    int synced[EXPORT_MAX_VIEWERS]; // has had a key frame of every machine
+    int viewer_count;
+} exporter = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// POSIX shared memory names start with a slash
+static void export_segment_name(char *name, size_t size, int id) {
+#ifdef _WIN32
+    snprintf(name, size, "%s.%d", export_shm_name, id);
+#else
+    snprintf(name, size, "%s%s.%d", export_shm_name[0] == '/' ? "" : "/", export_shm_name, id);
+#endif
+}
+
+static ExportScreen *export_map(Export *e) {
+    char name[MAX_PATH_LEN];
+    ExportScreen *s = NULL;
+    export_segment_name(name, sizeof(name), e->id);
+#ifdef _WIN32
+    e->shm_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                       0, sizeof(ExportScreen), name);
+    if (e->shm_handle) {
+        s = MapViewOfFile(e->shm_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ExportScreen));
+        if (!s) CloseHandle(e->shm_handle);
+    }
+#else
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd >= 0) {
+        if (ftruncate(fd, sizeof(ExportScreen)) == 0) {
+            s = mmap(NULL, sizeof(ExportScreen), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (s == MAP_FAILED) s = NULL;
+        }
+        close(fd);
+        if (!s) shm_unlink(name);
+    }
+#endif
+    if (!s) {
+        fprintf(stderr, "Warning: Could not create shared memory %s\n", name);
+        return NULL;
+    }
+    memset(s, 0, sizeof(ExportScreen));
+    memcpy(s->magic, EXPORT_MAGIC, 4);
+    s->version = EXPORT_VERSION;
+    return s;
+}
+
+static void export_unmap(Export *e) {
+    if (!e->shm) return;
+#ifdef _WIN32
+    UnmapViewOfFile(e->shm);
+    CloseHandle(e->shm_handle);
+#else
+    char name[MAX_PATH_LEN];
+    export_segment_name(name, sizeof(name), e->id);
+    munmap(e->shm, sizeof(ExportScreen));
+    shm_unlink(name);
+#endif
+}
+
+// Start exporting machine as number id. Does nothing unless the exporter
+// is running.
+void export_attach(int id) {
+    if (!exporter.running) return;
+    if (id >= EXPORT_MAX_MACHINES) {
+        fprintf(stderr, "Warning: Only the first %d machines are exported\n", EXPORT_MAX_MACHINES);
+        return;
+    }
+    Export *e = calloc(1, sizeof(Export));
+    if (!e) return;
+    e->id = id;
+    e->back = 0;
+    e->front = 1;
+    atomic_init(&e->latest, 2);
+    damage_clear(&e->carry);
+    if (export_shm_name) e->shm = export_map(e);
+    machine->export = e;
+    damage_full();
+    pthread_mutex_lock(&exporter.lock);
+    exporter.machines[id] = e;
+    pthread_mutex_unlock(&exporter.lock);
+}
+
+// Stop exporting machine; the exporter tells the viewers and frees it
+void export_detach(Machine *m) {
+    if (!m->export) return;
+    atomic_store(&m->export->gone, 1);
+    m->export = NULL;
+}
+
+// CPU thread: publish the live screen. Called with screen.dirty set,
+// before the caller clears screen.damage.
+void export_screen(void) {
+    Export *e = machine->export;
+    if (!e) return;
+    if (!(atomic_load(&e->latest) & FRAME_FRESH)) damage_clear(&e->carry);
+    damage_merge(&e->carry, &screen.damage);
+
+    Frame *f = &e->frames[e->back];
+    f->damage = e->carry;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        memcpy(f->chars[y], text_row(y), SCREEN_WIDTH);
+        memcpy(f->colors[y], color_row(y), SCREEN_WIDTH);
+    }
+    memcpy(f->pixels, screen.pixels, (size_t)PIXEL_HEIGHT * fb_stride(screen.pixel_depth));
+    f->pixel_depth = screen.pixel_depth;
+    f->cursor_x = screen.cursor_x;
+    f->cursor_y = screen.cursor_y;
+    f->cursor_visible = screen.cursor_visible;
+    f->pixel_mode = screen.pixel_mode;
+    e->back = (int)(atomic_exchange(&e->latest, (unsigned)e->back | FRAME_FRESH) & 3);
+}
+
+// Headless runs publish between slices, at most once per frame. Nothing
+// else consumes screen.damage there, so it is cleared here.
+static void export_slice(int last) {
+    Export *e = machine->export;
+    uint64_t now = host_time_us();
+    if (!screen.dirty || (!last && now < e->next_us)) return;
+    e->next_us = now + FRAME_INTERVAL_US;
+    export_screen();
+    damage_clear(&screen.damage);
+    screen.dirty = 0;
+}
+
+// The spans of f to send: every row for a key frame, else the damaged ones
+static int export_spans(const Frame *f, int whole, ExportSpan *spans) {
+    const Damage *d = &f->damage;
+    int stride = fb_stride(f->pixel_depth);
+    int n = 0;
+    whole |= d->full;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        int lo = whole ? 0 : d->text_lo[y];
+        int hi = whole ? SCREEN_WIDTH : d->text_hi[y];
+        if (lo >= hi) continue;
+        spans[n++] = (ExportSpan){ EXPORT_CHARS, (uint8_t)y, (uint16_t)lo, (uint16_t)hi,
+                                   (const uint8_t *)f->chars[y] };
+        spans[n++] = (ExportSpan){ EXPORT_COLORS, (uint8_t)y, (uint16_t)lo, (uint16_t)hi,
+                                   f->colors[y] };
+    }
+    for (int y = 0; y < PIXEL_HEIGHT; y++) {
+        int lo = whole ? 0 : d->pix_lo[y] * f->pixel_depth / 8;
+        int hi = whole ? stride : (d->pix_hi[y] * f->pixel_depth + 7) / 8;
+        if (lo >= hi) continue;
+        spans[n++] = (ExportSpan){ EXPORT_PIXELS, (uint8_t)y, (uint16_t)lo, (uint16_t)hi,
+                                   f->pixels + y * stride };
+    }
+    return n;
+}
+
+static ExportState export_state(const Frame *f) {
+    ExportState s = {0};
+    s.pixel_mode = (uint8_t)f->pixel_mode;
+    s.pixel_depth = (uint8_t)f->pixel_depth;
+    s.cursor_visible = (uint8_t)f->cursor_visible;
+    s.cursor_x = (uint8_t)f->cursor_x;
+    s.cursor_y = (uint8_t)f->cursor_y;
+    return s;
+}
+
+// Copy the spans into the segment between two bumps of seq
+static void export_write_shm(ExportScreen *s, const Frame *f, const ExportSpan *spans, int n) {
+    uint32_t seq = s->seq;
+    s->seq = seq + 1;
+    atomic_thread_fence(memory_order_release);
+    s->state = export_state(f);
+    for (int i = 0; i < n; i++) {
+        const ExportSpan *sp = &spans[i];
+        uint8_t *row = sp->plane == EXPORT_CHARS ? (uint8_t *)s->chars[sp->row] :
+                       sp->plane == EXPORT_COLORS ? s->colors[sp->row] :
+                       s->pixels + sp->row * fb_stride(f->pixel_depth);
+        memcpy(row + sp->lo, sp->bytes + sp->lo, sp->hi - sp->lo);
+    }
+    s->frames++;
+    atomic_thread_fence(memory_order_release);
+    s->seq = seq + 2;
+}
+
+// PackBits, see export.h
+static size_t export_rle(const uint8_t *src, size_t n, uint8_t *dst) {
+    size_t in = 0, out = 0;
+    while (in < n) {
+        size_t run = 1;
+        while (in + run < n && run < 128 && src[in + run] == src[in]) run++;
+        if (run > 1) {
+            dst[out++] = (uint8_t)(257 - run);
+            dst[out++] = src[in];
+            in += run;
+            continue;
+        }
+        size_t start = in, count = 0;
+        while (in < n && count < 128 && !(in + 1 < n && src[in + 1] == src[in])) {
+            in++;
+            count++;
+        }
+        dst[out++] = (uint8_t)(count - 1);
+        memcpy(dst + out, src + start, count);
+        out += count;
+    }
+    return out;
+}
+
+// Encode a message into msg; returns its length
+static size_t export_message(uint8_t *msg, int type, int id, const Frame *f,
+                             const ExportSpan *spans, int n) {
+    size_t len = 6;
+    msg[4] = (uint8_t)type;
+    msg[5] = (uint8_t)id;
+    if (f) {
+        ExportState s = export_state(f);
+        memcpy(msg + len, &s, sizeof(s));
+        len += sizeof(s);
+    }
+    for (int i = 0; i < n; i++) {
+        const ExportSpan *sp = &spans[i];
+        uint8_t *p = msg + len;
+        p[0] = sp->plane;
+        p[1] = sp->row;
+        p[2] = (uint8_t)sp->lo;
+        p[3] = (uint8_t)(sp->lo >> 8);
+        p[4] = (uint8_t)sp->hi;
+        p[5] = (uint8_t)(sp->hi >> 8);
+        len += 6 + export_rle(sp->bytes + sp->lo, sp->hi - sp->lo, p + 6);
+    }
+    uint32_t rest = (uint32_t)(len - 4);
+    for (int i = 0; i < 4; i++) msg[i] = (uint8_t)(rest >> (8 * i));
+    return len;
+}
+
+static void export_drop_viewer(int i) {
+    close_socket(exporter.viewers[i]);
+    exporter.viewer_count--;
+    exporter.viewers[i] = exporter.viewers[exporter.viewer_count];
+    exporter.synced[i] = exporter.synced[exporter.viewer_count];
+}
+
+// Send msg to the viewers whose synced flag is synced; drops those that fail
+static void export_send(const uint8_t *msg, size_t len, int synced) {
+    for (int i = exporter.viewer_count - 1; i >= 0; i--) {
+        if (exporter.synced[i] != synced) continue;
+        size_t sent = 0;
+        while (sent < len) {
+            int n = (int)send(exporter.viewers[i], (const char *)msg + sent,
+                              (int)(len - sent), MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += (size_t)n;
+        }
+        if (sent < len) export_drop_viewer(i);
+    }
+}
+
+static void export_accept(void) {
+    ExportSocket s = accept(exporter.listener, NULL, NULL);
+    if (s == EXPORT_NO_SOCKET) return;
+    if (exporter.viewer_count == EXPORT_MAX_VIEWERS) {
+        close_socket(s);
+        return;
+    }
+#ifdef _WIN32
+    DWORD timeout = 1000;
+#else
+    struct timeval timeout = {1, 0};
+#endif
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+    exporter.viewers[exporter.viewer_count] = s;
+    exporter.synced[exporter.viewer_count] = 0;
+    exporter.viewer_count++;
+}
+
+// Take every machine's newest frame and pass it on. The lock covers only
+// the copy of machines[]: encoding and the blocking sends run without it,
+// so a slow viewer never holds up export_attach() on a CPU thread.
+static void export_frames(void) {
+    static uint8_t msg[EXPORT_MSG_MAX];
+    static ExportSpan spans[EXPORT_MAX_SPANS];
+    Export *machines[EXPORT_MAX_MACHINES];
+    int gone[EXPORT_MAX_MACHINES];
+    int unsynced = 0;
+    for (int i = 0; i < exporter.viewer_count; i++) unsynced |= !exporter.synced[i];
+
+    // A detached machine leaves the list here; only this thread frees it
+    pthread_mutex_lock(&exporter.lock);
+    for (int id = 0; id < EXPORT_MAX_MACHINES; id++) {
+        machines[id] = exporter.machines[id];
+        gone[id] = machines[id] && atomic_load(&machines[id]->gone);
+        if (gone[id]) exporter.machines[id] = NULL;
+    }
+    pthread_mutex_unlock(&exporter.lock);
+
+    for (int id = 0; id < EXPORT_MAX_MACHINES; id++) {
+        Export *e = machines[id];
+        if (!e) continue;
+        if (atomic_load(&e->latest) & FRAME_FRESH) {
+            e->front = (int)(atomic_exchange(&e->latest, (unsigned)e->front) & 3);
+            Frame *f = &e->frames[e->front];
+            int n = export_spans(f, !e->shown, spans);
+            if (e->shm) export_write_shm(e->shm, f, spans, n);
+            export_send(msg, export_message(msg, e->shown ? EXPORT_DELTA : EXPORT_KEY,
+                                            id, f, spans, n), 1);
+            e->shown = 1;
+        }
+        if (unsynced && e->shown) {
+            Frame *f = &e->frames[e->front];
+            int n = export_spans(f, 1, spans);
+            export_send(msg, export_message(msg, EXPORT_KEY, id, f, spans, n), 0);
+        }
+        if (gone[id]) {
+            if (e->shown) export_send(msg, export_message(msg, EXPORT_GONE, id, NULL, NULL, 0), 1);
+            export_unmap(e);
+            free(e);
+        }
+    }
+    for (int i = 0; i < exporter.viewer_count; i++) exporter.synced[i] = 1;
+}
+
+static void *exporter_thread(void *arg) {
+    (void)arg;
+    while (!atomic_load(&exporter.stopping)) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        int max_fd = 0;
+        if (exporter.listener != EXPORT_NO_SOCKET) {
+            FD_SET(exporter.listener, &fds);
+            max_fd = (int)exporter.listener;
+        }
+        // Viewers only read; anything from one means it has gone
+        for (int i = 0; i < exporter.viewer_count; i++) {
+            FD_SET(exporter.viewers[i], &fds);
+            if ((int)exporter.viewers[i] > max_fd) max_fd = (int)exporter.viewers[i];
+        }
+        struct timeval tv = {0, FRAME_INTERVAL_US};
+        if (select(max_fd + 1, &fds, NULL, NULL, &tv) > 0) {
+            for (int i = exporter.viewer_count - 1; i >= 0; i--) {
+                char junk[256];
+                if (FD_ISSET(exporter.viewers[i], &fds) &&
+                    recv(exporter.viewers[i], junk, sizeof(junk), 0) <= 0) {
+                    export_drop_viewer(i);
+                }
+            }
+            if (exporter.listener != EXPORT_NO_SOCKET && FD_ISSET(exporter.listener, &fds)) {
+                export_accept();
+            }
+        }
+        export_frames();
+    }
+    // Every machine has been detached by now: this sends the last frames
+    // and the EXPORT_GONE messages
+    export_frames();
+    while (exporter.viewer_count) export_drop_viewer(exporter.viewer_count - 1);
+    if (exporter.listener != EXPORT_NO_SOCKET) close_socket(exporter.listener);
+    return NULL;
+}
+
+// Open the export port, if any, and start the exporter thread
+int export_start(void) {
+    exporter.listener = EXPORT_NO_SOCKET;
+    if (export_address) {
+        char host[64] = "127.0.0.1";
+        const char *colon = strrchr(export_address, ':');
+        const char *port = export_address;
+        if (colon) {
+            size_t n = (size_t)(colon - export_address);
+            if (n >= sizeof(host)) n = sizeof(host) - 1;
+            memcpy(host, export_address, n);
+            host[n] = '\0';
+            port = colon + 1;
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(port));
+        addr.sin_addr.s_addr = inet_addr(host);
+        if (addr.sin_addr.s_addr == INADDR_NONE) {
+            fprintf(stderr, "Error: Bad export address %s\n", export_address);
+            return -1;
+        }
+        ExportSocket s = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        if (s != EXPORT_NO_SOCKET) {
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+        }
+        if (s == EXPORT_NO_SOCKET || bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(s, 4) != 0) {
+            fprintf(stderr, "Error: Could not listen on %s\n", export_address);
+            if (s != EXPORT_NO_SOCKET) close_socket(s);
+            return -1;
+        }
+        exporter.listener = s;
+    }
+    if (pthread_create(&exporter.thread, NULL, exporter_thread, NULL) != 0) return -1;
+    exporter.running = 1;
+    return 0;
+}
+
+// Detach main_machine, pass on what is left and remove the segments.
+// Pool workers detach their own machines before this.
+void export_finish(void) {
+    if (!exporter.running) return;
+    export_detach(&main_machine);
+    atomic_store(&exporter.stopping, 1);
+    pthread_join(exporter.thread, NULL);
+    exporter.running = 0;
+}
+
+// Programs run in slices of cpu_slice_cycles instructions. Between slices
+// the screen is published at most once per frame, and with a target clock
+// the CPU thread sleeps off any lead it has over wall time. Falling far
+// behind (a blocking opcode, a slow host) re-bases the clock rather than
+// running flat out to catch up.
+void run_program(void) {
+    uint64_t base_us = host_time_us();
+    uint64_t base_cycles = cpu.cycles;
+    uint64_t next_frame_us = base_us + FRAME_INTERVAL_US;
+
+    if (profile_path && !machine->profile && profile_start() != 0) {
+        print_to_screen("Error: Out of memory for the profile\n");
+    }
+    os_mode = 0;
+    start_program_clock();
+    if (record_path && trace_start() != 0) {
+        print_to_screen("Error: Out of memory for the trace\n");
+    }
+    while (cpu.running && window_running) {
+        cpu.cycle_limit = cpu.cycles + cpu_slice_cycles;
+        run_slice();
+
+        uint64_t now = host_time_us();
+        if (now >= next_frame_us) {
+            present_screen();
+            next_frame_us = now + FRAME_INTERVAL_US;
+        }
+        if (cpu_clock_hz) {
+            uint64_t due = base_us + (cpu.cycles - base_cycles) * 1000000 / cpu_clock_hz;
+            if (due > now) {
+                sleep_us(due - now);
+            } else if (now - due > CLOCK_MAX_LAG_US) {
+                base_us = now;
+                base_cycles = cpu.cycles;
+            }
+        }
+    }
+    if (machine->profile) {
+        char msg[MAX_PATH_LEN + 64];
+        if (profile_finish(profile_path) == 0) {
+            snprintf(msg, sizeof(msg), "Profile written to %s\n", profile_path);
+        } else {
+            snprintf(msg, sizeof(msg), "Error: Could not write profile %s\n", profile_path);
+        }
+        print_to_screen(msg);
+    }
+    if (machine->trace) {
+        char msg[MAX_PATH_LEN + 64];
+        if (trace_finish(record_path) == 0) {
+            snprintf(msg, sizeof(msg), "Trace written to %s\n", record_path);
+        } else {
+            snprintf(msg, sizeof(msg), "Error: Could not write trace %s\n", record_path);
+        }
+        print_to_screen(msg);
+    }
+    present_screen();
+    os_mode = 1;
+}
+
+// Headless runs. The program runs flat out on the selected engine and is
+// timed; the opcode histogram comes from a second, interpreted pass from
+// the same starting snapshot and random seed, so counting costs the timed
+// run nothing.
+#define HEADLESS_SEED   1
+const char *engine_names[] = {"interp", "predecode", "jit"};
+
+static void run_counted(uint64_t *counts, uint64_t cycles) {
+    while (cpu.running && cpu.cycles < cycles) {
+        uint8_t op = step_instruction();
+        counts[op] += opcode_cycles(op);
+    }
+}
+
+// A host path first, then a file (or archive member) in the filesystem.
+// Pool workers load side by side; the shell never runs alongside them, so
+// this lock is all the filesystem needs.
+static pthread_mutex_t headless_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load_headless(const char *name) {
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        pthread_mutex_lock(&headless_fs_lock);
+        int status = load_program(name);
+        pthread_mutex_unlock(&headless_fs_lock);
+        return status;
+    }
+
+    uint8_t *data = NULL;
+    size_t size = 0, cap = 0, n;
+    do {
+        if (size == cap) {
+            uint8_t *grown = realloc(data, cap = cap ? cap * 2 : MEM_SIZE + 1);
+            if (!grown) break;
+            data = grown;
+        }
+        n = fread(data + size, 1, cap - size, f);
+        size += n;
+    } while (n > 0);
+    fclose(f);
+
+    int entry = data ? load_program_image(data, size) : -1;
+    free(data);
+    if (entry < 0) return -1;
+    flush_decode_cache();
+    cpu.pc = (uint16_t)entry;
+    cpu.running = 1;
+    return 0;
+}
+
+// Run the loaded program until it halts or reaches max_cycles; returns
+// the wall time taken in microseconds
+static uint64_t run_timed(uint64_t max_cycles) {
+    uint64_t t0 = host_time_us();
+    machine->rand_state = HEADLESS_SEED;
+    start_program_clock();
+    while (cpu.running && cpu.cycles < max_cycles) {
+        cpu.cycle_limit = max_cycles - cpu.cycles > cpu_slice_cycles ?
+                          cpu.cycles + cpu_slice_cycles : max_cycles;
+        run_slice();
+        if (machine->export) export_slice(0);
+    }
+    if (machine->export) export_slice(1);
+    return host_time_us() - t0;
+}
+
+int run_headless(const char *name, uint64_t max_cycles) {
+    if (load_headless(name) != 0) {
+        fprintf(stderr, "Error: Could not load %s\n", name);
+        return 1;
+    }
+    Snapshot *start = snapshot_take();
+
+    if (profile_path && profile_start() != 0) {
+        fprintf(stderr, "Error: Out of memory for the profile\n");
+        return 1;
+    }
+    os_mode = 0;
+    uint64_t wall_us = run_timed(max_cycles);
+    uint64_t executed = cpu.cycles;
+    if (profile_path && profile_finish(profile_path) != 0) {
+        fprintf(stderr, "Error: Could not write profile %s\n", profile_path);
+    }
+    int halted = !cpu.running;
+
+    printf("%s: %s after %llu instructions\n", name,
+           halted ? "halted" : "stopped at cycle limit", (unsigned long long)executed);
+    printf("  engine     %s\n", profile_path ? "interp (profiling)" : engine_names[cpu_engine]);
+    printf("  wall time  %.3f ms\n", wall_us / 1000.0);
+    printf("  MIPS       %.2f\n", wall_us ? (double)executed / wall_us : 0.0);
+
+    if (start) {
+        static uint64_t counts[256];
+        int engine = cpu_engine;
+        snapshot_restore(start);
+        cpu_engine = ENGINE_INTERP;
+        machine->rand_state = HEADLESS_SEED;
+        start_program_clock();
+        run_counted(counts, executed);
+        cpu_engine = engine;
+        snapshot_free(start);
+
+        printf("  opcode histogram:\n");
+        for (;;) {
+            int top = -1;
+            for (int op = 0; op < 256; op++) {
+                if (counts[op] && (top < 0 || counts[op] > counts[top])) top = op;
+            }
+            if (top < 0) break;
+            printf("    %02X %-16s %12llu  %5.1f%%\n", top,
+                   opcode_info[top].name ? opcode_info[top].name : "?",
+                   (unsigned long long)counts[top],
+                   executed ? 100.0 * counts[top] / executed : 0.0);
+            counts[top] = 0;
+        }
+    }
+    os_mode = 1;
+    return halted ? 0 : 2;
+}
+
+// --replay: load a trace, restore its starting state and run the program
+// on the selected engine with the recorded inputs, up to where the
+// recording stopped. The result is a match when every input was read
+// in step and the CPU and screen end as they did. Returns 0 for a
+// match, 3 for a mismatch and 1 when the trace cannot be read.
+int run_replay(const char *path) {
+    Trace *t = calloc(1, sizeof(Trace));
+    FILE *f = t ? fopen(path, "rb") : NULL;
+    if (f) {
+        size_t n;
+        do {
+            if (t->size == t->capacity) {
+                uint8_t *grown = realloc(t->data, t->capacity = t->capacity ? t->capacity * 2 : 65536);
+                if (!grown) break;
+                t->data = grown;
+            }
+            n = fread(t->data + t->size, 1, t->capacity - t->size, f);
+            t->size += n;
+        } while (n > 0);
+        fclose(f);
+    }
+
+    uint32_t len = 0;
+    Snapshot *start = NULL;
+    if (t && t->size >= TRACE_HEADER && memcmp(t->data, "MTRC", 4) == 0 &&
+        t->data[4] == TRACE_VERSION) {
+        memcpy(&len, t->data + 12, 4);
+        if (len <= t->size - TRACE_HEADER) start = snapshot_decode(t->data + TRACE_HEADER, len);
+    }
+    if (start) {
+        snapshot_restore(start);
+        snapshot_free(start);
+        memcpy(&machine->rand_state, t->data + 8, 4);
+        t->pos = TRACE_HEADER + len;
+        t->last = cpu.cycles;
+        t->replaying = 1;
+    }
+    if (!start || trace_next(t) != 0) {
+        fprintf(stderr, "Error: Could not load trace %s\n", path);
+        if (t) free(t->data);
+        free(t);
+        return 1;
+    }
+
+    os_mode = 0;
+    machine->trace = t;
+    start_program_clock();
+    uint64_t t0 = host_time_us(), first = cpu.cycles;
+    // The last slice ends exactly where the recording stopped, which holds
+    // on every engine because each stops at cycle_limit to the instruction
+    while (cpu.running && !t->diverged) {
+        uint64_t limit = cpu.cycles + cpu_slice_cycles;
+        if (t->next_op == OP_HALT && limit > t->next) limit = t->next;
+        if (limit <= cpu.cycles) break;
+        cpu.cycle_limit = limit;
+        run_slice();
+        // A record the program ran past without reading
+        if (t->next_op != OP_HALT && cpu.cycles > t->next) t->diverged = 1;
+    }
+    uint64_t wall_us = host_time_us() - t0;
+    machine->trace = NULL;
+
+    uint32_t hash[2], want[2] = {0, 0};
+    machine_hashes(hash);
+    int ended = !t->diverged && t->next_op == OP_HALT && cpu.cycles == t->next &&
+                t->size - t->pos >= sizeof(want);
+    if (ended) memcpy(want, t->data + t->pos, sizeof(want));
+    int match = ended && hash[0] == want[0] && hash[1] == want[1];
+
+    printf("%s: replayed %llu instructions\n", path, (unsigned long long)(cpu.cycles - first));
+    printf("  engine     %s\n", engine_names[cpu_engine]);
+    printf("  wall time  %.3f ms\n", wall_us / 1000.0);
+    if (ended) {
+        printf("  cpu        %08x (recorded %08x)\n", hash[0], want[0]);
+        printf("  screen     %08x (recorded %08x)\n", hash[1], want[1]);
+    } else {
+        printf("  diverged   at instruction %llu\n", (unsigned long long)cpu.cycles);
+    }
+    printf("  result     %s\n", match ? "match" : "MISMATCH");
+    free(t->data);
+    free(t);
+    os_mode = 1;
+    return match ? 0 : 3;
+}
+
+// Machines beyond main_machine, for pool workers. machine_new() leaves
+// the new machine current on the calling thread.
+Machine *machine_new(void) {
+    Machine *m = calloc(1, sizeof(Machine));
+    if (!m) return NULL;
+    machine = m;
+    if (cpu_engine == ENGINE_JIT && jit_init() != 0) {
+        free(m);
+        machine = &main_machine;
+        return NULL;
+    }
+    pthread_mutex_init(&input_buf.mutex, NULL);
+    pthread_cond_init(&input_buf.changed, NULL);
+    init_screen();
+    init_cpu();
+    return m;
+}
+
+// A new machine in the state src is in now: memory and banks, registers,
+// screen, the random generator and the program clock. Roughly a hundred
+// KB of copying, so a booted machine is cloned in microseconds. Like
+// machine_new() it leaves the clone current; src must not be running.
+Machine *machine_clone(const Machine *src) {
+    machine = (Machine *)src;
+    Snapshot *s = snapshot_take();
+    Machine *m = s ? machine_new() : NULL;
+    if (m) {
+        snapshot_restore(s);
+        m->rand_state = src->rand_state;
+        m->clock_start = src->clock_start;
+        m->slept_ms = src->slept_ms;
+        m->wake_us = src->wake_us;
+    }
+    snapshot_free(s);
+    if (!m) machine = &main_machine;
+    return m;
+}
+
+void machine_free(Machine *m) {
+    machine = m;
+    jit_release();
+    banks_free();
+    pthread_cond_destroy(&input_buf.changed);
+    pthread_mutex_destroy(&input_buf.mutex);
+    free(screen.chars);
+    free(screen.colors);
+    free(m);
+    machine = &main_machine;
+}
+
+// Headless pool. Jobs are dealt out to one deque per worker in
+// contiguous runs. A worker takes jobs from the front of its own deque;
+// once that is empty it steals from the back of the others in turn, so a
+// run of slow programs never leaves the rest of the pool idle.
+typedef struct {
+    pthread_mutex_t lock;
+    int head, tail;             // jobs [head, tail) not yet taken
+} JobDeque;
+
+typedef struct {
+    const char *name;
+    int status;                 // run_headless() exit codes
+    uint64_t instructions;
+    uint64_t wall_us;
+    uint32_t state;             // hash of the final machine snapshot
+} JobResult;
+
+typedef struct {
+    JobDeque *deques;
+    JobResult *results;
+    int workers;
+    uint64_t max_cycles;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} PoolWorker;
+
+static int take_job(Pool *pool, int id) {
+    JobDeque *own = &pool->deques[id];
+    int job = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) job = own->head++;
+    pthread_mutex_unlock(&own->lock);
+
+    for (int i = 1; job < 0 && i < pool->workers; i++) {
+        JobDeque *d = &pool->deques[(id + i) % pool->workers];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) job = --d->tail;
+        pthread_mutex_unlock(&d->lock);
+    }
+    return job;
+}
+
+static void *pool_worker(void *arg) {
+    PoolWorker *w = arg;
+    Pool *pool = w->pool;
+    // Every worker is a clone of the main machine, blank or from --state,
+    // and goes back to that state before each job
+    Machine *m = machine_clone(&main_machine);
+    Snapshot *start = m ? snapshot_take() : NULL;
+    int job;
+
+    if (m) export_attach(w->id);
+
+    while ((job = take_job(pool, w->id)) >= 0) {
+        JobResult *r = &pool->results[job];
+        if (!start || load_headless(r->name) != 0) {
+            r->status = 1;
+        } else {
+            r->wall_us = run_timed(pool->max_cycles);
+            r->instructions = cpu.cycles;
+            r->status = cpu.running ? 2 : 0;
+            Snapshot *end = snapshot_take();
+            if (end) {
+                r->state = fnv1a(end->image, end->size);
+                snapshot_free(end);
+            }
+        }
+        if (start) snapshot_restore(start);
+    }
+    snapshot_free(start);
+    if (m) {
+        export_detach(m);
+        machine_free(m);
+    }
+    return NULL;
+}
+
+static int host_cpus(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+// Run every program on its own machine across jobs worker threads, then
+// report them in order. The status is the worst of the programs'.
+int run_pool(const char **names, int count, int jobs, uint64_t max_cycles) {
+    if (jobs <= 0) jobs = host_cpus();
+    if (jobs > count) jobs = count;
+
+    Pool pool;
+    pool.workers = jobs;
+    pool.max_cycles = max_cycles;
+    pool.deques = calloc(jobs, sizeof(JobDeque));
+    pool.results = calloc(count, sizeof(JobResult));
+    PoolWorker *workers = calloc(jobs, sizeof(PoolWorker));
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    if (!pool.deques || !pool.results || !workers || !threads) {
+        fprintf(stderr, "Out of memory for %d jobs\n", count);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) pool.results[i].name = names[i];
+    for (int i = 0; i < jobs; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].head = (int)((int64_t)count * i / jobs);
+        pool.deques[i].tail = (int)((int64_t)count * (i + 1) / jobs);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    uint64_t t0 = host_time_us();
+    for (int i = 0; i < jobs; i++) {
+        pthread_create(&threads[i], NULL, pool_worker, &workers[i]);
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t wall_us = host_time_us() - t0;
+
+    uint64_t total = 0;
+    int halted = 0, limited = 0, failed = 0;
+    for (int i = 0; i < count; i++) {
+        JobResult *r = &pool.results[i];
+        if (r->status == 1) {
+            printf("%s: could not load\n", r->name);
+            failed++;
+            continue;
+        }
+        printf("%s: %s after %llu instructions, %.3f ms, %.2f MIPS, state %08x\n", r->name,
+               r->status == 0 ? "halted" : "stopped at cycle limit",
+               (unsigned long long)r->instructions, r->wall_us / 1000.0,
+               r->wall_us ? (double)r->instructions / r->wall_us : 0.0, r->state);
+        total += r->instructions;
+        if (r->status == 0) halted++;
+        else limited++;
+    }
+    printf("%d programs on %d workers (%s): %d halted, %d at cycle limit, %d failed\n",
+           count, jobs, engine_names[cpu_engine], halted, limited, failed);
+    printf("  %llu instructions in %.3f ms, %.2f MIPS aggregate\n", (unsigned long long)total,
+           wall_us / 1000.0, wall_us ? (double)total / wall_us : 0.0);
+
+    for (int i = 0; i < jobs; i++) pthread_mutex_destroy(&pool.deques[i].lock);
+    free(pool.deques);
+    free(pool.results);
+    free(workers);
+    free(threads);
+    return failed ? 1 : limited ? 2 : 0;
+}
+
+// Assembler and disassembler, both driven by opcode_info[]. Source is one
+// instruction or directive per line, mnemonics as in opcodes.h:
+//
+//     loop:   ADDI R0, 1          ; labels end in ':', comments in ';'
+//             CJNE R0, 10, loop
+//             PRINT_STR "done\n"
+//             HALT
+//             .org 0x2000         ; zero-fill up to an address
+//     table:  .byte 1, 2, 'x'
+//             .word 0x1234, loop
+//             .string "abc"       ; the bytes and a terminating 0
+//
+// Numbers are decimal, 0x hex or 'c' characters and may be negative; any
+// byte, word or address operand may be a label instead. The disassembler
+// prints the same syntax, so its output assembles back to the same bytes.
+#define ASM_MAX_LABELS  1024
+#define ASM_LABEL_LEN   32
+
+typedef struct {
+    char name[ASM_LABEL_LEN];
+    uint16_t addr;
+} AsmLabel;
+
+typedef struct {
+    uint8_t *out;           // MEM_SIZE bytes
+    uint32_t pc;
+    uint32_t size;          // highest address written, plus one
+    int pass;               // labels are collected in pass 1, used in pass 2
+    int line;
+    AsmLabel labels[ASM_MAX_LABELS];
+    int label_count;
+    char error[96];
+} Assembler;
+
+static int asm_fail(Assembler *a, const char *msg, const char *what) {
+    if (!a->error[0]) {
+        snprintf(a->error, sizeof(a->error), "line %d: %s%s%s", a->line, msg,
+                 what ? " " : "", what ? what : "");
+    }
+    return -1;
+}
+
+static void asm_skip_space(const char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\r') (*p)++;
+}
+
+static int asm_ident_char(char c, int first) {
+    return isalpha((unsigned char)c) || c == '_' || c == '.' || (!first && isdigit((unsigned char)c));
+}
+
+// Copy an identifier at p into buf (truncated to size); returns its length
+static size_t asm_ident(const char **p, char *buf, size_t size) {
+    size_t n = 0;
+    if (!asm_ident_char(**p, 1)) return 0;
+    while (asm_ident_char(**p, n == 0)) {
+        if (n + 1 < size) buf[n] = **p;
+        n++;
+        (*p)++;
+    }
+    buf[n < size ? n : size - 1] = '\0';
+    return n;
+}
+
+static AsmLabel *asm_find_label(Assembler *a, const char *name) {
+    for (int i = 0; i < a->label_count; i++) {
+        if (strcmp(a->labels[i].name, name) == 0) return &a->labels[i];
+    }
+    return NULL;
+}
+
+static int asm_emit(Assembler *a, uint8_t byte) {
+    if (a->pc >= MEM_SIZE) return asm_fail(a, "program does not fit in memory", NULL);
+    if (a->pass == 2) a->out[a->pc] = byte;
+    a->pc++;
+    if (a->pc > a->size) a->size = a->pc;
+    return 0;
+}
+
+// One character of a quoted string or character literal
+static int asm_char(const char **p, int *c) {
+    if (**p == '\0' || **p == '\n') return -1;
+    if (**p != '\\') {
+        *c = (unsigned char)*(*p)++;
+        return 0;
+    }
+    (*p)++;
+    switch (*(*p)++) {
+        case 'n': *c = '\n'; return 0;
+        case 't': *c = '\t'; return 0;
+        case 'r': *c = '\r'; return 0;
+        case '0': *c = 0; return 0;
+        case '\\': *c = '\\'; return 0;
+        case '"': *c = '"'; return 0;
+        case '\'': *c = '\''; return 0;
+        case 'x':
+            if (!isxdigit((unsigned char)(*p)[0]) || !isxdigit((unsigned char)(*p)[1])) return -1;
+            char hex[3] = { (*p)[0], (*p)[1], '\0' };
+            *c = (int)strtol(hex, NULL, 16);
+            *p += 2;
+            return 0;
+    }
+    return -1;
+}
+
+static int asm_value(Assembler *a, const char **p, long *value) {
+    char name[ASM_LABEL_LEN];
+    asm_skip_space(p);
+    if (**p == '\'') {
+        int c;
+        (*p)++;
+        if (asm_char(p, &c) != 0 || **p != '\'') return asm_fail(a, "bad character literal", NULL);
+        (*p)++;
+        *value = c;
+        return 0;
+    }
+    if (isdigit((unsigned char)**p) || (**p == '-' && isdigit((unsigned char)(*p)[1]))) {
+        char *end;
+        *value = strtol(*p, &end, 0);
+        *p = end;
+        return 0;
+    }
+    if (asm_ident(p, name, sizeof(name)) == 0) return asm_fail(a, "expected a value", NULL);
+    AsmLabel *l = asm_find_label(a, name);
+    if (!l && a->pass == 2) return asm_fail(a, "undefined label", name);
+    *value = l ? l->addr : 0;
+    return 0;
+}
+
+static int asm_string(Assembler *a, const char **p) {
+    asm_skip_space(p);
+    if (**p != '"') return asm_fail(a, "expected a string", NULL);
+    (*p)++;
+    while (**p != '"') {
+        int c;
+        if (asm_char(p, &c) != 0) return asm_fail(a, "unterminated string", NULL);
+        if (asm_emit(a, (uint8_t)c) != 0) return -1;
+    }
+    (*p)++;
+    return asm_emit(a, 0);
+}
+
+static int asm_operand(Assembler *a, const char **p, char kind) {
+    long v;
+    asm_skip_space(p);
+    switch (kind) {
+        case 'r':
+            if ((**p != 'R' && **p != 'r') || (*p)[1] < '0' || (*p)[1] > '7' ||
+                asm_ident_char((*p)[2], 0)) {
+                return asm_fail(a, "expected a register R0-R7", NULL);
             }
-            break;
-        case OP_STORE_MEM:
-            if (cpu.pc + 2 < MEM_SIZE) {
-                uint16_t addr = cpu.memory[cpu.pc++];
-                addr |= (cpu.memory[cpu.pc++] << 8);
-                uint8_t reg = cpu.memory[cpu.pc++];
-                if (reg < 8 && addr + 1 < MEM_SIZE) {
-                    cpu.memory[addr] = cpu.regs[reg] & 0xFF;
-                    cpu.memory[addr + 1] = (cpu.regs[reg] >> 8) & 0xFF;
-                }
+            *p += 2;
+            return asm_emit(a, (uint8_t)((*p)[-1] - '0'));
+        case 'b':
+            if (asm_value(a, p, &v) != 0) return -1;
+            if (v < -128 || v > 255) return asm_fail(a, "byte out of range", NULL);
+            return asm_emit(a, (uint8_t)v);
+        case 'w':
+        case 'a':
+            if (asm_value(a, p, &v) != 0) return -1;
+            if (v < -32768 || v > 65535) return asm_fail(a, "word out of range", NULL);
+            if (asm_emit(a, (uint8_t)(v & 0xFF)) != 0) return -1;
+            return asm_emit(a, (uint8_t)((v >> 8) & 0xFF));
+        case 's':
+            return asm_string(a, p);
+    }
+    return -1;
+}
+
+// Comma-separated values of one size, for .byte and .word
+static int asm_data(Assembler *a, const char **p, char kind) {
+    for (;;) {
+        if (asm_operand(a, p, kind) != 0) return -1;
+        asm_skip_space(p);
+        if (**p != ',') return 0;
+        (*p)++;
+    }
+}
+
+static int asm_line(Assembler *a, const char *p) {
+    char word[ASM_LABEL_LEN] = "";
+    asm_skip_space(&p);
+    while (asm_ident(&p, word, sizeof(word)) > 0) {
+        asm_skip_space(&p);
+        if (*p != ':') break;
+        // A label: defined in pass 1, already known in pass 2
+        p++;
+        if (a->pass == 1) {
+            if (asm_find_label(a, word)) return asm_fail(a, "duplicate label", word);
+            if (a->label_count == ASM_MAX_LABELS) return asm_fail(a, "too many labels", NULL);
+            AsmLabel *l = &a->labels[a->label_count++];
+            snprintf(l->name, sizeof(l->name), "%s", word);
+            l->addr = (uint16_t)a->pc;
+        }
+        word[0] = '\0';
+        asm_skip_space(&p);
+    }
+
+    if (word[0] == '\0') {
+        // Nothing but labels, a comment or whitespace
+    } else if (strcmp(word, ".byte") == 0) {
+        if (asm_data(a, &p, 'b') != 0) return -1;
+    } else if (strcmp(word, ".word") == 0) {
+        if (asm_data(a, &p, 'w') != 0) return -1;
+    } else if (strcmp(word, ".string") == 0) {
+        if (asm_string(a, &p) != 0) return -1;
+    } else if (strcmp(word, ".org") == 0) {
+        long v;
+        if (asm_value(a, &p, &v) != 0) return -1;
+        if (v < (long)a->pc || v > MEM_SIZE) return asm_fail(a, ".org moves backwards or past memory", NULL);
+        while (a->pc < (uint32_t)v) {
+            if (asm_emit(a, 0) != 0) return -1;
+        }
+    } else {
+        int opcode = -1;
+        for (char *c = word; *c; c++) *c = (char)toupper((unsigned char)*c);
+        for (int i = 0; i < 256 && opcode < 0; i++) {
+            if (opcode_info[i].name && strcmp(opcode_info[i].name, word) == 0) opcode = i;
+        }
+        if (opcode < 0) return asm_fail(a, "unknown instruction", word);
+        if (asm_emit(a, (uint8_t)opcode) != 0) return -1;
+        for (const char *k = opcode_info[opcode].operands; *k; k++) {
+            if (k != opcode_info[opcode].operands) {
+                asm_skip_space(&p);
+                if (*p++ != ',') return asm_fail(a, "expected ',' in", word);
             }
-            break;
-        case OP_COPY_MEM:
-            if (cpu.pc + 5 < MEM_SIZE) {
-                uint16_t src = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t dst = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                uint16_t len = cpu.memory[cpu.pc++] | (cpu.memory[cpu.pc++] << 8);
-                if (src + len < MEM_SIZE && dst + len < MEM_SIZE) {
-                    memmove(&cpu.memory[dst], &cpu.memory[src], len);
-                }
+            if (asm_operand(a, &p, *k) != 0) return -1;
+        }
+    }
+    asm_skip_space(&p);
+    if (*p != '\0' && *p != ';') return asm_fail(a, "unexpected text after", word[0] ? word : "label");
+    return 0;
+}
+
+// Assemble src into out (MEM_SIZE bytes). Returns the program size, or -1
+// with a message in error.
+long assemble(const char *src, size_t len, uint8_t *out, char *error, size_t error_size) {
+    Assembler *a = calloc(1, sizeof(Assembler));
+    if (!a) {
+        snprintf(error, error_size, "out of memory");
+        return -1;
+    }
+    a->out = out;
+    memset(out, 0, MEM_SIZE);
+
+    long result = 0;
+    for (a->pass = 1; a->pass <= 2 && result == 0; a->pass++) {
+        const char *p = src, *end = src + len;
+        a->pc = 0;
+        a->line = 0;
+        while (p < end && result == 0) {
+            char line[512];
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            size_t n = (size_t)((nl ? nl : end) - p);
+            a->line++;
+            if (n >= sizeof(line)) {
+                result = asm_fail(a, "line too long", NULL);
+                break;
             }
-            break;
-        default: {
-            char msg[64];
-            snprintf(msg, sizeof(msg), "Error: Unknown opcode 0x%02X\n", opcode);
-            print_to_screen(msg);
-            cpu.running = 0;
-            break;
+            memcpy(line, p, n);
+            line[n] = '\0';
+            result = asm_line(a, line);
+            p += n + (nl ? 1 : 0);
         }
     }
+    if (result == 0) result = (long)a->size;
+    else snprintf(error, error_size, "%s", a->error);
+    free(a);
+    return result;
 }
 
-void run_program(void) {
-    os_mode = 0;
-    while (cpu.running && cpu.pc < MEM_SIZE) {
-        execute_instruction();
+// Disassemble the instruction at mem[at] into text; returns its length.
+// Unknown opcodes and instructions cut off by the end of the data come
+// out as a single .byte, and encodings the assembler cannot write (a
+// register above R7) as .byte for the whole instruction.
+size_t disassemble(const uint8_t *mem, size_t size, size_t at, char *text, size_t text_size) {
+    const OpcodeInfo *info = &opcode_info[mem[at]];
+    size_t len = info->length, n;
+
+    if (info->name && strchr(info->operands, 's')) {
+        const uint8_t *nul = memchr(mem + at + 1, 0, size - at - 1);
+        len = nul ? (size_t)(nul - mem - at) + 1 : 0;
     }
-    os_mode = 1;
+    if (!info->name || len == 0 || at + len > size) {
+        snprintf(text, text_size, ".byte 0x%02X", mem[at]);
+        return 1;
+    }
+    for (size_t i = 0, p = at + 1; info->operands[i]; i++) {
+        char k = info->operands[i];
+        if (k == 'r' && mem[p] >= 8) {
+            n = (size_t)snprintf(text, text_size, ".byte 0x%02X", mem[at]);
+            for (size_t j = 1; j < len && n < text_size; j++) {
+                n += snprintf(text + n, text_size - n, ", 0x%02X", mem[at + j]);
+            }
+            return len;
+        }
+        p += k == 'w' || k == 'a' ? 2 : 1;
+    }
+
+    n = (size_t)snprintf(text, text_size, "%s", info->name);
+    size_t p = at + 1;
+    for (const char *k = info->operands; *k && n < text_size; k++) {
+        const char *sep = k == info->operands ? " " : ", ";
+        uint16_t word = p + 1 < size ? (uint16_t)(mem[p] | mem[p + 1] << 8) : 0;
+        switch (*k) {
+            case 'r': n += snprintf(text + n, text_size - n, "%sR%u", sep, mem[p++]); break;
+            case 'b': n += snprintf(text + n, text_size - n, "%s%u", sep, mem[p++]); break;
+            case 'w': n += snprintf(text + n, text_size - n, "%s%u", sep, word); p += 2; break;
+            case 'a': n += snprintf(text + n, text_size - n, "%s0x%04X", sep, word); p += 2; break;
+            case 's':
+                n += snprintf(text + n, text_size - n, "%s\"", sep);
+                for (; mem[p] && n + 6 < text_size; p++) {
+                    uint8_t c = mem[p];
+                    if (c == '\n') n += snprintf(text + n, text_size - n, "\\n");
+                    else if (c == '"' || c == '\\') n += snprintf(text + n, text_size - n, "\\%c", c);
+                    else if (c >= 32 && c < 127) text[n++] = (char)c;
+                    else n += snprintf(text + n, text_size - n, "\\x%02X", c);
+                }
+                if (n + 2 <= text_size) {
+                    text[n++] = '"';
+                    text[n] = '\0';
+                }
+                p++;
+                break;
+        }
+    }
+    return len;
 }
 
 // Command implementations
@@ -1436,6 +6886,26 @@ void cmd_help(void) {
     print_to_screen("  hexdump <file> ");
     screen.current_color = COLOR_WHITE;
     print_to_screen("- Display hexadecimal dump\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  disasm <file>  ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Disassemble a program\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  asm <in> <out> ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Assemble source into a program\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  savestate <f>  ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Save the machine state\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  loadstate <f>  ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Restore a saved state\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  cmp <a> <b>    ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Compare two files\n");
     
     screen.current_color = COLOR_BRIGHT_CYAN;
     print_to_screen("\nSystem Commands:\n");
@@ -1471,6 +6941,10 @@ void cmd_help(void) {
     print_to_screen("  history        ");
     screen.current_color = COLOR_WHITE;
     print_to_screen("- Show command history\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  cmd > <file>   ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Write a command's output to a file (>> appends)\n");
     
     screen.current_color = COLOR_BRIGHT_CYAN;
     print_to_screen("\nProgram Execution:\n");
@@ -1478,6 +6952,14 @@ void cmd_help(void) {
     print_to_screen("  run <file>     ");
     screen.current_color = COLOR_WHITE;
     print_to_screen("- Execute a binary program\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  source <file>  ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Run the commands in a file\n");
+    screen.current_color = COLOR_CYAN;
+    print_to_screen("  screendump     ");
+    screen.current_color = COLOR_WHITE;
+    print_to_screen("- Print the text on the screen\n");
     
     screen.current_color = COLOR_BRIGHT_CYAN;
     print_to_screen("\nFun Commands:\n");
@@ -1540,12 +7022,18 @@ void cmd_cat(const char *filename) {
         return;
     }
     
+    const uint8_t *data = file_data(f);
+    if (!data) {
+        print_to_screen("Error: Could not read file\n");
+        return;
+    }
+    
     print_to_screen("\n");
     for (size_t i = 0; i < f->size; i++) {
-        if (f->data[i] >= 32 && f->data[i] < 127) {
-            putchar_screen(f->data[i]);
-        } else if (f->data[i] == '\n' || f->data[i] == '\r' || f->data[i] == '\t') {
-            putchar_screen(f->data[i]);
+        if (data[i] >= 32 && data[i] < 127) {
+            putchar_screen(data[i]);
+        } else if (data[i] == '\n' || data[i] == '\r' || data[i] == '\t') {
+            putchar_screen(data[i]);
         } else {
             putchar_screen('.');
         }
@@ -1562,7 +7050,6 @@ void cmd_rm(const char *filename) {
     
     if (delete_file(filename) == 0) {
         print_to_screen("File deleted.\n");
-        scan_filesystem();
     } else {
         print_to_screen("Error: Could not delete file\n");
     }
@@ -1575,9 +7062,8 @@ void cmd_cp(const char *src, const char *dst) {
         return;
     }
     
-    if (write_file(dst, f->data, f->size) == 0) {
+    if (copy_file(src, dst) == 0) {
         print_to_screen("File copied.\n");
-        scan_filesystem();
     } else {
         print_to_screen("Error: Could not copy file\n");
     }
@@ -1640,6 +7126,12 @@ void cmd_hexdump(const char *filename) {
         return;
     }
     
+    const uint8_t *data = file_data(f);
+    if (!data) {
+        print_to_screen("Error: Could not read file\n");
+        return;
+    }
+    
     print_to_screen("\n");
     char line[128];
     for (size_t i = 0; i < f->size; i += 16) {
@@ -1647,14 +7139,14 @@ void cmd_hexdump(const char *filename) {
         print_to_screen(line);
         
         for (size_t j = 0; j < 16 && i + j < f->size; j++) {
-            snprintf(line, sizeof(line), "%02x ", f->data[i + j]);
+            snprintf(line, sizeof(line), "%02x ", data[i + j]);
             print_to_screen(line);
         }
         
         print_to_screen(" | ");
         
         for (size_t j = 0; j < 16 && i + j < f->size; j++) {
-            char c = f->data[i + j];
+            char c = data[i + j];
             if (c >= 32 && c < 127) {
                 putchar_screen(c);
             } else {
@@ -1667,6 +7159,60 @@ void cmd_hexdump(const char *filename) {
     print_to_screen("\n");
 }
 
+// List a program as assembler source, one instruction per line
+void cmd_disasm(const char *filename) {
+    File *f = find_file(filename);
+    if (!f) {
+        print_to_screen("Error: File not found\n");
+        return;
+    }
+    
+    const uint8_t *data = file_data(f);
+    if (!data) {
+        print_to_screen("Error: Could not read file\n");
+        return;
+    }
+    
+    print_to_screen("\n");
+    char text[1024], line[1100];
+    for (size_t i = 0; i < f->size;) {
+        size_t len = disassemble(data, f->size, i, text, sizeof(text));
+        char bytes[24] = "";
+        for (size_t j = 0; j < len && j < 6; j++) {
+            snprintf(bytes + 3 * j, sizeof(bytes) - 3 * j, "%02x ", data[i + j]);
+        }
+        snprintf(line, sizeof(line), "%04zx: %-18s %s\n", i, bytes, text);
+        print_to_screen(line);
+        i += len;
+    }
+    print_to_screen("\n");
+}
+
+// Assemble a source file into a program
+void cmd_asm(const char *src, const char *dst) {
+    File *f = find_file(src);
+    const uint8_t *text = f ? file_data(f) : NULL;
+    if (!text) {
+        print_to_screen("Error: File not found\n");
+        return;
+    }
+    
+    uint8_t *out = malloc(MEM_SIZE);
+    char error[128], msg[160];
+    long size = out ? assemble((const char *)text, f->size, out, error, sizeof(error)) : -1;
+    if (!out) snprintf(error, sizeof(error), "out of memory");
+    if (size < 0) {
+        snprintf(msg, sizeof(msg), "Error: %s\n", error);
+        print_to_screen(msg);
+    } else if (write_file(dst, out, (size_t)size) != 0) {
+        print_to_screen("Error: Could not write file\n");
+    } else {
+        snprintf(msg, sizeof(msg), "Assembled %ld bytes into %s\n", size, dst);
+        print_to_screen(msg);
+    }
+    free(out);
+}
+
 void add_to_history(const char *cmd) {
     if (history.count < MAX_HISTORY) {
         strncpy(history.commands[history.count], cmd, INPUT_BUFFER_SIZE - 1);
@@ -1753,7 +7299,6 @@ void cmd_touch(const char *filename) {
         screen.current_color = COLOR_BRIGHT_GREEN;
         print_to_screen("File created.\n");
         screen.current_color = COLOR_WHITE;
-        scan_filesystem();
     } else {
         screen.current_color = COLOR_BRIGHT_RED;
         print_to_screen("Error: Could not create file\n");
@@ -1761,6 +7306,86 @@ void cmd_touch(const char *filename) {
     }
 }
 
+void cmd_savestate(const char *filename) {
+    Snapshot *s = snapshot_take();
+    if (s && snapshot_save(s, filename) == 0) {
+        print_to_screen("State saved.\n");
+    } else {
+        print_to_screen("Error: Could not save state\n");
+    }
+    snapshot_free(s);
+}
+
+// Restore a saved state; a program that was running carries on
+void cmd_loadstate(const char *filename) {
+    Snapshot *s = snapshot_load(filename);
+    if (!s) {
+        print_to_screen("Error: Not a saved state\n");
+        return;
+    }
+    snapshot_restore(s);
+    snapshot_free(s);
+    if (cpu.running) {
+        run_program();
+        print_to_screen("Program terminated.\n");
+    }
+}
+
+// Compare two files. The status is 0 when they match, 1 when they
+// differ and 2 when one cannot be read.
+int cmd_cmp(const char *a, const char *b) {
+    File *fa = find_file(a);
+    const uint8_t *da = fa ? file_data(fa) : NULL;
+    size_t size_a = fa ? fa->size : 0;
+    File *fb = find_file(b);
+    const uint8_t *db = fb ? file_data(fb) : NULL;
+    if (!fa || !fb) {
+        print_to_screen("Error: File not found\n");
+        return 2;
+    }
+    if ((!da && size_a) || (!db && fb->size)) {
+        print_to_screen("Error: Could not read file\n");
+        return 2;
+    }
+
+    size_t common = size_a < fb->size ? size_a : fb->size;
+    size_t i = 0;
+    while (i < common && da[i] == db[i]) i++;
+    if (i == common && size_a == fb->size) {
+        print_to_screen("Files are identical\n");
+        return 0;
+    }
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Files differ at byte 0x%zx\n", i);
+    print_to_screen(msg);
+    return 1;
+}
+
+// The text screen, without trailing blanks, for scripts to keep or
+// compare what a program printed
+void cmd_screendump(void) {
+    char line[SCREEN_WIDTH + 2];
+    int rows = SCREEN_HEIGHT;
+    while (rows > 0) {
+        const char *row = text_row(rows - 1);
+        int x = 0;
+        while (x < SCREEN_WIDTH && row[x] == ' ') x++;
+        if (x < SCREEN_WIDTH) break;
+        rows--;
+    }
+    for (int y = 0; y < rows; y++) {
+        const char *row = text_row(y);
+        int len = SCREEN_WIDTH;
+        while (len > 0 && row[len - 1] == ' ') len--;
+        for (int x = 0; x < len; x++) {
+            line[x] = row[x] >= 32 && row[x] < 127 ? row[x] : '.';
+        }
+        line[len] = '\n';
+        line[len + 1] = '\0';
+        print_to_screen(line);
+    }
+}
+
 void cmd_banner(const char *text) {
     if (!text || strlen(text) == 0) {
         print_to_screen("Usage: banner <text>\n");
@@ -1818,12 +7443,12 @@ void cmd_matrix(void) {
         for (int x = 0; x < SCREEN_WIDTH; x++) {
             if (rand() % 3 == 0) {
                 int y = rand() % SCREEN_HEIGHT;
-                screen.chars[y][x] = 33 + rand() % 94;
-                screen.colors[y][x] = COLOR_BRIGHT_GREEN;
-                screen.dirty = 1;
+                text_row(y)[x] = 33 + rand() % 94;
+                color_row(y)[x] = COLOR_BRIGHT_GREEN;
+                damage_text(y, x, x + 1);
             }
         }
-        sleep_ms(30);
+        yield_ms(30);
     }
     
     screen.current_color = COLOR_WHITE;
@@ -1863,7 +7488,7 @@ void cmd_starfield(void) {
         }
         
         screen.dirty = 1;
-        sleep_ms(50);
+        yield_ms(50);
     }
     
     clear_screen_display();
@@ -1908,11 +7533,330 @@ void print_prompt(void) {
     screen.current_color = COLOR_WHITE;
 }
 
+// Scripts. --script FILE runs shell commands from a host file (or
+// standard input) with no window, and "source FILE" runs them from a
+// file in fs/, in a script or in the window. Programs started by a
+// script run like headless ones: on the virtual clock with a fixed seed,
+// with no loading animation, each reported in one line that is the same
+// on every run.
+#define SHELL_EXIT          1
+#define SOURCE_MAX_DEPTH    8
+
+int shell_status = 0;       // of the last run or cmp, or set by exit N
+uint64_t script_max_cycles = UINT64_MAX;
+
+int shell_line(char *line);
+int shell_command(char *cmd);
+
+static int script_run(const char *filename) {
+    char msg[MAX_PATH_LEN + 96];
+    clear_screen_display();
+    init_cpu();
+    if (load_program(filename) != 0) {
+        print_to_screen("Error: Could not load program\n");
+        return 1;
+    }
+    os_mode = 0;
+    run_timed(script_max_cycles);
+    os_mode = 1;
+
+    uint32_t state = 0;
+    Snapshot *end = snapshot_take();
+    if (end) {
+        state = fnv1a(end->image, end->size);
+        snapshot_free(end);
+    }
+    snprintf(msg, sizeof(msg), "%s: %s after %llu instructions, state %08x\n", filename,
+             cpu.running ? "stopped at cycle limit" : "halted",
+             (unsigned long long)cpu.cycles, state);
+    print_to_screen(msg);
+    return cpu.running ? 2 : 0;
+}
+
+// One line of a script: blank lines and lines starting with # are skipped
+static int script_line(const char *text) {
+    char cmd[256];
+    while (isspace((unsigned char)*text)) text++;
+    if (!*text || *text == '#') return 0;
+
+    strncpy(cmd, text, sizeof(cmd) - 1);
+    cmd[sizeof(cmd) - 1] = '\0';
+    int len = (int)strlen(cmd);
+    while (len > 0 && isspace((unsigned char)cmd[len - 1])) {
+        cmd[--len] = '\0';
+    }
+    sync_filesystem();
+    return shell_line(cmd);
+}
+
+int cmd_source(const char *filename) {
+    static int depth;
+    File *f = find_file(filename);
+    const uint8_t *data = f ? file_data(f) : NULL;
+    if (!f) {
+        print_to_screen("Error: File not found\n");
+        return 0;
+    }
+    if (!data && f->size) {
+        print_to_screen("Error: Could not read file\n");
+        return 0;
+    }
+    if (depth == SOURCE_MAX_DEPTH) {
+        print_to_screen("Error: source nested too deeply\n");
+        return 0;
+    }
+    // The commands may rewrite the file, so run them from a copy
+    char *text = malloc(f->size + 1);
+    if (!text) {
+        print_to_screen("Error: Out of memory\n");
+        return 0;
+    }
+    memcpy(text, data, f->size);
+    text[f->size] = '\0';
+
+    int status = 0;
+    depth++;
+    for (char *line = text; line && status != SHELL_EXIT;) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        status = script_line(line);
+        line = next;
+    }
+    depth--;
+    free(text);
+    return status;
+}
+
+// Run the script at path, "-" for standard input. Each command's output
+// is collected and written to standard output in one piece when it
+// finishes. Returns the script's exit status.
+int run_script(const char *path) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Error: Could not open %s\n", path);
+        return 1;
+    }
+    ShellOutput out = {0};
+    char line[1024];
+    shell_out = &out;
+    while (fgets(line, sizeof(line), in)) {
+        int status = script_line(line);
+        fwrite(out.data, 1, out.len, stdout);
+        out.len = 0;
+        if (status == SHELL_EXIT) break;
+    }
+    shell_out = NULL;
+    free(out.data);
+    if (in != stdin) fclose(in);
+    fflush(stdout);
+    return shell_status;
+}
+
+// A command line with an optional "> FILE" or ">> FILE" after it: the
+// command's output is collected and written to FILE instead of shown
+int shell_line(char *line) {
+    char *redirect = strchr(line, '>');
+    if (!redirect) return shell_command(line);
+
+    int append = redirect[1] == '>';
+    char *target = strtok(redirect + 1 + append, " ");
+    char *end = redirect;
+    while (end > line && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    if (!target || !*line) {
+        print_to_screen("Usage: <command> > <filename>\n");
+        return 0;
+    }
+
+    ShellOutput out = {0}, *outer = shell_out;
+    File *f = append ? find_file(target) : NULL;
+    const uint8_t *data = f ? file_data(f) : NULL;
+    if (data) shell_append(&out, data, f->size);
+    shell_out = &out;
+    int status = shell_command(line);
+    shell_out = outer;
+    if (write_file(target, (const uint8_t *)(out.data ? out.data : ""), out.len) != 0) {
+        print_to_screen("Error: Could not write file\n");
+    }
+    free(out.data);
+    return status;
+}
+
+// Run one command line, already trimmed. Returns SHELL_EXIT for exit.
+int shell_command(char *cmd) {
+    char *token = strtok(cmd, " ");
+    if (!token) return 0;
+
+    
+    if (strcmp(token, "exit") == 0 || strcmp(token, "quit") == 0) {
+        char *code = strtok(NULL, " ");
+        if (code) shell_status = atoi(code);
+        screen.current_color = COLOR_BRIGHT_YELLOW;
+        print_to_screen("Goodbye!\n");
+        screen.current_color = COLOR_WHITE;
+        yield_ms(500);
+        return SHELL_EXIT;
+    } else if (strcmp(token, "help") == 0) {
+        cmd_help();
+    } else if (strcmp(token, "clear") == 0 || strcmp(token, "cls") == 0) {
+        clear_screen_display();
+    } else if (strcmp(token, "ls") == 0 || strcmp(token, "dir") == 0) {
+        cmd_ls();
+    } else if (strcmp(token, "sysinfo") == 0) {
+        cmd_sysinfo();
+    } else if (strcmp(token, "touch") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            cmd_touch(filename);
+        } else {
+            print_to_screen("Usage: touch <filename>\n");
+        }
+    } else if (strcmp(token, "savestate") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            cmd_savestate(filename);
+        } else {
+            print_to_screen("Usage: savestate <filename>\n");
+        }
+    } else if (strcmp(token, "loadstate") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            cmd_loadstate(filename);
+        } else {
+            print_to_screen("Usage: loadstate <filename>\n");
+        }
+    } else if (strcmp(token, "banner") == 0) {
+        char *text = strtok(NULL, "");
+        cmd_banner(text);
+    } else if (strcmp(token, "color") == 0) {
+        char *arg = strtok(NULL, " ");
+        cmd_color(arg);
+    } else if (strcmp(token, "matrix") == 0) {
+        cmd_matrix();
+    } else if (strcmp(token, "starfield") == 0) {
+        cmd_starfield();
+    } else if (strcmp(token, "about") == 0) {
+        cmd_about();
+    } else if (strcmp(token, "cat") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            cmd_cat(filename);
+        } else {
+            print_to_screen("Usage: cat <filename>\n");
+        }
+    } else if (strcmp(token, "rm") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            cmd_rm(filename);
+        } else {
+            print_to_screen("Usage: rm <filename>\n");
+        }
+    } else if (strcmp(token, "cp") == 0) {
+        char *src = strtok(NULL, " ");
+        char *dst = strtok(NULL, " ");
+        if (src && dst) {
+            cmd_cp(src, dst);
+        } else {
+            print_to_screen("Usage: cp <source> <destination>\n");
+        }
+    } else if (strcmp(token, "mv") == 0) {
+        char *src = strtok(NULL, " ");
+        char *dst = strtok(NULL, " ");
+        if (src && dst) {
+            cmd_mv(src, dst);
+        } else {
+            print_to_screen("Usage: mv <source> <destination>\n");
+        }
+    } else if (strcmp(token, "echo") == 0) {
+        char *text = strtok(NULL, "");
+        if (text) {
+            print_to_screen(text);
+            putchar_screen('\n');
+        } else {
+            putchar_screen('\n');
+        }
+    } else if (strcmp(token, "date") == 0) {
+        cmd_date();
+    } else if (strcmp(token, "uptime") == 0) {
+        cmd_uptime();
+    } else if (strcmp(token, "meminfo") == 0) {
+        cmd_meminfo();
+    } else if (strcmp(token, "hexdump") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            cmd_hexdump(filename);
+        } else {
+            print_to_screen("Usage: hexdump <filename>\n");
+        }
+    } else if (strcmp(token, "disasm") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            cmd_disasm(filename);
+        } else {
+            print_to_screen("Usage: disasm <filename>\n");
+        }
+    } else if (strcmp(token, "asm") == 0) {
+        char *src = strtok(NULL, " ");
+        char *dst = strtok(NULL, " ");
+        if (src && dst) {
+            cmd_asm(src, dst);
+        } else {
+            print_to_screen("Usage: asm <source> <output>\n");
+        }
+    } else if (strcmp(token, "cmp") == 0) {
+        char *a = strtok(NULL, " ");
+        char *b = strtok(NULL, " ");
+        if (a && b) {
+            shell_status = cmd_cmp(a, b);
+        } else {
+            print_to_screen("Usage: cmp <file1> <file2>\n");
+        }
+    } else if (strcmp(token, "source") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename) {
+            if (cmd_source(filename) == SHELL_EXIT) return SHELL_EXIT;
+        } else {
+            print_to_screen("Usage: source <filename>\n");
+        }
+    } else if (strcmp(token, "screendump") == 0) {
+        cmd_screendump();
+    } else if (strcmp(token, "history") == 0) {
+        cmd_history();
+    } else if (strcmp(token, "run") == 0) {
+        char *filename = strtok(NULL, " ");
+        if (filename && headless) {
+            shell_status = script_run(filename);
+        } else if (filename) {
+            init_cpu();
+            if (load_program(filename) == 0) {
+                show_loading_animation(filename);
+                print_to_screen("Running program...\n");
+                run_program();
+                print_to_screen("Program terminated.\n");
+            } else {
+                print_to_screen("Error: Could not load program\n");
+            }
+        } else {
+            print_to_screen("Usage: run <filename>\n");
+        }
+    } else {
+        screen.current_color = COLOR_BRIGHT_RED;
+        print_to_screen("Unknown command: ");
+        print_to_screen(token);
+        print_to_screen("\n");
+        screen.current_color = COLOR_YELLOW;
+        print_to_screen("Type 'help' for available commands.\n");
+        screen.current_color = COLOR_WHITE;
+    }
+    return 0;
+}
+
 void shell_loop(void) {
     char cmd[256];
     
     show_boot_animation();
-    clear_screen_display();
+    // A fast boot leaves its banner above the first prompt
+    if (boot_mode == BOOT_FULL) clear_screen_display();
     
     screen.current_color = COLOR_BRIGHT_CYAN;
     print_to_screen("MicroOS v1.0\n");
@@ -1925,6 +7869,7 @@ void shell_loop(void) {
         
         char *line = read_line_from_screen();
         if (!window_running) break;
+        sync_filesystem();
         
         strncpy(cmd, line, sizeof(cmd) - 1);
         cmd[sizeof(cmd) - 1] = '\0';
@@ -1938,145 +7883,161 @@ void shell_loop(void) {
         
         add_to_history(cmd);
         
-        char *token = strtok(cmd, " ");
-        if (!token) continue;
-        
-        if (strcmp(token, "exit") == 0 || strcmp(token, "quit") == 0) {
-            screen.current_color = COLOR_BRIGHT_YELLOW;
-            print_to_screen("Goodbye!\n");
-            screen.current_color = COLOR_WHITE;
-            sleep_us(500000);
-            break;
-        } else if (strcmp(token, "help") == 0) {
-            cmd_help();
-        } else if (strcmp(token, "clear") == 0 || strcmp(token, "cls") == 0) {
-            clear_screen_display();
-        } else if (strcmp(token, "ls") == 0 || strcmp(token, "dir") == 0) {
-            cmd_ls();
-        } else if (strcmp(token, "sysinfo") == 0) {
-            cmd_sysinfo();
-        } else if (strcmp(token, "touch") == 0) {
-            char *filename = strtok(NULL, " ");
-            if (filename) {
-                cmd_touch(filename);
-            } else {
-                print_to_screen("Usage: touch <filename>\n");
-            }
-        } else if (strcmp(token, "banner") == 0) {
-            char *text = strtok(NULL, "");
-            cmd_banner(text);
-        } else if (strcmp(token, "color") == 0) {
-            char *arg = strtok(NULL, " ");
-            cmd_color(arg);
-        } else if (strcmp(token, "matrix") == 0) {
-            cmd_matrix();
-        } else if (strcmp(token, "starfield") == 0) {
-            cmd_starfield();
-        } else if (strcmp(token, "about") == 0) {
-            cmd_about();
-        } else if (strcmp(token, "cat") == 0) {
-            char *filename = strtok(NULL, " ");
-            if (filename) {
-                cmd_cat(filename);
-            } else {
-                print_to_screen("Usage: cat <filename>\n");
-            }
-        } else if (strcmp(token, "rm") == 0) {
-            char *filename = strtok(NULL, " ");
-            if (filename) {
-                cmd_rm(filename);
-            } else {
-                print_to_screen("Usage: rm <filename>\n");
-            }
-        } else if (strcmp(token, "cp") == 0) {
-            char *src = strtok(NULL, " ");
-            char *dst = strtok(NULL, " ");
-            if (src && dst) {
-                cmd_cp(src, dst);
-            } else {
-                print_to_screen("Usage: cp <source> <destination>\n");
-            }
-        } else if (strcmp(token, "mv") == 0) {
-            char *src = strtok(NULL, " ");
-            char *dst = strtok(NULL, " ");
-            if (src && dst) {
-                cmd_mv(src, dst);
-            } else {
-                print_to_screen("Usage: mv <source> <destination>\n");
-            }
-        } else if (strcmp(token, "echo") == 0) {
-            char *text = strtok(NULL, "");
-            if (text) {
-                print_to_screen(text);
-                putchar_screen('\n');
-            } else {
-                putchar_screen('\n');
-            }
-        } else if (strcmp(token, "date") == 0) {
-            cmd_date();
-        } else if (strcmp(token, "uptime") == 0) {
-            cmd_uptime();
-        } else if (strcmp(token, "meminfo") == 0) {
-            cmd_meminfo();
-        } else if (strcmp(token, "hexdump") == 0) {
-            char *filename = strtok(NULL, " ");
-            if (filename) {
-                cmd_hexdump(filename);
-            } else {
-                print_to_screen("Usage: hexdump <filename>\n");
-            }
-        } else if (strcmp(token, "history") == 0) {
-            cmd_history();
-        } else if (strcmp(token, "run") == 0) {
-            char *filename = strtok(NULL, " ");
-            if (filename) {
-                init_cpu();
-                if (load_program(filename) == 0) {
-                    show_loading_animation(filename);
-                    print_to_screen("Running program...\n");
-                    run_program();
-                    print_to_screen("Program terminated.\n");
-                } else {
-                    print_to_screen("Error: Could not load program\n");
-                }
-            } else {
-                print_to_screen("Usage: run <filename>\n");
+        if (shell_line(cmd) == SHELL_EXIT) break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char **programs = calloc(argc, sizeof(char *));
+    const char *replay_path = NULL, *script_path = NULL, *start_state = NULL;
+    int program_count = 0, jobs = 0;
+    uint64_t max_cycles = UINT64_MAX;
+    // A deployment can set its default in the environment
+    const char *boot = getenv("MICROEMU_BOOT");
+    if (boot && set_boot_mode(boot) != 0) {
+        fprintf(stderr, "Warning: MICROEMU_BOOT takes full, fast or none\n");
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interp") == 0) {
+            cpu_engine = ENGINE_INTERP;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            cpu_engine = ENGINE_JIT;
+        } else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc) {
+            cpu_slice_cycles = (uint32_t)strtoul(argv[++i], NULL, 0);
+            if (cpu_slice_cycles == 0) cpu_slice_cycles = 1;
+        } else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc) {
+            cpu_clock_hz = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--scrollback") == 0 && i + 1 < argc) {
+            scrollback_lines = atoi(argv[++i]);
+            if (scrollback_lines < 0) scrollback_lines = 0;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = 1;
+        } else if (strcmp(argv[i], "--run") == 0 && i + 1 < argc) {
+            programs[program_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+            max_cycles = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--boot") == 0 && i + 1 < argc) {
+            if (set_boot_mode(argv[++i]) != 0) {
+                fprintf(stderr, "--boot takes full, fast or none\n");
+                return 1;
             }
+        } else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) {
+            start_state = argv[++i];
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+        } else if (strcmp(argv[i], "--export-shm") == 0 && i + 1 < argc) {
+            export_shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--export-port") == 0 && i + 1 < argc) {
+            export_address = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs <= 0) jobs = -1;   // as many as there are cores
+        } else if (argv[i][0] != '-' && programs) {
+            programs[program_count++] = argv[i];
         } else {
-            screen.current_color = COLOR_BRIGHT_RED;
-            print_to_screen("Unknown command: ");
-            print_to_screen(token);
-            print_to_screen("\n");
-            screen.current_color = COLOR_YELLOW;
-            print_to_screen("Type 'help' for available commands.\n");
-            screen.current_color = COLOR_WHITE;
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            fprintf(stderr, "Usage: %s [--interp | --jit] [--slice CYCLES] [--clock HZ] [--scrollback LINES] [--boot full|fast|none] [--profile FILE] [--record FILE]\n"
+                            "       %s --headless [--jobs N] [--max-cycles N] [--state FILE] [--interp | --jit] [--profile FILE] PROGRAM...\n"
+                            "       %s --replay FILE [--interp | --jit]\n"
+                            "       %s --script FILE [--max-cycles N] [--interp | --jit]\n"
+                            "Any of these also take --export-shm NAME and --export-port [ADDR:]PORT\n",
+                    argv[0], argv[0], argv[0], argv[0]);
+            return 1;
         }
     }
-}
+    if (replay_path || script_path) {
+        if (headless || program_count || profile_path || record_path || (replay_path && script_path)) {
+            fprintf(stderr, replay_path ? "--replay runs the trace on its own\n" :
+                                          "--script runs the script on its own\n");
+            return 1;
+        }
+        headless = 1;
+        script_max_cycles = max_cycles;
+    } else if (headless != (program_count > 0)) {
+        fprintf(stderr, "--headless runs the programs named on the command line, and needs at least one\n");
+        return 1;
+    }
+    if (start_state && !program_count) {
+        fprintf(stderr, "--state starts the programs named on the command line\n");
+        return 1;
+    }
+    if (record_path && headless) {
+        fprintf(stderr, "--record records programs run in the window\n");
+        return 1;
+    }
+    if (profile_path && (jobs || program_count > 1)) {
+        fprintf(stderr, "--profile profiles a single program\n");
+        return 1;
+    }
+
+    if (cpu_engine == ENGINE_JIT && jit_init() != 0) {
+        fprintf(stderr, "JIT not available on this platform, using predecoded engine\n");
+        cpu_engine = ENGINE_PREDECODE;
+    }
 
-int main(int argc, char *argv[]) {
-    (void)argc;
-    (void)argv;
-    
 #ifdef _WIN32
     WSADATA wsa;
     WSAStartup(MAKEWORD(2,2), &wsa);
 #endif
+    if ((export_shm_name || export_address) && export_start() != 0) return 1;
     
     srand(time(NULL));
+    main_machine.rand_state = (uint32_t)time(NULL);
     boot_time = time(NULL);
     
     pthread_mutex_init(&input_buf.mutex, NULL);
+    pthread_cond_init(&input_buf.changed, NULL);
     input_buf.pos = 0;
     input_buf.ready = 0;
-    input_buf.char_ready = 0;
+    input_buf.key_count = 0;
+    init_renderer_wake();
     
     memset(&history, 0, sizeof(History));
     
     init_screen();
+    // Pool workers export their own machines
+    if (!headless || replay_path || script_path || (!jobs && program_count == 1)) {
+        export_attach(0);
+    }
+    present_screen();
     init_filesystem();
     init_cpu();
     
+    if (headless) {
+        scan_filesystem();
+        // Programs start from the saved machine instead of a blank one
+        if (start_state) {
+            Snapshot *s = snapshot_load(start_state);
+            if (!s) {
+                fprintf(stderr, "Error: Could not load state %s\n", start_state);
+                return 1;
+            }
+            snapshot_restore(s);
+            snapshot_free(s);
+            cpu.cycles = 0;
+        }
+        int status = script_path ? run_script(script_path) :
+                     replay_path ? run_replay(replay_path) :
+                     jobs || program_count > 1 ?
+                     run_pool(programs, program_count, jobs, max_cycles) :
+                     run_headless(programs[0], max_cycles);
+        free(programs);
+        export_finish();
+        flush_writes();
+        pthread_cond_destroy(&input_buf.changed);
+        pthread_mutex_destroy(&input_buf.mutex);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return status;
+    }
+    
     printf("MicroComputer Emulator v1.0\n");
     printf("===========================\n");
     printf("Filesystem: %s\n", fs.root_dir);
@@ -2089,12 +8050,22 @@ int main(int argc, char *argv[]) {
     pthread_t thread;
     pthread_create(&thread, NULL, window_thread, NULL);
     
-    sleep_ms(1000);
+    // The full boot animation waits to be seen
+    if (boot_mode == BOOT_FULL) {
+        pthread_mutex_lock(&input_buf.mutex);
+        wait_for_input(&input_buf.window_shown);
+        pthread_mutex_unlock(&input_buf.mutex);
+    }
     
-    shell_loop();
+    free(programs);
+    if (window_running) shell_loop();
+    export_finish();
+    flush_writes();
     
     window_running = 0;
+    wake_renderer();
     pthread_join(thread, NULL);
+    pthread_cond_destroy(&input_buf.changed);
     pthread_mutex_destroy(&input_buf.mutex);
     
 #ifdef _WIN32
@@ -0,0 +1,111 @@
+// MicroComputer instruction set
+// The one description of every opcode, shared by the emulator and the
+// program generators in fs/. Each row of OPCODE_TABLE is
+//
+//     X(name, value, operands, length, cycles)
+//
+// operands lists the fields after the opcode byte, one letter each:
+//     r  register number (one byte, 0-7)
+//     b  byte immediate
+//     w  16-bit little-endian immediate
+//     a  16-bit little-endian address
+//     s  null-terminated string
+// length is the whole instruction in bytes (for PRINT_STR, with an empty
+// string) and cycles its cost to the scheduler. Every engine charges
+// cpu.cycles, and so the slice budget, --max-cycles, the virtual clock and
+// the profiler, from this column; for now every instruction costs one.
+//
+// Users expand the table with their own X to get what they need; the
+// expansions below give the OP_*, OPLEN_* and OPCYC_* constants and
+// opcode_info[].
+
+#ifndef MICROCOMPUTER_OPCODES_H
+#define MICROCOMPUTER_OPCODES_H
+
+#include <stdint.h>
+
+#define OPCODE_TABLE(X) \
+    X(HALT,            0x00, "",       1,  1) \
+    X(PRINT_CHAR,      0x01, "b",      2,  1) \
+    X(PRINT_STR,       0x02, "s",      2,  1) \
+    X(CLEAR_SCREEN,    0x04, "",       1,  1) \
+    X(SET_COLOR,       0x05, "b",      2,  1) \
+    X(GET_CURSOR,      0x06, "rr",     3,  1) \
+    X(SET_CURSOR,      0x07, "bb",     3,  1) \
+    X(DRAW_LINE,       0x08, "wwww",   9,  1) \
+    X(DRAW_RECT,       0x09, "wwww",   9,  1) \
+    X(FILL_RECT,       0x0A, "wwww",   9,  1) \
+    X(DRAW_CIRCLE,     0x0B, "www",    7,  1) \
+    X(SLEEP_MS,        0x20, "w",      3,  1) \
+    X(BEEP,            0x21, "ww",     5,  1) \
+    X(GET_TIME,        0x22, "r",      2,  1) \
+    X(RANDOM,          0x23, "rw",     4,  1) \
+    X(TONE,            0x24, "bwwb",   7,  1) \
+    X(GET_TIME_MS,     0x25, "r",      2,  1) \
+    X(SET_PIXEL,       0x30, "wwb",    6,  1) \
+    X(CLEAR_PIXELS,    0x31, "",       1,  1) \
+    X(DRAW_SPRITE,     0x32, "awwbbb", 10, 1) \
+    X(PIXEL_DEPTH,     0x33, "b",      2,  1) \
+    X(DRAW_SPRITE_REG, 0x34, "arrbbb", 8,  1) \
+    X(LOAD_REG,        0x40, "rw",     4,  1) \
+    X(STORE_REG,       0x41, "ra",     4,  1) \
+    X(PUSH,            0x42, "r",      2,  1) \
+    X(POP,             0x43, "r",      2,  1) \
+    X(ADD,             0x50, "rrr",    4,  1) \
+    X(SUB,             0x51, "rrr",    4,  1) \
+    X(MUL,             0x52, "rrr",    4,  1) \
+    X(DIV,             0x53, "rrr",    4,  1) \
+    X(MOD,             0x54, "rrr",    4,  1) \
+    X(AND,             0x55, "rrr",    4,  1) \
+    X(OR,              0x56, "rrr",    4,  1) \
+    X(XOR,             0x57, "rrr",    4,  1) \
+    X(NOT,             0x58, "rr",     3,  1) \
+    X(SHL,             0x59, "rr",     3,  1) \
+    X(SHR,             0x5A, "rr",     3,  1) \
+    X(CMP,             0x5B, "rr",     3,  1) \
+    X(ADDI,            0x5C, "rw",     4,  1) \
+    X(CMPI,            0x5D, "rw",     4,  1) \
+    X(JMP,             0x60, "a",      3,  1) \
+    X(JZ,              0x61, "a",      3,  1) \
+    X(JNZ,             0x62, "a",      3,  1) \
+    X(JG,              0x63, "a",      3,  1) \
+    X(JL,              0x64, "a",      3,  1) \
+    X(CALL,            0x65, "a",      3,  1) \
+    X(RET,             0x66, "",       1,  1) \
+    X(DJNZ,            0x67, "ra",     4,  1) \
+    X(CJNE,            0x68, "rwa",    6,  1) \
+    X(READ_CHAR,       0x70, "r",      2,  1) \
+    X(KEY_PRESSED,     0x71, "r",      2,  1) \
+    X(LOAD_MEM,        0x80, "ra",     4,  1) \
+    X(STORE_MEM,       0x81, "ar",     4,  1) \
+    X(COPY_MEM,        0x82, "aaw",    7,  1) \
+    X(LOAD_IDX,        0x83, "rar",    5,  1) \
+    X(STORE_IDX,       0x84, "arr",    5,  1) \
+    X(FILL_MEM,        0x85, "awb",    6,  1) \
+    X(CMP_MEM,         0x86, "aaw",    7,  1) \
+    X(FIND_BYTE,       0x87, "rawb",   7,  1) \
+    X(ADD_MEM,         0x88, "awb",    6,  1) \
+    X(XOR_MEM,         0x89, "awb",    6,  1) \
+    X(SET_BANK,        0x8A, "br",     3,  1) \
+    X(GET_BANK,        0x8B, "rb",     3,  1)
+
+#define OPCODE_VALUE(name, value, operands, length, cycles)  OP_##name = value,
+#define OPCODE_LENGTH(name, value, operands, length, cycles) OPLEN_##name = length,
+#define OPCODE_CYCLES(name, value, operands, length, cycles) OPCYC_##name = cycles,
+#define OPCODE_INFO(name, value, operands, length, cycles) \
+    [value] = { #name, operands, length, cycles },
+
+enum { OPCODE_TABLE(OPCODE_VALUE) };
+enum { OPCODE_TABLE(OPCODE_LENGTH) };
+enum { OPCODE_TABLE(OPCODE_CYCLES) };
+
+typedef struct {
+    const char *name;       // NULL for unassigned opcodes
+    const char *operands;
+    uint8_t length;
+    uint8_t cycles;
+} OpcodeInfo;
+
+static const OpcodeInfo opcode_info[256] = { OPCODE_TABLE(OPCODE_INFO) };
+
+#endif